@@ -7,6 +7,7 @@ LOCAL_SRC_FILES := ../../pslr_enum.c \
 	../../pslr_lens.c \
 	../../pslr_model.c \
 	../../pslr_scsi.c \
+	../../pslr_virtual.c \
 	../../pslr.c \
 	../../pktriggercord-servermode.c \
 	../../pktriggercord-cli.c
@@ -49,12 +49,21 @@ typedef struct sg_io_hdr {
     unsigned int info;          /* [o] auxiliary information */
 } sg_io_hdr_t;
 
+#define SG_DXFER_NONE       -1
 #define SG_DXFER_TO_DEV     -2
 #define SG_DXFER_FROM_DEV   -3
 
 /* synchronous SCSI command ioctl, (only in version 3 interface) */
 #define SG_IO 0x2285   /* similar effect as write() followed by read() */
 
+#define SG_SET_COMMAND_Q 0x2271 /* 0 -> one command at a time */
+#define SG_SET_FORCE_PACK_ID 0x227b /* read() returns the given pack_id */
+#define SG_GET_VERSION_NUM 0x2282 /* e.g. 30536 for 3.5.36 */
+#define SG_GET_RESERVED_SIZE 0x2272
+#define SG_SET_RESERVED_SIZE 0x2275 /* the buffer mmap() maps */
+
+#define SG_FLAG_MMAP_IO 4 /* data in the mmap-ed reserved buffer */
+
 /* The following 'info' values are "or"-ed together.  */
 #define SG_INFO_OK_MASK 0x1
 #define SG_INFO_OK      0x0 /* no sense, host nor driver "noise" */
@@ -50,6 +50,9 @@
 #define FILE_ACCESS O_WRONLY | O_CREAT | O_TRUNC
 #endif
 
+#define PIPELINE_BUFFERS 16 /* bits of the buffer mask */
+#define PIPELINE_TIMEOUT 60 /* sec to wait for a triggered frame */
+
 extern char *optarg;
 extern int optind, opterr, optopt;
 bool debug = false;
@@ -105,14 +108,33 @@ static struct option const longopts[] = {
     {"settings_hex", no_argument, NULL, 28},
     {"dump_memory", required_argument, NULL, 29},
     {"settings", no_argument, NULL, 'S'},
+    {"pipelined", required_argument, NULL, 30},
+    {"fast_shutter", no_argument, NULL, 31},
+    {"mapped_download", no_argument, NULL, 32},
+    {"trace_file", required_argument, NULL, 33},
+    {"probe_block_size", no_argument, NULL, 34},
+    {"sync_devices", required_argument, NULL, 35},
+    {"queued_commands", no_argument, NULL, 36},
     { NULL, 0, NULL, 0}
 };
 
+static int write_buffer_block(const uint8_t *buf, uint32_t bytes, uintptr_t fd) {
+    ssize_t r = write(fd, buf, bytes);
+    if (r == 0) {
+        DPRINT("write(buf): Nothing has been written to buf.\n");
+    } else if (r == -1) {
+        perror("write(buf)");
+        return 1;
+    } else if (r < bytes) {
+        DPRINT("write(buf): only write %d bytes, should be %d bytes.\n", r, bytes);
+    }
+    return 0;
+}
+
+/* returns 1 while the buffer cannot be opened, -1 if the download failed */
 int save_buffer(pslr_handle_t camhandle, int bufno, int fd, pslr_status *status, user_file_format filefmt, int jpeg_stars) {
     pslr_buffer_type imagetype;
-    uint8_t buf[65536];
     uint32_t length;
-    uint32_t current;
 
     if (filefmt == USER_FILE_FORMAT_PEF) {
         imagetype = PSLR_BUF_PEF;
@@ -130,23 +152,11 @@ int save_buffer(pslr_handle_t camhandle, int bufno, int fd, pslr_status *status,
 
     length = pslr_buffer_get_size(camhandle);
     DPRINT("Buffer length: %d\n", length);
-    current = 0;
 
-    while (true) {
-        uint32_t bytes;
-        bytes = pslr_buffer_read(camhandle, buf, sizeof (buf));
-        if (bytes == 0) {
-            break;
-        }
-        ssize_t r = write(fd, buf, bytes);
-        if (r == 0) {
-            DPRINT("write(buf): Nothing has been written to buf.\n");
-        } else if (r == -1) {
-            perror("write(buf)");
-        } else if (r < bytes) {
-            DPRINT("write(buf): only write %d bytes, should be %d bytes.\n", r, bytes);
-        }
-        current += bytes;
+    if (pslr_buffer_save(camhandle, write_buffer_block, fd) != PSLR_OK) {
+        fprintf(stderr, "Download of buffer %d failed\n", bufno);
+        pslr_buffer_close(camhandle);
+        return -1;
     }
     pslr_buffer_close(camhandle);
     return 0;
@@ -197,6 +207,7 @@ Shoot a Pentax DSLR and send the picture to standard output.\n\
 \n\
       --model=CAMERA_MODEL              valid values are: K20d, K10d, GX10, GX20, K-x, K200D, K-7, K-r, K-5, K-2000, K-m, K-30, K100D, K110D, K-01, K-3, K-3II, K-500\n\
       --device=DEVICE                   valid values for Linux: sg0, sg1, ..., for Windows: C, D, E, ...\n\
+                                        virtual[:MODEL[:LATENCY_US[:BYTES_PER_SEC[:IMAGE_BYTES[:CAPTURE_US]]]]] for a simulated camera\n\
       --timeout=SECONDS                 timeout for camera connection ( 0 means forever )\n\
   -w, --warnings                        warning mode on\n\
       --nowarnings                      warning mode off\n\
@@ -232,6 +243,13 @@ Shoot a Pentax DSLR and send the picture to standard output.\n\
       --dust_removal                    dust removal\n\
   -F, --frames=NUMBER                   number of frames\n\
   -d, --delay=SECONDS                   delay between the frames (seconds)\n\
+      --pipelined=DEPTH                 shoot the next frame while up to DEPTH earlier frames are still on the camera\n\
+      --fast_shutter                    press the shutter without reading the camera status first\n\
+      --mapped_download                 download into the mapped SCSI buffer, without copying it\n\
+      --queued_commands                 request the next download block while the current one is read\n\
+      --probe_block_size                try download blocks up to 1 MiB instead of 64 KiB\n\
+      --sync_devices=DEVICE,DEVICE...   fire the cameras together and print the shutter skew, -f focuses and locks AE first\n\
+      --trace_file=FILE                 write the last SCSI transactions to FILE on errors and at exit\n\
       --file_format=FORMAT              valid values: PEF, DNG, JPEG\n\
   -o, --output_file=FILE                send output to FILE instead of stdout\n\
       --debug                           turn on debug messages\n\
@@ -329,6 +347,203 @@ void bulb_new(pslr_handle_t camhandle, pslr_rational_t shutter_speed) {
     pslr_shutter(camhandle);
 }
 
+/* with one push bracketing the first press takes the whole set,
+   the later frames of the set only wait */
+void take_picture(pslr_handle_t camhandle, pslr_status *status, pslr_rational_t shutter_speed, struct timeval prev_time,
+                  bool one_push_bracket_continued) {
+    if ( status->exposure_mode ==  PSLR_GUI_EXPOSURE_MODE_B ) {
+        if (pslr_get_model_old_bulb_mode(camhandle)) {
+            bulb_old(camhandle, shutter_speed, prev_time);
+        } else {
+            bulb_new(camhandle, shutter_speed);
+        }
+    } else {
+        DPRINT("not bulb\n");
+        if (!one_push_bracket_continued) {
+            pslr_shutter(camhandle);
+        } else {
+            // TODO: fix waiting time
+            sleep_sec(1);
+        }
+    }
+}
+
+/* Frames of a pipelined capture, mapped to the camera buffers they show
+   up in. Buffers already in use when the capture starts are left alone. */
+typedef struct {
+    int depth;                          /* frames allowed on the camera */
+    uint16_t known;                     /* buffers mapped or not ours */
+    int buffer_frame[PIPELINE_BUFFERS]; /* -1 if not one of our frames */
+    int shot;
+    int assigned;
+    int saved;
+    int failed;                         /* downloads that failed, left on the camera */
+} pipeline_t;
+
+static void pipeline_update(pslr_handle_t camhandle, pipeline_t *pl, pslr_status *status) {
+    uint16_t new_buffers;
+    int i;
+
+    if ( pslr_get_status(camhandle, status) != PSLR_OK ) {
+        return;
+    }
+    new_buffers = status->bufmask & ~pl->known;
+    for ( i = 0; i < PIPELINE_BUFFERS && new_buffers; ++i ) {
+        if ( new_buffers & (1 << i) ) {
+            new_buffers &= ~(1 << i);
+            pl->known |= 1 << i;
+            if ( pl->assigned < pl->shot ) {
+                pl->buffer_frame[i] = pl->assigned++;
+                DPRINT("frame %d in buffer %d\n", pl->buffer_frame[i], i);
+            }
+        }
+    }
+}
+
+/* downloads and deletes the oldest frame on the camera, returns false if there is none */
+static bool pipeline_save_oldest(pslr_handle_t camhandle, pipeline_t *pl, pslr_status *status,
+                                 char *output_file, user_file_format_t ufft, user_file_format uff, int quality) {
+    int bufno = -1;
+    int fd;
+    int i;
+    int ret;
+
+    for ( i = 0; i < PIPELINE_BUFFERS; ++i ) {
+        if ( pl->buffer_frame[i] >= 0 && (bufno < 0 || pl->buffer_frame[i] < pl->buffer_frame[bufno]) ) {
+            bufno = i;
+        }
+    }
+    if ( bufno < 0 ) {
+        return false;
+    }
+    fd = open_file(output_file, pl->buffer_frame[bufno], ufft);
+    while ( (ret = save_buffer(camhandle, bufno, fd, status, uff, quality)) > 0 ) {
+        usleep(10000);
+    }
+    if (fd != 1) {
+        close(fd);
+    }
+    pl->buffer_frame[bufno] = -1;
+    if ( ret == 0 ) {
+        pslr_delete_buffer(camhandle, bufno);
+        pl->known &= ~(1 << bufno);
+    } else {
+        ++pl->failed;
+    }
+    ++pl->saved;
+    return true;
+}
+
+/* Triggers the next frame as soon as the delay has passed and fewer than
+   depth frames wait on the camera; downloads run in the meantime.
+   Returns the number of frames that could not be downloaded. */
+int pipelined_capture(pslr_handle_t camhandle, int frames, double delay, int depth,
+                       char *output_file, user_file_format_t ufft, user_file_format uff, int quality,
+                       pslr_rational_t shutter_speed) {
+    pipeline_t pl;
+    pslr_status status;
+    struct timeval prev_time;
+    struct timeval current_time;
+    struct timeval progress_time;
+    double save_sec = 0; /* duration of the last download */
+    double time_left;
+    int i;
+
+    memset(&pl, 0, sizeof (pl));
+    pl.depth = depth;
+    for ( i = 0; i < PIPELINE_BUFFERS; ++i ) {
+        pl.buffer_frame[i] = -1;
+    }
+    pslr_get_status(camhandle, &status);
+    pl.known = status.bufmask;
+    gettimeofday(&progress_time, NULL);
+
+    while ( pl.saved < pl.shot || pl.shot < frames ) {
+        gettimeofday(&current_time, NULL);
+        if ( pl.shot < frames && pl.shot - pl.saved < pl.depth &&
+                (pl.shot == 0 || timeval_diff(&current_time, &prev_time) >= delay * 1000000.0) ) {
+            if ( frames > 1 ) {
+                printf("Taking picture %d/%d\n", pl.shot+1, frames);
+                fflush(stdout);
+            }
+            prev_time = current_time;
+            progress_time = current_time;
+            take_picture(camhandle, &status, shutter_speed, prev_time, false);
+            ++pl.shot;
+            continue;
+        }
+        pipeline_update(camhandle, &pl, &status);
+        /* do not let a download delay the next frame while there is a free slot */
+        time_left = delay - timeval_diff(&current_time, &prev_time) / 1000000.0;
+        if ( pl.shot < frames && pl.shot - pl.saved < pl.depth && (save_sec == 0 || save_sec > time_left) ) {
+            usleep(time_left > 0.01 ? 10000 : 1000);
+            continue;
+        }
+        if ( pipeline_save_oldest(camhandle, &pl, &status, output_file, ufft, uff, quality) ) {
+            gettimeofday(&progress_time, NULL);
+            save_sec = timeval_diff(&progress_time, &current_time) / 1000000.0;
+            continue;
+        }
+        if ( timeval_diff(&current_time, &progress_time) / 1000000.0 >= PIPELINE_TIMEOUT ) {
+            fprintf(stderr, "No new image for %d sec, %d frames lost\n", PIPELINE_TIMEOUT, pl.shot - pl.saved);
+            return pl.failed + pl.shot - pl.saved;
+        }
+        usleep(10000);
+    }
+    return pl.failed;
+}
+
+/* Fires the comma separated devices together and prints how far the
+   shutter commands of the cameras were apart. The images stay on the
+   cameras. Returns the number of failed triggers. */
+int sync_capture(char *devices, bool arm, int frames, double delay) {
+    char *device_list[PIPELINE_BUFFERS];
+    pslr_sync_result_t results[PIPELINE_BUFFERS];
+    pslr_sync_group_t *group;
+    char *saveptr;
+    char *device;
+    int count = 0;
+    int failed = 0;
+    int frame;
+    int i;
+
+    for ( device = strtok_r(devices, ",", &saveptr); device; device = strtok_r(NULL, ",", &saveptr) ) {
+        if ( count == PIPELINE_BUFFERS ) {
+            fprintf(stderr, "At most %d devices can be synchronized\n", PIPELINE_BUFFERS);
+            return frames;
+        }
+        device_list[count++] = device;
+    }
+    if ( !(group = pslr_sync_open(device_list, count)) ) {
+        fprintf(stderr, "Cannot connect to all of the cameras\n");
+        return frames;
+    }
+    if ( arm ) {
+        pslr_sync_arm(group, true);
+    }
+    for ( frame = 0; frame < frames; ++frame ) {
+        if ( frame > 0 && delay > 0 ) {
+            sleep_sec(delay);
+        }
+        if ( pslr_sync_shutter(group, results) != PSLR_OK ) {
+            ++failed;
+        }
+        for ( i = 0; i < count; ++i ) {
+            if ( results[i].result != PSLR_OK ) {
+                printf("frame %d %s: error %d\n", frame + 1, device_list[i], results[i].result);
+            } else {
+                printf("frame %d %s: skew %d us, accepted after %u us\n", frame + 1, device_list[i],
+                       results[i].skew_usec, results[i].accept_usec);
+            }
+        }
+    }
+    if ( arm ) {
+        pslr_sync_arm(group, false);
+    }
+    pslr_sync_close(group);
+    return failed;
+}
+
 int main(int argc, char **argv) {
     float F = 0;
     char C;
@@ -354,7 +569,8 @@ int main(int argc, char **argv) {
     uint32_t auto_iso_min = 0;
     uint32_t auto_iso_max = 0;
     int frames = 1;
-    int delay = 0;
+    double delay = 0;
+    int pipeline_depth = 0;
     int timeout = 0;
     bool auto_focus = false;
     bool green = false;
@@ -379,6 +595,14 @@ int main(int argc, char **argv) {
     struct timeval prev_time;
     struct timeval current_time;
     bool noshutter = false;
+    bool fast_shutter = false;
+    bool mapped_download = false;
+    bool queued_commands = false;
+    char *trace_file = NULL;
+    bool probe_block_size = false;
+    char *sync_devices = NULL;
+    bool download_failed = false;
+    int ret;
 #ifndef WIN32
     bool servermode = false;
     int servermode_timeout = 30;
@@ -647,7 +871,7 @@ int main(int argc, char **argv) {
                 break;
 
             case 'd':
-                delay = atoi(optarg);
+                delay = atof(optarg);
                 if (!delay) {
                     warning_message("%s: Invalid delay value\n", argv[0]);
                 }
@@ -736,6 +960,38 @@ int main(int argc, char **argv) {
                 }
                 DPRINT("DUMP_MEMORY_SIZE: %u\n",dump_memory_size);
                 break;
+
+            case 31:
+                fast_shutter = true;
+                break;
+
+            case 32:
+                mapped_download = true;
+                break;
+
+            case 33:
+                trace_file = optarg;
+                break;
+
+            case 34:
+                probe_block_size = true;
+                break;
+
+            case 35:
+                sync_devices = optarg;
+                break;
+
+            case 36:
+                queued_commands = true;
+                break;
+
+            case 30:
+                pipeline_depth = atoi(optarg);
+                if (pipeline_depth < 1 || pipeline_depth > PIPELINE_BUFFERS) {
+                    warning_message("%s: Invalid pipeline depth\n", argv[0]);
+                    pipeline_depth = 0;
+                }
+                break;
         }
     }
 
@@ -747,6 +1003,11 @@ int main(int argc, char **argv) {
     }
 #endif
 
+    if ( sync_devices ) {
+        ret = sync_capture(sync_devices, auto_focus, frames, delay);
+        exit(ret ? -1 : 0);
+    }
+
     if (!output_file && frames > 1) {
         fprintf(stderr, "Should specify output filename if frames>1\n");
         exit(-1);
@@ -765,6 +1026,15 @@ int main(int argc, char **argv) {
 
     camera_name = pslr_camera_name(camhandle);
     printf("%s: %s Connected...\n", argv[0], camera_name);
+    pslr_set_fast_shutter(camhandle, fast_shutter);
+    if (mapped_download && pslr_set_mapped_download(camhandle, true) != PSLR_OK) {
+        warning_message("%s: Mapped download is not supported by the device\n", argv[0]);
+    }
+    if (queued_commands && pslr_set_queued_commands(camhandle, true) != PSLR_OK) {
+        warning_message("%s: Queued commands are not supported by the device\n", argv[0]);
+    }
+    pslr_set_trace_file(camhandle, trace_file);
+    pslr_set_block_size_probe(camhandle, probe_block_size);
 
     if ( dump_memory_size > 0 ) {
         int dfd = open(DUMP_FILE_NAME, FILE_ACCESS, 0664);
@@ -961,7 +1231,9 @@ int main(int argc, char **argv) {
     }
 
     // read the status after setting the values
-    pslr_read_settings(camhandle);
+    if ( settings_hex ) {
+        pslr_read_all_settings(camhandle);
+    }
     pslr_get_settings(camhandle, &settings);
     pslr_get_status(camhandle, &status);
 
@@ -1012,15 +1284,36 @@ int main(int argc, char **argv) {
                       status.drive_mode == PSLR_DRIVE_MODE_CONTINUOUS_LO;
     DPRINT("cont: %d\n", continuous);
 
+    if ( pipeline_depth > 0 ) {
+        if ( bracket_count > 1 || noshutter || reconnect ) {
+            warning_message("%s: --pipelined is ignored with bracketing, --noshutter and --reconnect\n", argv[0]);
+        } else {
+            ret = pipelined_capture(camhandle, frames, delay, pipeline_depth, output_file, ufft, uff, quality, shutter_speed);
+            if (trace_file) {
+                pslr_trace_dump(camhandle, trace_file);
+            }
+            camera_close(camhandle);
+            exit(ret ? -1 : 0);
+        }
+    }
+
     for (frameNo = 0; frameNo < frames; ++frameNo) {
         gettimeofday(&current_time, NULL);
         if ( bracket_count <= bracket_index ) {
             if ( reconnect ) {
-                camera_close( camhandle );
-                while (!(camhandle = pslr_init( model, device ))) {
-                    sleep_sec(1);
+                if (trace_file) {
+                    pslr_trace_dump(camhandle, trace_file);
                 }
+                camera_close( camhandle );
+                int hotplug_fd = pslr_hotplug_open();
+                camhandle = pslr_init_wait( model, device, hotplug_fd, -1 );
+                pslr_hotplug_close(hotplug_fd);
                 pslr_connect(camhandle);
+                pslr_set_fast_shutter(camhandle, fast_shutter);
+                pslr_set_mapped_download(camhandle, mapped_download);
+                pslr_set_queued_commands(camhandle, queued_commands);
+                pslr_set_trace_file(camhandle, trace_file);
+                pslr_set_block_size_probe(camhandle, probe_block_size);
             }
             waitsec = 1.0 * delay - timeval_diff(&current_time, &prev_time) / 1000000.0;
             if ( waitsec > 0 ) {
@@ -1053,21 +1346,8 @@ int main(int argc, char **argv) {
                 printf("Taking picture %d/%d\n", frameNo+1, frames);
                 fflush(stdout);
             }
-            if ( status.exposure_mode ==  PSLR_GUI_EXPOSURE_MODE_B ) {
-                if (pslr_get_model_old_bulb_mode(camhandle)) {
-                    bulb_old(camhandle, shutter_speed, prev_time);
-                } else {
-                    bulb_new(camhandle, shutter_speed);
-                }
-            } else {
-                DPRINT("not bulb\n");
-                if (!settings.one_push_bracketing.value || bracket_index == 0) {
-                    pslr_shutter(camhandle);
-                } else {
-                    // TODO: fix waiting time
-                    sleep_sec(1);
-                }
-            }
+            take_picture(camhandle, &status, shutter_speed, prev_time,
+                         settings.one_push_bracketing.value && bracket_index > 0);
             pslr_get_status(camhandle, &status);
         }
         if ( bracket_index+1 >= bracket_count || frameNo+1>=frames ) {
@@ -1077,10 +1357,14 @@ int main(int argc, char **argv) {
             }
             for ( buffer_index = 0; buffer_index < bracket_count; ++buffer_index ) {
                 fd = open_file(output_file, frameNo-bracket_count+buffer_index+1, ufft);
-                while ( save_buffer(camhandle, buffer_index, fd, &status, uff, quality) ) {
+                while ( (ret = save_buffer(camhandle, buffer_index, fd, &status, uff, quality)) > 0 ) {
                     usleep(10000);
                 }
-                pslr_delete_buffer(camhandle, buffer_index);
+                if ( ret == 0 ) {
+                    pslr_delete_buffer(camhandle, buffer_index);
+                } else {
+                    download_failed = true;
+                }
                 if (fd != 1) {
                     close(fd);
                 }
@@ -1088,7 +1372,10 @@ int main(int argc, char **argv) {
         }
         ++bracket_index;
     }
+    if (trace_file) {
+        pslr_trace_dump(camhandle, trace_file);
+    }
     camera_close(camhandle);
 
-    exit(0);
+    exit(download_failed ? -1 : 0);
 }
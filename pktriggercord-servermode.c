@@ -28,11 +28,23 @@
  */
 #ifndef WIN32
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#else
+#include <poll.h>
+#endif
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/time.h>
 #include <stdlib.h>
 
@@ -51,22 +63,19 @@ void camera_close(pslr_handle_t camhandle) {
 }
 
 pslr_handle_t camera_connect( char *model, char *device, int timeout, char *error_message ) {
-    struct timeval prev_time;
-    struct timeval current_time;
     pslr_handle_t camhandle;
+    int hotplug_fd = -1;
     int r;
 
-    gettimeofday(&prev_time, NULL);
-    while (!(camhandle = pslr_init( model, device ))) {
-        gettimeofday(&current_time, NULL);
-        DPRINT("diff: %f\n", timeval_diff(&current_time, &prev_time) / 1000000.0);
-        if ( timeout == 0 || timeout > timeval_diff(&current_time, &prev_time) / 1000000.0 ) {
-            DPRINT("sleep 1 sec\n");
-            sleep_sec(1);
-        } else {
-            snprintf(error_message, 1000, "%d %ds timeout exceeded\n", 1, timeout);
-            return NULL;
-        }
+    // timeout < 0: one attempt, 0: wait forever
+    if ( timeout >= 0 ) {
+        hotplug_fd = pslr_hotplug_open();
+    }
+    camhandle = pslr_init_wait( model, device, hotplug_fd, timeout < 0 ? 0 : timeout == 0 ? -1 : timeout * 1000 );
+    pslr_hotplug_close(hotplug_fd);
+    if ( !camhandle ) {
+        snprintf(error_message, 1000, "%d %ds timeout exceeded\n", 1, timeout);
+        return NULL;
     }
 
     DPRINT("before connect\n");
@@ -77,6 +86,7 @@ pslr_handle_t camera_connect( char *model, char *device, int timeout, char *erro
             } else {
                 snprintf(error_message, 1000, "%d Unknown Pentax camera found.\n",1);
             }
+            pslr_shutdown(camhandle);
             return NULL;
         }
     }
@@ -84,21 +94,357 @@ pslr_handle_t camera_connect( char *model, char *device, int timeout, char *erro
 }
 
 #ifndef WIN32
-int client_sock;
+/*
+   The event loop accepts any number of clients and queues their commands
+   per client. A single camera thread runs the queues round-robin, one
+   command or one download block at a time, so a long get_buffer does not
+   hold back the other clients. The answers are queued per client and
+   written by the event loop, several of them with one sendmsg.
+
+   Commands end with a newline, so a client may send many of them without
+   waiting for the answers. Clients which never send a newline are served
+   the old way, every read is one command. After a newline terminated
+   command the rest of a read waits for its newline, unless it fills the
+   whole read buffer.
+
+   After the "binary" command both directions use frames with a 12 byte
+   header (big endian): payload length, request id, type, flags and two
+   reserved bytes. The client sends the command text in COMMAND frames
+   and may cancel a queued command or a running get_buffer with a CANCEL
+   frame carrying its id. Every answer is an ANSWER frame with the request
+   id; the image of get_buffer and get_preview_buffer follows in DATA
+   frames, all frames but the last one of a request have the MORE flag.
+   Queries of a framed client run between the blocks of its own download.
+
+   Subscribed clients get the changed status fields pushed, as "* name=value"
+   lines or as STATUS frames with the id of the subscribe command. The
+   camera thread reads the status once for all subscribers due at the same
+   time, the others get the changes at their own interval.
+ */
+
+#define SERVER_PORT 8888
+#define SERVER_BACKLOG 64
+#define SERVER_READ_SIZE 2000                  // longest command
+#define SERVER_CHUNK_SIZE 4096                 // small answers are collected into chunks of this size
+#define SERVER_IOV 16                          // chunks written with one sendmsg
+#define SERVER_MAX_QUEUED 64                   // queued commands of a client before reading it pauses
+#define SERVER_MAX_OUT_BYTES (256 * 1024)      // unwritten answers of a client before reading it pauses
+#define SERVER_STOP_FLUSH_MS 1000              // stopserver waits this long for the answers to be written
+#define SERVER_DOWNLOAD_BLOCK (1024 * 1024)    // bytes downloaded in one turn
+#define SERVER_SHARED_BLOCK (256 * 1024)       // the same while other clients are connected
+#define SERVER_EVENTS 64
+#define SERVER_ZEROCOPY_MIN (64 * 1024)       // smaller writes are copied, the notification costs more
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define SERVER_ZEROCOPY
+#endif
+
+#define SERVER_FRAME_HEADER 12
+#define SERVER_FRAME_COMMAND 1
+#define SERVER_FRAME_CANCEL 2
+#define SERVER_FRAME_ANSWER 0x81
+#define SERVER_FRAME_DATA 0x82
+#define SERVER_FRAME_STATUS 0x83
+#define SERVER_FRAME_MORE 1
+#define SERVER_FRAME_CANCELLED 2
+
+#define SERVER_WANT_READ 1
+#define SERVER_WANT_WRITE 2
+
+#define SERVER_SUBSCRIBE_INTERVAL 500          // default status poll interval of subscribe, ms
+#define SERVER_SUBSCRIBE_MIN_INTERVAL 20
+#define SERVER_STATUS_CACHE_TTL 250000         // longest status cache TTL while subscribed
+#define SERVER_STATUS_VALUE 128                // longest name=value of a status field
+
+typedef struct server_command {
+    struct server_command *next;
+    uint32_t id;                    // request id of a framed command
+    bool cancelled;
+    char text[];
+} server_command_t;
+
+typedef struct server_chunk {
+    struct server_chunk *next;
+    bool pinned;                    // written with MSG_ZEROCOPY, kept until sent_seq completed
+    uint32_t sent_seq;
+    size_t pos;                     // bytes already written
+    size_t len;
+    size_t size;
+    uint8_t data[];
+} server_chunk_t;
+
+typedef struct server_client {
+    struct server_client *next;
+    int sock;                       // -1 after the client disconnected
+    int interest;                   // SERVER_WANT_* registered in the event loop
+    bool busy;                      // the camera thread runs a command of the client
+    server_command_t *head;
+    server_command_t *tail;
+    int queued;
+    bool sleeping;                  // usleep in progress until wake_time
+    struct timeval wake_time;
+    bool downloading;
+    uint32_t download_remaining;
+    uint32_t download_id;
+    bool cancel;                    // the framed client cancelled the download
+    bool last_was_command;          // a query ran in the previous turn of a downloading client
+    pslr_status status;             // status of the last update_status
+    char *reply;                    // get_status_all answer, reused, camera thread only
+    size_t reply_size;
+    uint32_t request_id;            // of the command run by the camera thread
+    bool subscribed;
+    bool subscribe_snapshot;        // the next push sends every field
+    uint32_t subscribe_id;
+    int subscribe_interval;         // ms
+    struct timeval subscribe_next;  // the next push is due
+    bool subscribe_due;             // pushed by the running status poll
+    uint64_t subscribe_changes;     // fields changed since the last push, bit per server_status_fields entry
+    bool framed;                    // answers are framed, set by the camera thread
+    bool binary;                    // input is framed, set by the event loop
+    bool line_mode;                 // a newline terminated command was read, wait for the end of the line
+    char in[SERVER_READ_SIZE + 1];  // unterminated end of the input in line mode
+    size_t in_len;
+    server_chunk_t *out_head;
+    server_chunk_t *out_tail;
+    size_t out_bytes;               // not yet written
+    bool zerocopy;
+    uint32_t zerocopy_seq;          // MSG_ZEROCOPY writes so far
+    uint32_t zerocopy_done;         // of them completed
+    server_chunk_t *sent_head;      // written chunks waiting for the zerocopy completion
+    server_chunk_t *sent_tail;
+} server_client_t;
+
+static struct {
+    pthread_mutex_t lock;           // guards the clients and their queues and output
+    pthread_cond_t cond;            // new work for the camera thread
+    server_client_t *clients;
+    server_client_t *last_served;
+    server_client_t *download_client;
+    int wakeup[2];                  // camera thread -> event loop
+    int listen_sock;
+#ifdef __linux__
+    int epoll_fd;
+#endif
+    pslr_handle_t camhandle;        // used by the camera thread only
+    bool ttl_saved;                 // the subscriptions set the status cache TTL of camhandle
+    uint32_t saved_ttl;             // to restore when the last subscriber leaves
+    bool published_valid;           // published holds the last pushed values
+    bool stopping;                  // stopserver: the threads finish, the answers are written
+} server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+typedef enum {
+    SERVER_FIELD_UINT,
+    SERVER_FIELD_INT,
+    SERVER_FIELD_RATIONAL,
+    SERVER_FIELD_LENS_NAME
+} server_field_kind_t;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+    server_field_kind_t kind;
+} server_status_field_t;
+
+#define STATUS_FIELD(field, kind) { #field, offsetof(pslr_status, field), sizeof(((pslr_status *) 0)->field), kind }
+
+static const server_status_field_t server_status_fields[] = {
+    STATUS_FIELD(bufmask, SERVER_FIELD_UINT),
+    STATUS_FIELD(current_iso, SERVER_FIELD_UINT),
+    STATUS_FIELD(current_shutter_speed, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(current_aperture, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(lens_max_aperture, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(lens_min_aperture, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(set_shutter_speed, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(set_aperture, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(max_shutter_speed, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(auto_bracket_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(auto_bracket_ev, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(auto_bracket_picture_count, SERVER_FIELD_UINT),
+    STATUS_FIELD(auto_bracket_picture_counter, SERVER_FIELD_UINT),
+    STATUS_FIELD(fixed_iso, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_resolution, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_saturation, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_quality, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_contrast, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_sharpness, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_image_tone, SERVER_FIELD_UINT),
+    STATUS_FIELD(jpeg_hue, SERVER_FIELD_UINT),
+    STATUS_FIELD(zoom, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(focus, SERVER_FIELD_INT),
+    STATUS_FIELD(image_format, SERVER_FIELD_UINT),
+    STATUS_FIELD(raw_format, SERVER_FIELD_UINT),
+    STATUS_FIELD(light_meter_flags, SERVER_FIELD_UINT),
+    STATUS_FIELD(ec, SERVER_FIELD_RATIONAL),
+    STATUS_FIELD(custom_ev_steps, SERVER_FIELD_UINT),
+    STATUS_FIELD(custom_sensitivity_steps, SERVER_FIELD_UINT),
+    STATUS_FIELD(exposure_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(scene_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(user_mode_flag, SERVER_FIELD_UINT),
+    STATUS_FIELD(ae_metering_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(af_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(af_point_select, SERVER_FIELD_UINT),
+    STATUS_FIELD(selected_af_point, SERVER_FIELD_UINT),
+    STATUS_FIELD(focused_af_point, SERVER_FIELD_UINT),
+    STATUS_FIELD(auto_iso_min, SERVER_FIELD_UINT),
+    STATUS_FIELD(auto_iso_max, SERVER_FIELD_UINT),
+    STATUS_FIELD(drive_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(shake_reduction, SERVER_FIELD_UINT),
+    STATUS_FIELD(white_balance_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(white_balance_adjust_mg, SERVER_FIELD_UINT),
+    STATUS_FIELD(white_balance_adjust_ba, SERVER_FIELD_UINT),
+    STATUS_FIELD(flash_mode, SERVER_FIELD_UINT),
+    STATUS_FIELD(flash_exposure_compensation, SERVER_FIELD_INT),
+    STATUS_FIELD(manual_mode_ev, SERVER_FIELD_INT),
+    STATUS_FIELD(color_space, SERVER_FIELD_UINT),
+    STATUS_FIELD(lens_id1, SERVER_FIELD_UINT),
+    STATUS_FIELD(lens_id2, SERVER_FIELD_UINT),
+    { "lens_name", 0, 0, SERVER_FIELD_LENS_NAME },
+    STATUS_FIELD(battery_1, SERVER_FIELD_UINT),
+    STATUS_FIELD(battery_2, SERVER_FIELD_UINT),
+    STATUS_FIELD(battery_3, SERVER_FIELD_UINT),
+    STATUS_FIELD(battery_4, SERVER_FIELD_UINT)
+};
+
+#define SERVER_STATUS_FIELDS (sizeof(server_status_fields) / sizeof(server_status_fields[0]))
+
+/* last values pushed to the subscribers, camera thread only */
+static char server_published[SERVER_STATUS_FIELDS][SERVER_STATUS_VALUE];
+
+_Static_assert(SERVER_STATUS_FIELDS <= 64, "subscribe_changes has a bit per status field");
+
+/* Gives the camera handle its own status cache TTL back, camera thread only. */
+static void server_status_ttl_restore(void) {
+    if (server.ttl_saved && server.camhandle) {
+        pslr_set_status_cache_ttl(server.camhandle, server.saved_ttl);
+    }
+    server.ttl_saved = false;
+}
+
+/* Formats a status field as name=value, returns its length. */
+static int server_status_format(char *buf, size_t size, const server_status_field_t *field, const pslr_status *status) {
+    const uint8_t *p = (const uint8_t *) status + field->offset;
+    uint16_t u16;
+    uint32_t u32;
+    int32_t i32;
+    pslr_rational_t rational;
+    int n;
+
+    switch (field->kind) {
+        case SERVER_FIELD_UINT:
+            if (field->size == sizeof(uint16_t)) {
+                memcpy(&u16, p, sizeof(u16));
+                u32 = u16;
+            } else {
+                memcpy(&u32, p, sizeof(u32));
+            }
+            n = snprintf(buf, size, "%s=%u", field->name, u32);
+            break;
+        case SERVER_FIELD_INT:
+            memcpy(&i32, p, sizeof(i32));
+            n = snprintf(buf, size, "%s=%d", field->name, i32);
+            break;
+        case SERVER_FIELD_RATIONAL:
+            memcpy(&rational, p, sizeof(rational));
+            n = snprintf(buf, size, "%s=%d/%d", field->name, rational.nom, rational.denom);
+            break;
+        default:
+            n = snprintf(buf, size, "%s=%s", field->name, get_lens_name(status->lens_id1, status->lens_id2));
+            break;
+    }
+    return n < (int) size ? n : (int) size - 1;
+}
+
+static void server_wakeup(void) {
+    char c = 0;
+    if (write(server.wakeup[1], &c, 1) < 0 && errno != EAGAIN) {
+        DPRINT("wakeup write failed\n");
+    }
+}
+
+static server_chunk_t *server_chunk_new(size_t size) {
+    server_chunk_t *chunk = malloc(sizeof(server_chunk_t) + size);
+    chunk->next = NULL;
+    chunk->pinned = false;
+    chunk->pos = 0;
+    chunk->len = 0;
+    chunk->size = size;
+    return chunk;
+}
+
+/* server.lock is held, the chunk is owned by the client afterwards */
+static void client_append_chunk(server_client_t *client, server_chunk_t *chunk) {
+    if (client->sock < 0 || chunk->len == 0) {
+        free(chunk);
+        return;
+    }
+    if (client->out_tail) {
+        client->out_tail->next = chunk;
+    } else {
+        client->out_head = chunk;
+    }
+    client->out_tail = chunk;
+    client->out_bytes += chunk->len;
+}
+
+/* server.lock is held */
+static void client_append(server_client_t *client, const uint8_t *data, size_t length) {
+    server_chunk_t *chunk = client->out_tail;
+    if (client->sock < 0) {
+        return;
+    }
+    if (chunk && chunk->size - chunk->len >= length) {
+        memcpy(chunk->data + chunk->len, data, length);
+        chunk->len += length;
+        client->out_bytes += length;
+        return;
+    }
+    chunk = server_chunk_new(length > SERVER_CHUNK_SIZE ? length : SERVER_CHUNK_SIZE);
+    memcpy(chunk->data, data, length);
+    chunk->len = length;
+    client_append_chunk(client, chunk);
+}
+
+static void server_frame_header(uint8_t *header, uint32_t length, uint32_t id, uint8_t type, uint8_t flags) {
+    set_uint32_be(length, header);
+    set_uint32_be(id, header + 4);
+    header[8] = type;
+    header[9] = flags;
+    header[10] = 0;
+    header[11] = 0;
+}
 
-void write_socket_answer( char *answer ) {
-    ssize_t r = write(client_sock , answer , strlen(answer));
-    if (r != strlen(answer)) {
-        fprintf(stderr, "write(answer) failed");
+/* server.lock is held */
+static void client_append_frame(server_client_t *client, uint32_t id, uint8_t type, uint8_t flags,
+                                const uint8_t *data, uint32_t length) {
+    uint8_t header[SERVER_FRAME_HEADER];
+    server_frame_header(header, length, id, type, flags);
+    client_append(client, header, SERVER_FRAME_HEADER);
+    if (length) {
+        client_append(client, data, length);
     }
 }
 
-void write_socket_answer_bin( uint8_t *answer, uint32_t length ) {
-    ssize_t r = write(client_sock , answer , length);
-    if (r != length) {
-        fprintf(stderr, "write(answer) failed");
+static void write_socket_answer_bin( server_client_t *client, const uint8_t *answer, uint32_t length ) {
+    pthread_mutex_lock(&server.lock);
+    if (client->framed) {
+        // the answer line without its newline
+        if (length > 0 && answer[length - 1] == '\n') {
+            --length;
+        }
+        client_append_frame(client, client->request_id, SERVER_FRAME_ANSWER, 0, answer, length);
+    } else {
+        client_append(client, answer, length);
     }
+    pthread_mutex_unlock(&server.lock);
+    server_wakeup();
+}
 
+static void write_socket_answer( server_client_t *client, const char *answer ) {
+    write_socket_answer_bin(client, (const uint8_t *) answer, strlen(answer));
 }
 
 char *is_string_prefix(char *str, char *prefix) {
@@ -113,9 +459,9 @@ char *is_string_prefix(char *str, char *prefix) {
     }
 }
 
-bool check_camera(pslr_handle_t camhandle) {
-    if ( !camhandle ) {
-        write_socket_answer("1 No camera connected\n");
+bool check_camera(server_client_t *client) {
+    if ( !server.camhandle ) {
+        write_socket_answer(client, "1 No camera connected\n");
         return false;
     } else {
         return true;
@@ -134,14 +480,66 @@ void strip(char *s) {
     *p2 = '\0';
 }
 
-int servermode_socket(int servermode_timeout) {
-    int socket_desc, c , read_size;
-    struct sockaddr_in server , client;
-    char client_message[2000];
+/* commands which may run while another client downloads a buffer */
+static bool server_command_is_query(const char *command) {
+    if (!strncmp(command, "get_buffer", strlen("get_buffer")) ||
+            !strncmp(command, "get_preview_buffer", strlen("get_preview_buffer"))) {
+        return false;
+    }
+    return !strncmp(command, "get_", strlen("get_")) || !strcmp(command, "update_status") ||
+           is_string_prefix((char *) command, "echo") || is_string_prefix((char *) command, "usleep");
+}
+
+static int server_setting_format(char *buf, const char *name, pslr_setting_status_t status, unsigned int value) {
+    switch (status) {
+        case PSLR_SETTING_STATUS_NA:
+            return sprintf(buf, "%s=n/a\n", name);
+        case PSLR_SETTING_STATUS_UNKNOWN:
+            return sprintf(buf, "%s=unknown\n", name);
+        default:
+            return sprintf(buf, "%s=%u\n", name, value);
+    }
+}
+
+/* Answers get_status_all: "0 COUNT" and COUNT name=value lines of the
+   status fields, the lens name and the settings. */
+static void server_status_all(server_client_t *client) {
+    pslr_settings settings;
+    bool has_settings = pslr_get_model_has_settings_parser(server.camhandle) &&
+                        pslr_get_settings(server.camhandle, &settings) == PSLR_OK;
+    unsigned int count = SERVER_STATUS_FIELDS + (has_settings ? 4 : 0);
+    size_t size = 16 + count * (SERVER_STATUS_VALUE + 1);
+    unsigned int i;
+    char *p;
+
+    if (client->reply_size < size) {
+        client->reply = realloc(client->reply, size);
+        client->reply_size = size;
+    }
+    p = client->reply;
+    p += sprintf(p, "%d %u\n", 0, count);
+    for (i = 0; i < SERVER_STATUS_FIELDS; ++i) {
+        p += server_status_format(p, SERVER_STATUS_VALUE, &server_status_fields[i], &client->status);
+        *p++ = '\n';
+    }
+    if (has_settings) {
+        p += server_setting_format(p, "one_push_bracketing", settings.one_push_bracketing.pslr_setting_status,
+                                   settings.one_push_bracketing.value);
+        p += server_setting_format(p, "bulb_mode_press_press", settings.bulb_mode_press_press.pslr_setting_status,
+                                   settings.bulb_mode_press_press.value);
+        p += server_setting_format(p, "bulb_timer", settings.bulb_timer.pslr_setting_status, settings.bulb_timer.value);
+        p += server_setting_format(p, "bulb_timer_sec", settings.bulb_timer_sec.pslr_setting_status,
+                                   settings.bulb_timer_sec.value);
+    }
+    write_socket_answer_bin(client, (uint8_t *) client->reply, p - client->reply);
+}
+
+/* Runs one command of the client in the camera thread. */
+static void server_client_write(server_client_t *client);
+
+static void servermode_command(server_client_t *client, char *client_message) {
     char *arg;
     char buf[2100];
-    pslr_handle_t camhandle=NULL;
-    pslr_status status;
     char C;
     float F = 0;
     pslr_rational_t shutter_speed = {0, 0};
@@ -149,256 +547,1118 @@ int servermode_socket(int servermode_timeout) {
     uint32_t auto_iso_min = 0;
     uint32_t auto_iso_max = 0;
 
+    DPRINT(":%s:\n",client_message);
+    if ( !strcmp(client_message, "stopserver" ) ) {
+        if ( server.camhandle ) {
+            server_status_ttl_restore();
+            camera_close(server.camhandle);
+            server.camhandle = NULL;
+        }
+        write_socket_answer(client, "0\n");
+        // the camera thread returns, the event loop writes the answers and stops
+        pthread_mutex_lock(&server.lock);
+        server.stopping = true;
+        pthread_mutex_unlock(&server.lock);
+        server_wakeup();
+    } else if ( !strcmp(client_message, "binary" ) ) {
+        // the event loop already reads frames, this answer is the last text line
+        write_socket_answer(client, "0\n");
+        pthread_mutex_lock(&server.lock);
+        client->framed = true;
+        pthread_mutex_unlock(&server.lock);
+    } else if (  (arg = is_string_prefix( client_message, "subscribe")) != NULL ) {
+        if ( check_camera(client) ) {
+            int interval = arg != client_message ? atoi(arg) : SERVER_SUBSCRIBE_INTERVAL;
+            if (interval < SERVER_SUBSCRIBE_MIN_INTERVAL) {
+                interval = SERVER_SUBSCRIBE_MIN_INTERVAL;
+            }
+            pthread_mutex_lock(&server.lock);
+            if (client->framed) {
+                // the pushes follow with the same id until unsubscribe
+                sprintf(buf, "%d %d", 0, interval);
+                client_append_frame(client, client->request_id, SERVER_FRAME_ANSWER, SERVER_FRAME_MORE, (uint8_t *) buf, strlen(buf));
+            } else {
+                sprintf(buf, "%d %d\n", 0, interval);
+                client_append(client, (uint8_t *) buf, strlen(buf));
+            }
+            client->subscribed = true;
+            client->subscribe_snapshot = true;
+            client->subscribe_id = client->request_id;
+            client->subscribe_interval = interval;
+            client->subscribe_changes = 0;
+            // the new subscriber gets its first status right away
+            gettimeofday(&client->subscribe_next, NULL);
+            pthread_mutex_unlock(&server.lock);
+            server_wakeup();
+        }
+    } else if ( !strcmp(client_message, "unsubscribe" ) ) {
+        pthread_mutex_lock(&server.lock);
+        if (client->subscribed && client->framed) {
+            client_append_frame(client, client->subscribe_id, SERVER_FRAME_STATUS, 0, NULL, 0);
+        }
+        client->subscribed = false;
+        pthread_mutex_unlock(&server.lock);
+        write_socket_answer(client, "0\n");
+    } else if ( !strcmp(client_message, "disconnect" ) ) {
+        if ( server.camhandle ) {
+            server_status_ttl_restore();
+            camera_close(server.camhandle);
+            server.camhandle = NULL;
+        }
+        write_socket_answer(client, "0\n");
+    } else if ( (arg = is_string_prefix( client_message, "echo")) != NULL ) {
+        sprintf( buf, "0 %.100s\n", arg);
+        write_socket_answer(client, buf);
+    } else if (  (arg = is_string_prefix( client_message, "usleep")) != NULL ) {
+        // the wait was done by the scheduler
+        write_socket_answer(client, "0\n");
+    } else if ( !strcmp(client_message, "connect") ) {
+        if ( server.camhandle ) {
+            write_socket_answer(client, "0\n");
+        } else if ( (server.camhandle = camera_connect( NULL, NULL, -1, buf ))  ) {
+            write_socket_answer(client, "0\n");
+        } else {
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "update_status") ) {
+        if ( check_camera(client) ) {
+            if ( !pslr_get_status(server.camhandle, &client->status) ) {
+                sprintf( buf, "%d\n", 0);
+            } else {
+                sprintf( buf, "%d\n", 1);
+            }
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_status_all") ) {
+        if ( check_camera(client) ) {
+            if ( pslr_get_status(server.camhandle, &client->status) ) {
+                write_socket_answer(client, "1\n");
+            } else {
+                server_status_all(client);
+            }
+        }
+    } else if ( !strcmp(client_message, "get_camera_name") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %s\n", 0, pslr_camera_name(server.camhandle));
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_lens_name") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %s\n", 0, get_lens_name(client->status.lens_id1, client->status.lens_id2));
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_current_shutter_speed") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %d/%d\n", 0, client->status.current_shutter_speed.nom, client->status.current_shutter_speed.denom);
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_current_aperture") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %s\n", 0, format_rational( client->status.current_aperture, "%.1f"));
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_current_iso") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %d\n", 0, client->status.current_iso);
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_bufmask") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %d\n", 0, client->status.bufmask);
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_auto_bracket_mode") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %d\n", 0, client->status.auto_bracket_mode);
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "get_auto_bracket_picture_count") ) {
+        if ( check_camera(client) ) {
+            sprintf(buf, "%d %d\n", 0, client->status.auto_bracket_picture_count);
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "focus") ) {
+        if ( check_camera(client) ) {
+            pslr_focus(server.camhandle);
+            sprintf(buf, "%d\n", 0);
+            write_socket_answer(client, buf);
+        }
+    } else if ( !strcmp(client_message, "shutter") ) {
+        if ( check_camera(client) ) {
+            pslr_shutter(server.camhandle);
+            sprintf(buf, "%d\n", 0);
+            write_socket_answer(client, buf);
+        }
+    } else if (  (arg = is_string_prefix( client_message, "delete_buffer")) != NULL ) {
+        int bufno = atoi(arg);
+        if ( check_camera(client) ) {
+            pslr_delete_buffer(server.camhandle,bufno);
+            sprintf(buf, "%d\n", 0);
+            write_socket_answer(client, buf);
+        }
+    } else if (  (arg = is_string_prefix( client_message, "get_preview_buffer")) != NULL ) {
+        int bufno = atoi(arg);
+        if ( check_camera(client) ) {
+            uint8_t *pImage;
+            uint32_t imageSize;
+            if ( pslr_get_buffer(server.camhandle, bufno, PSLR_BUF_PREVIEW, 4, &pImage, &imageSize) ) {
+                sprintf(buf, "%d %d\n", 1, imageSize);
+                write_socket_answer(client, buf);
+            } else {
+                pthread_mutex_lock(&server.lock);
+                if (client->framed) {
+                    sprintf(buf, "%d %d", 0, imageSize);
+                    client_append_frame(client, client->request_id, SERVER_FRAME_ANSWER, SERVER_FRAME_MORE, (uint8_t *) buf, strlen(buf));
+                    client_append_frame(client, client->request_id, SERVER_FRAME_DATA, 0, pImage, imageSize);
+                } else {
+                    sprintf(buf, "%d %d\n", 0, imageSize);
+                    client_append(client, (uint8_t *) buf, strlen(buf));
+                    client_append(client, pImage, imageSize);
+                }
+                pthread_mutex_unlock(&server.lock);
+                server_wakeup();
+                free(pImage);
+            }
+        }
+    } else if (  (arg = is_string_prefix( client_message, "get_buffer")) != NULL ) {
+        int bufno = atoi(arg);
+        if ( check_camera(client) ) {
+            uint32_t imageSize;
+            if ( pslr_buffer_open(server.camhandle, bufno, PSLR_BUF_DNG, 0) ) {
+                sprintf(buf, "%d\n", 1);
+                write_socket_answer(client, buf);
+            } else {
+                imageSize = pslr_buffer_get_size(server.camhandle);
+                pthread_mutex_lock(&server.lock);
+                if (client->framed) {
+                    sprintf(buf, "%d %d", 0, imageSize);
+                    client_append_frame(client, client->request_id, SERVER_FRAME_ANSWER, SERVER_FRAME_MORE, (uint8_t *) buf, strlen(buf));
+                } else {
+                    sprintf(buf, "%d %d\n", 0, imageSize);
+                    client_append(client, (uint8_t *) buf, strlen(buf));
+                }
+                pthread_mutex_unlock(&server.lock);
+                server_wakeup();
+                // the blocks are read in later turns
+                pthread_mutex_lock(&server.lock);
+                client->downloading = true;
+                client->download_remaining = imageSize;
+                client->download_id = client->request_id;
+                client->cancel = false;
+                server.download_client = client;
+                pthread_mutex_unlock(&server.lock);
+            }
+        }
+    } else if (  (arg = is_string_prefix( client_message, "set_shutter_speed")) != NULL ) {
+        if ( check_camera(client) ) {
+            // TODO: merge with pktriggercord-cli shutter speed parse
+            if (sscanf(arg, "1/%d%c", &shutter_speed.denom, &C) == 1) {
+                shutter_speed.nom = 1;
+                sprintf(buf, "%d %d %d\n", 0, shutter_speed.nom, shutter_speed.denom);
+            } else if ((sscanf(arg, "%f%c", &F, &C)) == 1) {
+                if (F < 2) {
+                    F = F * 10;
+                    shutter_speed.denom = 10;
+                    shutter_speed.nom = F;
+                } else {
+                    shutter_speed.denom = 1;
+                    shutter_speed.nom = F;
+                }
+                sprintf(buf, "%d %d %d\n", 0, shutter_speed.nom, shutter_speed.denom);
+            } else {
+                shutter_speed.nom = 0;
+                sprintf(buf,"1 Invalid shutter speed value.\n");
+            }
+            if (shutter_speed.nom) {
+                pslr_set_shutter(server.camhandle, shutter_speed);
+            }
+            write_socket_answer(client, buf);
+        }
+    } else if (  (arg = is_string_prefix( client_message, "set_iso")) != NULL ) {
+        if ( check_camera(client) ) {
+            // TODO: merge with pktriggercord-cli shutter iso
+            if (sscanf(arg, "%d-%d%c", &auto_iso_min, &auto_iso_max, &C) != 2) {
+                auto_iso_min = 0;
+                auto_iso_max = 0;
+                iso = atoi(arg);
+            } else {
+                iso = 0;
+            }
+            if (iso==0 && auto_iso_min==0) {
+                sprintf(buf,"1 Invalid iso value.\n");
+            } else {
+                pslr_set_iso(server.camhandle, iso, auto_iso_min, auto_iso_max);
+                sprintf(buf, "%d %d %d-%d\n", 0, iso, auto_iso_min, auto_iso_max);
+            }
+            write_socket_answer(client, buf);
+        }
+    } else {
+        write_socket_answer(client, "1 Invalid servermode command\n");
+    }
+}
+
+static void server_download_finish(server_client_t *client) {
+    if (client->download_remaining > 0) {
+        DPRINT("get_buffer stopped with %d bytes left\n", client->download_remaining);
+    }
+    pslr_buffer_close(server.camhandle);
+    pthread_mutex_lock(&server.lock);
+    client->downloading = false;
+    server.download_client = NULL;
+    pthread_mutex_unlock(&server.lock);
+}
+
+/* Reads the next block of the client's get_buffer in the camera thread.
+   Not pslr_buffer_save: its reader thread would hold the camera for the
+   whole image, here other clients' commands run between the blocks. */
+static void server_download_step(server_client_t *client, uint32_t block_size) {
+    uint32_t size = client->download_remaining < block_size ? client->download_remaining : block_size;
+    // the event loop changes these under the lock
+    pthread_mutex_lock(&server.lock);
+    bool framed = client->framed;
+    bool cancel = client->cancel;
+    pthread_mutex_unlock(&server.lock);
+    uint32_t header = framed ? SERVER_FRAME_HEADER : 0;
+    // read straight into the chunk queued for the socket
+    server_chunk_t *chunk = server_chunk_new(header + size);
+    uint32_t n = size && !cancel ? pslr_buffer_read(server.camhandle, chunk->data + header, size) : 0;
+
+    chunk->len = header + n;
+    pthread_mutex_lock(&server.lock);
+    client->download_remaining -= n;
+    bool done = n == 0 || client->download_remaining == 0 || client->sock < 0;
+    if (framed) {
+        uint8_t flags = cancel ? SERVER_FRAME_CANCELLED : done ? 0 : SERVER_FRAME_MORE;
+        server_frame_header(chunk->data, n, client->download_id, SERVER_FRAME_DATA, flags);
+    }
+    client_append_chunk(client, chunk);
+    pthread_mutex_unlock(&server.lock);
+    server_wakeup();
+
+    if (done) {
+        server_download_finish(client);
+    }
+}
+
+/* Tells if the status poll of any subscriber is due and marks those
+   subscribers, otherwise moves wake_time to the next push. pinterval is
+   the shortest interval of the due subscribers. server.lock is held. */
+static bool server_status_due(struct timeval *now, struct timeval *wake_time, bool *wake_set, int *pinterval) {
+    server_client_t *client;
+    bool subscribed = false;
+    int interval = 0;
+    if (!server.camhandle) {
+        return false;
+    }
+    for (client = server.clients; client; client = client->next) {
+        if (client->sock < 0 || !client->subscribed) {
+            continue;
+        }
+        subscribed = true;
+        if (!timercmp(now, &client->subscribe_next, <)) {
+            client->subscribe_due = true;
+            client->subscribe_next.tv_sec = now->tv_sec + (now->tv_usec + client->subscribe_interval * 1000L) / 1000000;
+            client->subscribe_next.tv_usec = (now->tv_usec + client->subscribe_interval * 1000L) % 1000000;
+            if (!interval || client->subscribe_interval < interval) {
+                interval = client->subscribe_interval;
+            }
+        } else if (!*wake_set || timercmp(&client->subscribe_next, wake_time, <)) {
+            *wake_time = client->subscribe_next;
+            *wake_set = true;
+        }
+    }
+    if (!subscribed) {
+        server_status_ttl_restore();
+    }
+    if (!interval) {
+        return false;
+    }
+    *pinterval = interval;
+    return true;
+}
+
+/* Reads the status once and pushes the fields changed since their last
+   push to the due subscribers. */
+static void server_status_publish(int interval) {
+    static char lines[SERVER_STATUS_FIELDS * (SERVER_STATUS_VALUE + 3)];
+    bool changed[SERVER_STATUS_FIELDS];
+    char value[SERVER_STATUS_VALUE];
+    pslr_status status;
+    server_client_t *client;
+    uint32_t ttl;
+    unsigned int i;
+
+    // a cached status must not be older than half of the interval,
+    // the handle gets its own TTL back when the last subscriber leaves
+    if (!server.ttl_saved) {
+        pslr_get_status_cache_ttl(server.camhandle, &server.saved_ttl);
+        server.ttl_saved = true;
+    }
+    ttl = interval * 500 < SERVER_STATUS_CACHE_TTL ? interval * 500 : SERVER_STATUS_CACHE_TTL;
+    pslr_set_status_cache_ttl(server.camhandle, ttl);
+    if (pslr_get_status(server.camhandle, &status) != PSLR_OK) {
+        return;
+    }
+    // the status groups changed since the previous poll or any update_status
+    uint32_t changes = pslr_get_status_changes(server.camhandle);
+
+    pthread_mutex_lock(&server.lock);
+    for (i = 0; i < SERVER_STATUS_FIELDS; ++i) {
+        changed[i] = false;
+        if (!changes && server.published_valid) {
+            continue;
+        }
+        server_status_format(value, sizeof(value), &server_status_fields[i], &status);
+        changed[i] = !server.published_valid || strcmp(value, server_published[i]);
+        if (changed[i]) {
+            strcpy(server_published[i], value);
+        }
+    }
+    server.published_valid = true;
+    for (client = server.clients; client; client = client->next) {
+        size_t length = 0;
+        if (client->sock < 0 || !client->subscribed) {
+            continue;
+        }
+        // the subscribers that are not due collect the changes for their next push
+        for (i = 0; i < SERVER_STATUS_FIELDS; ++i) {
+            if (changed[i]) {
+                client->subscribe_changes |= (uint64_t) 1 << i;
+            }
+        }
+        if (!client->subscribe_due) {
+            continue;
+        }
+        for (i = 0; i < SERVER_STATUS_FIELDS; ++i) {
+            if ((client->subscribe_changes & (uint64_t) 1 << i) || client->subscribe_snapshot) {
+                length += sprintf(lines + length, "%s%s\n", client->framed ? "" : "* ", server_published[i]);
+            }
+        }
+        client->subscribe_due = false;
+        client->subscribe_changes = 0;
+        client->subscribe_snapshot = false;
+        if (length == 0) {
+            continue;
+        }
+        if (client->framed) {
+            client_append_frame(client, client->subscribe_id, SERVER_FRAME_STATUS, SERVER_FRAME_MORE, (uint8_t *) lines, length - 1);
+        } else {
+            client_append(client, (uint8_t *) lines, length);
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    server_wakeup();
+}
+
+static void server_client_free(server_client_t *client) {
+    server_command_t *command;
+    server_chunk_t *chunk;
+    while ((command = client->head) != NULL) {
+        client->head = command->next;
+        free(command);
+    }
+    while ((chunk = client->out_head) != NULL) {
+        client->out_head = chunk->next;
+        free(chunk);
+    }
+    // the socket is closed, the pinned pages are not sent any more
+    while ((chunk = client->sent_head) != NULL) {
+        client->sent_head = chunk->next;
+        free(chunk);
+    }
+    free(client->reply);
+    free(client);
+}
+
+/* Tells if the first queued command of the client may run now.
+   server.lock is held. */
+static bool server_command_ready(server_client_t *client, struct timeval *now, struct timeval *wake_time, bool *wake_set) {
+    char *arg;
+    if (!client->head) {
+        return false;
+    }
+    if (client->head->cancelled) {
+        return true;
+    }
+    if (!client->sleeping && (arg = is_string_prefix(client->head->text, "usleep")) != NULL) {
+        long usec = atol(arg);
+        client->wake_time.tv_sec = now->tv_sec + (now->tv_usec + usec) / 1000000;
+        client->wake_time.tv_usec = (now->tv_usec + usec) % 1000000;
+        client->sleeping = true;
+    }
+    if (client->sleeping && timercmp(now, &client->wake_time, <)) {
+        if (!*wake_set || timercmp(&client->wake_time, wake_time, <)) {
+            *wake_time = client->wake_time;
+            *wake_set = true;
+        }
+        return false;
+    }
+    return !server.download_client || server_command_is_query(client->head->text);
+}
+
+/* Picks the next client with a runnable command or download block,
+   round-robin. server.lock is held. */
+static server_client_t *server_next_client(struct timeval *now, struct timeval *wake_time, bool *wake_set, bool *command) {
+    server_client_t *start = server.last_served ? server.last_served->next : NULL;
+    server_client_t *client = start ? start : server.clients;
+    server_client_t *first = client;
+
+    while (client) {
+        if (client->sock >= 0 && !client->busy) {
+            if (client->downloading) {
+                // wait until the event loop sent most of the previous block
+                bool block_ready = client->cancel || client->out_bytes < SERVER_DOWNLOAD_BLOCK;
+                // a framed client's queries alternate with the blocks of its download
+                if (client->framed && !(block_ready && client->last_was_command) &&
+                        server_command_ready(client, now, wake_time, wake_set)) {
+                    *command = true;
+                    return client;
+                }
+                if (block_ready) {
+                    *command = false;
+                    return client;
+                }
+            } else if (server_command_ready(client, now, wake_time, wake_set)) {
+                *command = true;
+                return client;
+            }
+        }
+        client = client->next ? client->next : server.clients;
+        if (client == first) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* server.lock is held */
+static bool server_others_connected(server_client_t *client) {
+    server_client_t *c;
+    for (c = server.clients; c; c = c->next) {
+        if (c != client && c->sock >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *server_camera_thread(void *arg) {
+    pthread_mutex_lock(&server.lock);
+    while (true) {
+        server_client_t **pclient;
+        server_client_t *client;
+        struct timeval now;
+        struct timeval wake_time = { 0, 0 };
+        bool wake_set = false;
+        bool command = false;
+        int interval;
+
+        // free the disconnected clients
+        pclient = &server.clients;
+        while ((client = *pclient) != NULL) {
+            if (client->sock < 0 && !client->busy) {
+                if (client->downloading) {
+                    client->busy = true;
+                    pthread_mutex_unlock(&server.lock);
+                    server_download_finish(client);
+                    pthread_mutex_lock(&server.lock);
+                    client->busy = false;
+                }
+                *pclient = client->next;
+                if (server.last_served == client) {
+                    server.last_served = NULL;
+                }
+                server_client_free(client);
+            } else {
+                pclient = &client->next;
+            }
+        }
+        if (server.stopping) {
+            break;
+        }
+
+        gettimeofday(&now, NULL);
+        if (server_status_due(&now, &wake_time, &wake_set, &interval)) {
+            pthread_mutex_unlock(&server.lock);
+            server_status_publish(interval);
+            pthread_mutex_lock(&server.lock);
+            continue;
+        }
+        client = server_next_client(&now, &wake_time, &wake_set, &command);
+        if (!client) {
+            if (wake_set) {
+                struct timespec ts = { wake_time.tv_sec, wake_time.tv_usec * 1000 };
+                pthread_cond_timedwait(&server.cond, &server.lock, &ts);
+            } else {
+                pthread_cond_wait(&server.cond, &server.lock);
+            }
+            continue;
+        }
+
+        client->busy = true;
+        server.last_served = client;
+        client->last_was_command = command;
+        if (!command) {
+            uint32_t block_size = server_others_connected(client) ? SERVER_SHARED_BLOCK : SERVER_DOWNLOAD_BLOCK;
+            pthread_mutex_unlock(&server.lock);
+            server_download_step(client, block_size);
+            pthread_mutex_lock(&server.lock);
+        } else {
+            server_command_t *next = client->head;
+            client->head = next->next;
+            if (!client->head) {
+                client->tail = NULL;
+            }
+            --client->queued;
+            client->sleeping = false;
+            client->request_id = next->id;
+            pthread_mutex_unlock(&server.lock);
+            if (next->cancelled) {
+                pthread_mutex_lock(&server.lock);
+                client_append_frame(client, next->id, SERVER_FRAME_ANSWER, SERVER_FRAME_CANCELLED,
+                                    (const uint8_t *) "1 Cancelled", strlen("1 Cancelled"));
+                pthread_mutex_unlock(&server.lock);
+                server_wakeup();
+            } else {
+                servermode_command(client, next->text);
+            }
+            free(next);
+            pthread_mutex_lock(&server.lock);
+        }
+        client->busy = false;
+        // reading may continue if the queue was full
+        server_wakeup();
+    }
+    pthread_mutex_unlock(&server.lock);
+    return NULL;
+}
+
+/* event loop side, server.lock is held */
+
+static int server_client_interest(server_client_t *client) {
+    int interest = 0;
+    // a client that does not read its answers is not read either
+    if (client->queued < SERVER_MAX_QUEUED && client->out_bytes < SERVER_MAX_OUT_BYTES && !server.stopping) {
+        interest |= SERVER_WANT_READ;
+    }
+    if (client->out_head) {
+        interest |= SERVER_WANT_WRITE;
+    }
+    return interest;
+}
+
+#ifdef __linux__
+static void server_watch(int op, int fd, void *ptr, int interest) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((interest & SERVER_WANT_READ) ? EPOLLIN : 0) | ((interest & SERVER_WANT_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = ptr;
+    if (epoll_ctl(server.epoll_fd, op, fd, &ev) < 0) {
+        DPRINT("epoll_ctl failed: %s\n", strerror(errno));
+    }
+}
+#endif
+
+static void server_client_update(server_client_t *client) {
+    int interest = server_client_interest(client);
+    if (client->sock >= 0 && interest != client->interest) {
+#ifdef __linux__
+        server_watch(EPOLL_CTL_MOD, client->sock, client, interest);
+#endif
+        client->interest = interest;
+    }
+}
+
+static void server_client_close(server_client_t *client) {
+    DPRINT("Client disconnected\n");
+#ifdef __linux__
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client->sock, NULL);
+#endif
+    close(client->sock);
+    client->sock = -1;
+    pthread_cond_signal(&server.cond);
+}
+
+static void server_accept(void) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int sock = accept(server.listen_sock, (struct sockaddr *)&addr, &addrlen);
+    if (sock < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "accept failed");
+        }
+        return;
+    }
+    DPRINT("Connection accepted\n");
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    server_client_t *client = calloc(1, sizeof(server_client_t));
+    client->sock = sock;
+    client->interest = SERVER_WANT_READ;
+#ifdef SERVER_ZEROCOPY
+    int enable = 1;
+    client->zerocopy = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+#endif
+    client->next = server.clients;
+    server.clients = client;
+#ifdef __linux__
+    server_watch(EPOLL_CTL_ADD, sock, client, client->interest);
+#endif
+}
+
+static void server_client_queue(server_client_t *client, uint32_t id, const char *text, size_t length) {
+    server_command_t *command = malloc(sizeof(server_command_t) + length + 1);
+    command->next = NULL;
+    command->id = id;
+    command->cancelled = false;
+    memcpy(command->text, text, length);
+    command->text[length] = '\0';
+    if (client->tail) {
+        client->tail->next = command;
+    } else {
+        client->head = command;
+    }
+    client->tail = command;
+    ++client->queued;
+}
+
+/* CANCEL frame: stops the download or drops the queued command with the id */
+static void server_client_cancel(server_client_t *client, uint32_t id) {
+    server_command_t *command;
+    if (client->downloading && client->download_id == id) {
+        client->cancel = true;
+        return;
+    }
+    for (command = client->head; command; command = command->next) {
+        if (command->id == id) {
+            // answered in order by the camera thread
+            command->cancelled = true;
+            return;
+        }
+    }
+}
+
+static void server_client_frames(server_client_t *client) {
+    uint8_t *frame = (uint8_t *) client->in;
+    size_t left = client->in_len;
+    while (left >= SERVER_FRAME_HEADER) {
+        uint32_t length = get_uint32_be(frame);
+        uint32_t id = get_uint32_be(frame + 4);
+        if (length > SERVER_READ_SIZE - SERVER_FRAME_HEADER) {
+            DPRINT("Frame too long: %u\n", length);
+            server_client_close(client);
+            return;
+        }
+        if (left < SERVER_FRAME_HEADER + length) {
+            break;
+        }
+        if (frame[8] == SERVER_FRAME_COMMAND) {
+            server_client_queue(client, id, (char *) frame + SERVER_FRAME_HEADER, length);
+        } else if (frame[8] == SERVER_FRAME_CANCEL) {
+            server_client_cancel(client, id);
+        } else {
+            DPRINT("Unknown frame type %d\n", frame[8]);
+        }
+        frame += SERVER_FRAME_HEADER + length;
+        left -= SERVER_FRAME_HEADER + length;
+    }
+    memmove(client->in, frame, left);
+    client->in_len = left;
+}
+
+static void server_client_lines(server_client_t *client) {
+    char *line = client->in;
+    char *end;
+    // frames may follow the binary command in the same read
+    while (!client->binary && (end = memchr(line, '\n', client->in + client->in_len - line)) != NULL) {
+        *end = '\0';
+        strip(line);
+        if (*line) {
+            server_client_queue(client, 0, line, strlen(line));
+            client->binary = !strcmp(line, "binary");
+        }
+        client->line_mode = true;
+        line = end + 1;
+    }
+    client->in_len -= line - client->in;
+    memmove(client->in, line, client->in_len);
+}
+
+static void server_client_read(server_client_t *client) {
+    ssize_t read_size = recv(client->sock, client->in + client->in_len, SERVER_READ_SIZE - client->in_len, 0);
+    if (read_size == 0 || (read_size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        if (read_size < 0) {
+            fprintf(stderr, "recv failed\n");
+        }
+        server_client_close(client);
+        return;
+    }
+    if (read_size < 0) {
+        return;
+    }
+    client->in_len += read_size;
+    client->in[client->in_len] = '\0';
+    if (!client->binary) {
+        server_client_lines(client);
+        // what is left has no newline: the unterminated command of an old
+        // client, a line longer than the buffer, or the start of a line
+        if (!client->binary && client->in_len > 0 && (!client->line_mode || client->in_len == SERVER_READ_SIZE)) {
+            client->in[client->in_len] = '\0';
+            strip(client->in);
+            server_client_queue(client, 0, client->in, strlen(client->in));
+            client->binary = !strcmp(client->in, "binary");
+            client->in_len = 0;
+        }
+    }
+    if (client->binary) {
+        server_client_frames(client);
+    }
+    pthread_cond_signal(&server.cond);
+}
+
+static void server_client_write(server_client_t *client) {
+    struct iovec iov[SERVER_IOV];
+    struct msghdr msg;
+    server_chunk_t *chunk;
+    size_t total = 0;
+    int flags = MSG_NOSIGNAL;
+    int n = 0;
+    ssize_t r;
+
+    for (chunk = client->out_head; chunk && n < SERVER_IOV; chunk = chunk->next, ++n) {
+        iov[n].iov_base = chunk->data + chunk->pos;
+        iov[n].iov_len = chunk->len - chunk->pos;
+        total += iov[n].iov_len;
+    }
+    if (n == 0) {
+        return;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+#ifdef SERVER_ZEROCOPY
+    if (client->zerocopy && total >= SERVER_ZEROCOPY_MIN) {
+        flags |= MSG_ZEROCOPY;
+    }
+#endif
+    r = sendmsg(client->sock, &msg, flags);
+#ifdef SERVER_ZEROCOPY
+    if (r < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // no room for the completion notification, send a copy
+        flags &= ~MSG_ZEROCOPY;
+        r = sendmsg(client->sock, &msg, flags);
+    }
+#endif
+    if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            fprintf(stderr, "write(answer) failed");
+            server_client_close(client);
+        }
+        return;
+    }
+    bool pinned = (flags & MSG_ZEROCOPY) != 0;
+    uint32_t seq = pinned ? client->zerocopy_seq++ : 0;
+    client->out_bytes -= r;
+    while (r > 0) {
+        chunk = client->out_head;
+        size_t left = chunk->len - chunk->pos;
+        if (pinned) {
+            // the kernel sends from these pages until the completion arrives
+            chunk->pinned = true;
+            chunk->sent_seq = seq;
+        }
+        if ((size_t) r < left) {
+            chunk->pos += r;
+            break;
+        }
+        r -= left;
+        // the camera thread may still append to the tail
+        client->out_head = chunk->next;
+        if (!client->out_head) {
+            client->out_tail = NULL;
+        }
+        if (chunk->pinned && (int32_t) (chunk->sent_seq - client->zerocopy_done) >= 0) {
+            chunk->next = NULL;
+            if (client->sent_tail) {
+                client->sent_tail->next = chunk;
+            } else {
+                client->sent_head = chunk;
+            }
+            client->sent_tail = chunk;
+        } else {
+            free(chunk);
+        }
+    }
+    if (client->downloading) {
+        pthread_cond_signal(&server.cond);
+    }
+}
+
+#ifdef SERVER_ZEROCOPY
+/* Frees the written chunks whose MSG_ZEROCOPY sends the kernel completed. */
+static void server_client_completions(server_client_t *client) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    server_chunk_t *chunk;
+
+    while (true) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(client->sock, &msg, MSG_ERRQUEUE) < 0) {
+            break;
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR ||
+                    err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // sends ee_info to ee_data are done, TCP completes them in order
+            client->zerocopy_done = err->ee_data + 1;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // the kernel had to copy (loopback), plain sends are cheaper
+                client->zerocopy = false;
+            }
+        }
+    }
+    while ((chunk = client->sent_head) != NULL && (int32_t) (chunk->sent_seq - client->zerocopy_done) < 0) {
+        client->sent_head = chunk->next;
+        if (!client->sent_head) {
+            client->sent_tail = NULL;
+        }
+        free(chunk);
+    }
+}
+#endif
+
+static void server_client_events(server_client_t *client, bool readable, bool writable, bool error) {
+#ifdef SERVER_ZEROCOPY
+    if (error && client->sock >= 0) {
+        server_client_completions(client);
+    }
+#endif
+    if (writable && client->sock >= 0) {
+        server_client_write(client);
+    }
+    if (readable && client->sock >= 0) {
+        server_client_read(client);
+    }
+}
+
+/* Waits up to timeout_ms for events and handles them. */
+static void server_poll(int timeout_ms) {
+    char drain[64];
+#ifdef __linux__
+    struct epoll_event events[SERVER_EVENTS];
+    int i;
+    int n = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        DPRINT("epoll error\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&server.lock);
+    for (i = 0; i < n; ++i) {
+        if (events[i].data.ptr == &server.listen_sock) {
+            server_accept();
+        } else if (events[i].data.ptr == &server.wakeup) {
+            while (read(server.wakeup[0], drain, sizeof(drain)) > 0) {
+            }
+        } else {
+            server_client_events(events[i].data.ptr, events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR),
+                                 events[i].events & EPOLLOUT, events[i].events & EPOLLERR);
+        }
+    }
+#else
+    server_client_t *client;
+    struct pollfd *fds;
+    int count = 2;
+    int i;
+    pthread_mutex_lock(&server.lock);
+    for (client = server.clients; client; client = client->next) {
+        ++count;
+    }
+    fds = calloc(count, sizeof(struct pollfd));
+    fds[0].fd = server.listen_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = server.wakeup[0];
+    fds[1].events = POLLIN;
+    for (client = server.clients, i = 2; client; client = client->next, ++i) {
+        fds[i].fd = client->sock;
+        fds[i].events = ((client->interest & SERVER_WANT_READ) ? POLLIN : 0) | ((client->interest & SERVER_WANT_WRITE) ? POLLOUT : 0);
+    }
+    pthread_mutex_unlock(&server.lock);
+    int n = poll(fds, count, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        DPRINT("poll error\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&server.lock);
+    if (n > 0) {
+        if (fds[1].revents) {
+            while (read(server.wakeup[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        // new clients are added to the head, behind them the order is unchanged
+        for (client = server.clients; client; client = client->next) {
+            for (i = 2; i < count && fds[i].fd != client->sock; ++i) {
+            }
+            if (i < count && client->sock >= 0 && fds[i].revents) {
+                server_client_events(client, fds[i].revents & (POLLIN | POLLHUP | POLLERR), fds[i].revents & POLLOUT,
+                                     fds[i].revents & POLLERR);
+            }
+        }
+        if (fds[0].revents) {
+            server_accept();
+        }
+    }
+    free(fds);
+#endif
+    // answers of the camera thread, paused and resumed reading
+    server_client_t *c;
+    for (c = server.clients; c; c = c->next) {
+        server_client_update(c);
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+/* stopserver was run and the answers are written, or could not be written in time */
+static bool server_stopped(struct timeval *stop_time) {
+    server_client_t *client;
+    struct timeval now;
+    bool ret;
+
+    pthread_mutex_lock(&server.lock);
+    ret = server.stopping;
+    if (ret) {
+        gettimeofday(&now, NULL);
+        if (stop_time->tv_sec == 0) {
+            *stop_time = now;
+        }
+        for (client = server.clients; client; client = client->next) {
+            if (client->sock >= 0 && client->out_head && timeval_diff(&now, stop_time) < SERVER_STOP_FLUSH_MS * 1000) {
+                ret = false;
+            }
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    return ret;
+}
+
+static bool server_has_clients(void) {
+    server_client_t *client;
+    bool ret = false;
+    pthread_mutex_lock(&server.lock);
+    for (client = server.clients; client; client = client->next) {
+        if (client->sock >= 0) {
+            ret = true;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    return ret;
+}
+
+int servermode_socket(int servermode_timeout) {
+    struct sockaddr_in addr;
+    struct timeval idle_since;
+    struct timeval current_time;
+    struct timeval stop_time = { 0, 0 };
+    server_client_t *client;
+    pthread_t camera_thread;
+
     //Create socket
-    socket_desc = socket(AF_INET , SOCK_STREAM , 0);
-    if (socket_desc == -1) {
+    server.listen_sock = socket(AF_INET , SOCK_STREAM , 0);
+    if (server.listen_sock == -1) {
         fprintf(stderr, "Could not create socket");
     }
 
     int enable = 1;
-    if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+    if (setsockopt(server.listen_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
         fprintf(stderr, "setsockopt(SO_REUSEADDR) failed");
     }
     DPRINT("Socket created\n");
 
     //Prepare the sockaddr_in structure
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons( 8888 );
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons( SERVER_PORT );
 
     //Bind
-    if ( bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0) {
+    if ( bind(server.listen_sock,(struct sockaddr *)&addr , sizeof(addr)) < 0) {
         fprintf(stderr, "bind failed. Error");
         return 1;
     }
     DPRINT("bind done\n");
 
     //Listen
-    listen(socket_desc , 3);
+    listen(server.listen_sock , SERVER_BACKLOG);
+    fcntl(server.listen_sock, F_SETFL, fcntl(server.listen_sock, F_GETFL) | O_NONBLOCK);
+
+    if (pipe(server.wakeup) < 0) {
+        fprintf(stderr, "pipe failed");
+        return 1;
+    }
+    fcntl(server.wakeup[0], F_SETFL, fcntl(server.wakeup[0], F_GETFL) | O_NONBLOCK);
+    fcntl(server.wakeup[1], F_SETFL, fcntl(server.wakeup[1], F_GETFL) | O_NONBLOCK);
+#ifdef __linux__
+    server.epoll_fd = epoll_create(SERVER_EVENTS);
+    if (server.epoll_fd < 0) {
+        fprintf(stderr, "epoll_create failed");
+        return 1;
+    }
+    server_watch(EPOLL_CTL_ADD, server.listen_sock, &server.listen_sock, SERVER_WANT_READ);
+    server_watch(EPOLL_CTL_ADD, server.wakeup[0], &server.wakeup, SERVER_WANT_READ);
+#endif
+    if (pthread_create(&camera_thread, NULL, server_camera_thread, NULL)) {
+        fprintf(stderr, "Could not create camera thread");
+        return 1;
+    }
 
     //Accept and incoming connection
     DPRINT("Waiting for incoming connections...\n");
-    c = sizeof(struct sockaddr_in);
+    gettimeofday(&idle_since, NULL);
 
     while ( true ) {
-        fd_set rfds;
-        struct timeval tv;
-        int retval;
-        FD_ZERO(&rfds);
-        FD_SET(socket_desc, &rfds);
-        tv.tv_sec = servermode_timeout;
-        tv.tv_usec = 0;
-        retval = select(socket_desc+1, &rfds, NULL, NULL, &tv);
-
-        if (retval == -1) {
-            DPRINT("select error\n");
-            exit(1);
-        } else if (retval) {
-            client_sock = accept(socket_desc, (struct sockaddr *)&client, (socklen_t*)&c);
-            if (client_sock < 0) {
-                fprintf(stderr, "accept failed");
-                return 1;
-            }
-            DPRINT("Connection accepted\n");
-        } else {
-            DPRINT("Timeout\n");
-            close(socket_desc);
-            exit(0);
-        }
-
-        //Receive a message from client
-        while ( (read_size = recv(client_sock , client_message , 2000 , 0)) > 0 ) {
-            client_message[read_size]='\0';
-            strip( client_message );
-            DPRINT(":%s:\n",client_message);
-            if ( !strcmp(client_message, "stopserver" ) ) {
-                if ( camhandle ) {
-                    camera_close(camhandle);
-                }
-                write_socket_answer("0\n");
-                exit(0);
-            } else if ( !strcmp(client_message, "disconnect" ) ) {
-                if ( camhandle ) {
-                    camera_close(camhandle);
-                }
-                write_socket_answer("0\n");
-            } else if ( (arg = is_string_prefix( client_message, "echo")) != NULL ) {
-                sprintf( buf, "0 %.100s\n", arg);
-                write_socket_answer(buf);
-            } else if (  (arg = is_string_prefix( client_message, "usleep")) != NULL ) {
-                int microseconds = atoi(arg);
-                usleep(microseconds);
-                write_socket_answer("0\n");
-            } else if ( !strcmp(client_message, "connect") ) {
-                if ( camhandle ) {
-                    write_socket_answer("0\n");
-                } else if ( (camhandle = camera_connect( NULL, NULL, -1, buf ))  ) {
-                    write_socket_answer("0\n");
-                } else {
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "update_status") ) {
-                if ( check_camera(camhandle) ) {
-                    if ( !pslr_get_status(camhandle, &status) ) {
-                        sprintf( buf, "%d\n", 0);
-                    } else {
-                        sprintf( buf, "%d\n", 1);
-                    }
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_camera_name") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %s\n", 0, pslr_camera_name(camhandle));
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_lens_name") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %s\n", 0, get_lens_name(status.lens_id1, status.lens_id2));
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_current_shutter_speed") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %d/%d\n", 0, status.current_shutter_speed.nom, status.current_shutter_speed.denom);
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_current_aperture") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %s\n", 0, format_rational( status.current_aperture, "%.1f"));
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_current_iso") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %d\n", 0, status.current_iso);
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_bufmask") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %d\n", 0, status.bufmask);
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_auto_bracket_mode") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %d\n", 0, status.auto_bracket_mode);
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "get_auto_bracket_picture_count") ) {
-                if ( check_camera(camhandle) ) {
-                    sprintf(buf, "%d %d\n", 0, status.auto_bracket_picture_count);
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "focus") ) {
-                if ( check_camera(camhandle) ) {
-                    pslr_focus(camhandle);
-                    sprintf(buf, "%d\n", 0);
-                    write_socket_answer(buf);
-                }
-            } else if ( !strcmp(client_message, "shutter") ) {
-                if ( check_camera(camhandle) ) {
-                    pslr_shutter(camhandle);
-                    sprintf(buf, "%d\n", 0);
-                    write_socket_answer(buf);
-                }
-            } else if (  (arg = is_string_prefix( client_message, "delete_buffer")) != NULL ) {
-                int bufno = atoi(arg);
-                if ( check_camera(camhandle) ) {
-                    pslr_delete_buffer(camhandle,bufno);
-                    sprintf(buf, "%d\n", 0);
-                    write_socket_answer(buf);
-                }
-            } else if (  (arg = is_string_prefix( client_message, "get_preview_buffer")) != NULL ) {
-                int bufno = atoi(arg);
-                if ( check_camera(camhandle) ) {
-                    uint8_t *pImage;
-                    uint32_t imageSize;
-                    if ( pslr_get_buffer(camhandle, bufno, PSLR_BUF_PREVIEW, 4, &pImage, &imageSize) ) {
-                        sprintf(buf, "%d %d\n", 1, imageSize);
-                        write_socket_answer(buf);
-                    } else {
-                        sprintf(buf, "%d %d\n", 0, imageSize);
-                        write_socket_answer(buf);
-                        write_socket_answer_bin(pImage, imageSize);
-                    }
-                }
-            } else if (  (arg = is_string_prefix( client_message, "get_buffer")) != NULL ) {
-                int bufno = atoi(arg);
-                if ( check_camera(camhandle) ) {
-                    uint32_t imageSize;
-                    if ( pslr_buffer_open(camhandle, bufno, PSLR_BUF_DNG, 0) ) {
-                        sprintf(buf, "%d\n", 1);
-                        write_socket_answer(buf);
-                    } else {
-                        imageSize = pslr_buffer_get_size(camhandle);
-                        sprintf(buf, "%d %d\n", 0, imageSize);
-                        write_socket_answer(buf);
-                        uint32_t current = 0;
-                        while (1) {
-                            uint32_t bytes;
-                            uint8_t buf[65536];
-                            bytes = pslr_buffer_read(camhandle, buf, sizeof (buf));
-                            if (bytes == 0) {
-                                break;
-                            }
-                            write_socket_answer_bin( buf, bytes);
-                            current += bytes;
-                        }
-                        pslr_buffer_close(camhandle);
-                    }
-                }
-            } else if (  (arg = is_string_prefix( client_message, "set_shutter_speed")) != NULL ) {
-                if ( check_camera(camhandle) ) {
-                    // TODO: merge with pktriggercord-cli shutter speed parse
-                    if (sscanf(arg, "1/%d%c", &shutter_speed.denom, &C) == 1) {
-                        shutter_speed.nom = 1;
-                        sprintf(buf, "%d %d %d\n", 0, shutter_speed.nom, shutter_speed.denom);
-                    } else if ((sscanf(arg, "%f%c", &F, &C)) == 1) {
-                        if (F < 2) {
-                            F = F * 10;
-                            shutter_speed.denom = 10;
-                            shutter_speed.nom = F;
-                        } else {
-                            shutter_speed.denom = 1;
-                            shutter_speed.nom = F;
-                        }
-                        sprintf(buf, "%d %d %d\n", 0, shutter_speed.nom, shutter_speed.denom);
-                    } else {
-                        shutter_speed.nom = 0;
-                        sprintf(buf,"1 Invalid shutter speed value.\n");
-                    }
-                    if (shutter_speed.nom) {
-                        pslr_set_shutter(camhandle, shutter_speed);
-                    }
-                    write_socket_answer(buf);
-                }
-            } else if (  (arg = is_string_prefix( client_message, "set_iso")) != NULL ) {
-                if ( check_camera(camhandle) ) {
-                    // TODO: merge with pktriggercord-cli shutter iso
-                    if (sscanf(arg, "%d-%d%c", &auto_iso_min, &auto_iso_max, &C) != 2) {
-                        auto_iso_min = 0;
-                        auto_iso_max = 0;
-                        iso = atoi(arg);
-                    } else {
-                        iso = 0;
-                    }
-                    if (iso==0 && auto_iso_min==0) {
-                        sprintf(buf,"1 Invalid iso value.\n");
-                    } else {
-                        pslr_set_iso(camhandle, iso, auto_iso_min, auto_iso_max);
-                        sprintf(buf, "%d %d %d-%d\n", 0, iso, auto_iso_min, auto_iso_max);
-                    }
-                    write_socket_answer(buf);
-                }
-            } else {
-                write_socket_answer("1 Invalid servermode command\n");
+        int timeout_ms = -1;
+        if (!server_has_clients()) {
+            gettimeofday(&current_time, NULL);
+            timeout_ms = servermode_timeout * 1000 - timeval_diff(&current_time, &idle_since) / 1000;
+            if (timeout_ms <= 0) {
+                DPRINT("Timeout\n");
+                pthread_mutex_lock(&server.lock);
+                server.stopping = true;
+                pthread_cond_signal(&server.cond);
+                pthread_mutex_unlock(&server.lock);
+                break;
             }
         }
+        if (server_stopped(&stop_time)) {
+            break;
+        }
+        server_poll(stop_time.tv_sec ? 100 : timeout_ms);
+        if (server_has_clients()) {
+            gettimeofday(&idle_since, NULL);
+        }
+    }
 
-        if (read_size == 0) {
-            DPRINT("Client disconnected\n");
-            fflush(stdout);
-        } else if (read_size == -1) {
-            fprintf(stderr, "recv failed\n");
+    pthread_join(camera_thread, NULL);
+    if (server.camhandle) {
+        camera_close(server.camhandle);
+        server.camhandle = NULL;
+    }
+    while ((client = server.clients) != NULL) {
+        server.clients = client->next;
+        if (client->sock >= 0) {
+            close(client->sock);
         }
+        server_client_free(client);
     }
+#ifdef __linux__
+    close(server.epoll_fd);
+#endif
+    close(server.wakeup[0]);
+    close(server.wakeup[1]);
+    close(server.listen_sock);
     return 0;
 }
 #endif
@@ -68,6 +68,7 @@ void set_preview_icon(int n, GdkPixbuf *pBuf);
 void error_message(const gchar *message);
 
 static gboolean status_poll(gpointer data);
+static gboolean hotplug_event(GIOChannel *source, GIOCondition condition, gpointer data);
 static void update_image_areas(int buffer, bool main);
 
 static void init_controls(pslr_status *st_new, pslr_status *st_old);
@@ -80,7 +81,7 @@ static void which_iso_table(pslr_status *st, const int **table, int *steps);
 static void which_ec_table(pslr_status *st, const int **table, int *steps);
 static bool is_inside(int rect_x, int rect_y, int rect_w, int rect_h, int px, int py);
 
-static void save_buffer(int bufno, const char *filename);
+static int save_buffer(int bufno, const char *filename);
 
 /* ----------------------------------------------------------------------- */
 
@@ -200,6 +201,11 @@ bool dangerous = false;
 bool dangerous_camera_connected = false;
 bool in_initcontrols = false;
 
+/* with hotplug events the camera is only looked for after a device was added */
+static int hotplug_fd = -1;
+static int hotplug_retries = 1;         // status polls left to look for the camera
+#define HOTPLUG_RETRIES 3
+
 static const int THUMBNAIL_WIDTH = 160;
 static const int THUMBNAIL_HEIGHT = 120;
 static const int HISTOGRAM_WIDTH = 640;
@@ -291,6 +297,10 @@ int common_init(void) {
 
     init_controls(NULL, NULL);
 
+    hotplug_fd = pslr_hotplug_open();
+    if ( hotplug_fd != -1 ) {
+        g_io_add_watch(g_io_channel_unix_new(hotplug_fd), G_IO_IN, hotplug_event, NULL);
+    }
     g_timeout_add(1000, status_poll, 0);
 
     gtk_widget_show(widget);
@@ -624,6 +634,23 @@ static void init_controls(pslr_status *st_new, pslr_status *st_old) {
 static pslr_status cam_status[2];
 static pslr_status *status_new = NULL;
 static pslr_status *status_old = NULL;
+static bool buffer_save_active = false;
+
+static gboolean hotplug_event(GIOChannel *source, GIOCondition condition, gpointer data) {
+    int r = pslr_hotplug_wait(hotplug_fd, 0);
+    if ( r == -1 ) {
+        /* back to polling */
+        pslr_hotplug_close(hotplug_fd);
+        hotplug_fd = -1;
+        return FALSE;
+    }
+    if ( r > 0 && !camhandle ) {
+        /* udev may need a few moments for the device node */
+        hotplug_retries = HOTPLUG_RETRIES;
+        status_poll(NULL);
+    }
+    return TRUE;
+}
 
 static gboolean status_poll(gpointer data) {
     GtkWidget *pw;
@@ -633,7 +660,7 @@ static gboolean status_poll(gpointer data) {
     static bool status_poll_inhibit = false;
 
     DPRINT("start status_poll\n");
-    if (status_poll_inhibit) {
+    if (status_poll_inhibit || buffer_save_active) {
         return TRUE;
     }
 
@@ -646,6 +673,14 @@ static gboolean status_poll(gpointer data) {
             status_poll_inhibit = false;
             return TRUE;
         }
+        if ( hotplug_fd != -1 && hotplug_retries == 0 ) {
+            /* Nothing was plugged in since the last try */
+            status_poll_inhibit = false;
+            return TRUE;
+        }
+        if ( hotplug_retries > 0 ) {
+            --hotplug_retries;
+        }
         camhandle = pslr_init( NULL, NULL );
         if (camhandle) {
             /* Try to reconnect */
@@ -663,10 +698,12 @@ static gboolean status_poll(gpointer data) {
             if ( ret == -1 ) {
                 gtk_statusbar_pop(statusbar, sbar_connect_ctx);
                 gtk_statusbar_push(statusbar, sbar_connect_ctx, "Unknown Pentax camera found.");
+                pslr_shutdown(camhandle);
                 camhandle=NULL;
             } else if ( ret != 0 ) {
                 gtk_statusbar_pop(statusbar, sbar_connect_ctx);
                 gtk_statusbar_push(statusbar, sbar_connect_ctx, "Cannot connect to Pentax camera.");
+                pslr_shutdown(camhandle);
                 camhandle=NULL;
             }
         }
@@ -709,6 +746,7 @@ static gboolean status_poll(gpointer data) {
     if (ret != PSLR_OK) {
         if (ret == PSLR_DEVICE_ERROR) {
             /* Camera disconnected */
+            pslr_shutdown(camhandle);
             camhandle = NULL;
         }
         DPRINT("pslr_get_status: %d\n", ret);
@@ -987,10 +1025,15 @@ static bool auto_save_check(int format, int buffer) {
     snprintf(filename, sizeof(filename), "%s%04d.%s", filebase, counter, file_formats[format].extension);
     DPRINT("Save buffer %d\n", buffer);
     gtk_progress_bar_set_text(pbar, filename);
-    save_buffer(buffer, filename);
+    ret = save_buffer(buffer, filename);
     gtk_progress_bar_set_text(pbar, NULL);
 
-    if (autodelete) {
+    if (ret != PSLR_OK) {
+        char msg[300];
+
+        snprintf(msg, sizeof(msg), "Could not save %s, the image stays on the camera", filename);
+        error_message(msg);
+    } else if (autodelete) {
         int retry;
         pslr_status st;
         /* Init bufmask to 1's so that we don't see buffer as deleted
@@ -1205,8 +1248,9 @@ G_MODULE_EXPORT gboolean main_drawing_area_button_press_event_cb(GtkAction *acti
     int ret;
     GtkWidget *pw;
 
-    /* Don't care about clicks on AF points if no camera is connected. */
-    if (!camhandle) {
+    /* Don't care about clicks on AF points if no camera is connected
+       or a buffer is being saved. */
+    if (!camhandle || buffer_save_active) {
         return TRUE;
     }
 
@@ -1933,22 +1977,68 @@ G_MODULE_EXPORT void preview_icon_view_selection_changed_cb(GtkAction *action) {
     gtk_widget_set_sensitive(GW("preview_delete_button"), en);
 }
 
+typedef struct {
+    int fd;
+    uint32_t current;
+    uint32_t length;
+    GtkWidget *bar;
+} save_buffer_progress_t;
+
+/*
+ * Called from pslr_buffer_save with each downloaded block while the
+ * library reads the next one.
+ */
+static int save_buffer_block(const uint8_t *buf, uint32_t bytes, uintptr_t user_data) {
+    save_buffer_progress_t *progress = (save_buffer_progress_t *) user_data;
+    ssize_t r = write(progress->fd, buf, bytes);
+    if (r == 0) {
+        DPRINT("write(buf): Nothing has been written to buf.\n");
+    } else if (r == -1) {
+        perror("write(buf)");
+        return 1;
+    } else if (r < bytes) {
+        DPRINT("write(buf): only write %d bytes, should be %d bytes.\n", r, bytes);
+    }
+
+    progress->current += bytes;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress->bar), (gdouble) progress->current / (gdouble) progress->length);
+    /* process pending events */
+    while (gtk_events_pending()) {
+        gtk_main_iteration();
+    }
+    return 0;
+}
+
+/*
+ * The reader thread of pslr_buffer_save owns the camera while the sink
+ * runs the main loop. No handler may send camera commands until the
+ * save is done, so the camera widgets are disabled meanwhile.
+ */
+static void camera_widgets_block(bool block) {
+    buffer_save_active = block;
+    init_controls(block ? NULL : status_new, status_old);
+    gtk_widget_set_sensitive(GW("preview_icon_view"), !block);
+    if (block) {
+        gtk_widget_set_sensitive(GW("preview_save_as_button"), FALSE);
+        gtk_widget_set_sensitive(GW("preview_delete_button"), FALSE);
+    } else {
+        preview_icon_view_selection_changed_cb(NULL);
+    }
+}
+
 /*
  * Save the indicated buffer using the current UI file format
  * settings.  Updates the progress bar periodically & runs the GTK
  * main loop to show it.
  */
-static void save_buffer(int bufno, const char *filename) {
+static int save_buffer(int bufno, const char *filename) {
     int r;
-    int fd;
     GtkWidget *pw;
     int quality;
     int resolution;
     int filefmt;
     pslr_buffer_type imagetype;
-    uint8_t buf[65536];
-    uint32_t length;
-    uint32_t current;
+    save_buffer_progress_t progress;
 
     pw = GW("jpeg_quality_combo");
     quality = gtk_combo_box_get_active(GTK_COMBO_BOX(pw));
@@ -1969,45 +2059,30 @@ static void save_buffer(int bufno, const char *filename) {
     r = pslr_buffer_open(camhandle, bufno, imagetype, resolution);
     if (r != PSLR_OK) {
         DPRINT("Could not open buffer: %d\n", r);
-        return;
+        return r;
     }
 
-    length = pslr_buffer_get_size(camhandle);
-    current = 0;
+    progress.length = pslr_buffer_get_size(camhandle);
+    progress.current = 0;
 
-    fd = open(filename, FILE_ACCESS, 0664);
-    if (fd == -1) {
+    progress.fd = open(filename, FILE_ACCESS, 0664);
+    if (progress.fd == -1) {
         perror("could not open target");
-        return;
+        pslr_buffer_close(camhandle);
+        return PSLR_PARAM;
     }
 
-    pw = GW("download_progress");
-
-    while (1) {
-        uint32_t bytes;
-        bytes = pslr_buffer_read(camhandle, buf, sizeof(buf));
-        //printf("Read %d bytes\n", bytes);
-        if (bytes == 0) {
-            break;
-        }
-        ssize_t r = write(fd, buf, bytes);
-        if (r == 0) {
-            DPRINT("write(buf): Nothing has been written to buf.\n");
-        } else if (r == -1) {
-            perror("write(buf)");
-        } else if (r < bytes) {
-            DPRINT("write(buf): only write %d bytes, should be %d bytes.\n", r, bytes);
-        }
+    progress.bar = GW("download_progress");
 
-        current += bytes;
-        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(pw), (gdouble) current / (gdouble) length);
-        /* process pending events */
-        while (gtk_events_pending()) {
-            gtk_main_iteration();
-        }
-    }
-    close(fd);
+    camera_widgets_block(true);
+    r = pslr_buffer_save(camhandle, save_buffer_block, (uintptr_t) &progress);
+    camera_widgets_block(false);
+    close(progress.fd);
     pslr_buffer_close(camhandle);
+    if (r != PSLR_OK) {
+        DPRINT("Could not save buffer: %d\n", r);
+    }
+    return r;
 }
 
 G_MODULE_EXPORT void preview_save_as_cb(GtkAction *action) {
@@ -2038,7 +2113,9 @@ G_MODULE_EXPORT void preview_save_as_cb(GtkAction *action) {
             filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (pw));
             DPRINT("Save to: %s\n", filename);
             gtk_progress_bar_set_text(pbar, filename);
-            save_buffer(*pi, filename);
+            if (save_buffer(*pi, filename) != PSLR_OK) {
+                error_message("Could not save the image");
+            }
             gtk_progress_bar_set_text(pbar, NULL);
         }
     }
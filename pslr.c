@@ -34,6 +34,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
@@ -46,16 +47,35 @@
 #include <stdarg.h>
 #include <dirent.h>
 #include <math.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "pslr.h"
 #include "pslr_scsi.h"
 #include "pslr_lens.h"
-
-#define POLL_INTERVAL 50000 /* Number of us to wait when polling */
+#include "pslr_virtual.h"
+
+#define POLL_INTERVAL 50000 /* Max number of us to wait when polling */
+#define POLL_MIN_INTERVAL 100 /* First backoff step when the learned latency is unknown */
+#define POLL_EWMA_SHIFT 3 /* learned latency = 7/8 old + 1/8 new */
+#define HOTPLUG_SETTLE_MS 50 /* first retry after a device was added */
+#define HOTPLUG_SETTLE_MAX_MS 1600 /* the retry delay doubles up to this */
+#define STATUS_CACHE_TTL 0 /* us a full status is reused, off unless set */
+#define STATUS_DELTA_MAX 64 /* changed fields re-derived one by one, more get a full parse */
+#define TRACE_SLOW_USEC 5000000 /* slower transactions are dumped to the trace file */
 #define BLKSZ 65536 /* Block size for downloads; if too big, we get
                      * memory allocation error from sg driver */
+#define MAX_BLKSZ (1024 * 1024) /* Largest block size probed */
+#define PIPELINE_BLOCKS 4 /* Ring size of pslr_buffer_save */
 #define BLOCK_RETRY 3 /* Number of retries, since we can occasionally
                        * get SCSI errors when downloading data */
+#define SEGMENT_INFO_MAX_DELAY 100000 /* Max us between segment info reads */
+#define SEGMENT_INFO_TIMEOUT 2000000 /* Max us to wait for a ready segment info */
+
+/* The original code needed 100 ms after every segment step. Models only
+   get a shorter timing table once it is verified on the camera. */
+static ipslr_model_timing_t default_model_timing = { 100000, 100000 };
 
 #define CHECK(x) do {                           \
         int __r;                                \
@@ -74,8 +94,6 @@ void sleep_sec(double sec) {
     usleep(1000000*(sec-floor(sec)));
 }
 
-ipslr_handle_t pslr;
-
 static int ipslr_set_mode(ipslr_handle_t *p, uint32_t mode);
 static int ipslr_cmd_00_09(ipslr_handle_t *p, uint32_t mode);
 static int ipslr_cmd_10_0a(ipslr_handle_t *p, uint32_t mode);
@@ -86,21 +104,33 @@ static int ipslr_press_shutter(ipslr_handle_t *p, bool fullpress);
 static int ipslr_select_buffer(ipslr_handle_t *p, int bufno, pslr_buffer_type buftype, int bufres);
 static int ipslr_buffer_segment_info(ipslr_handle_t *p, pslr_buffer_segment_info *pInfo);
 static int ipslr_next_segment(ipslr_handle_t *p);
-static int ipslr_download(ipslr_handle_t *p, uint32_t addr, uint32_t length, uint8_t *buf);
+static int ipslr_download(ipslr_handle_t *p, uint32_t addr, uint32_t length, uint8_t *buf, uint32_t end);
 static int ipslr_identify(ipslr_handle_t *p);
 static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...);
 #define ipslr_write_args(p,n,...) _ipslr_write_args(0,(p),(n),__VA_ARGS__)
 #define ipslr_write_args_special(p,n,...) _ipslr_write_args(4,(p),(n),__VA_ARGS__)
 
-static int command(FDTYPE fd, int a, int b, int c);
-static int get_status(FDTYPE fd);
-static int get_result(FDTYPE fd);
-static int read_result(FDTYPE fd, uint8_t *buf, uint32_t n);
+static uint32_t ipslr_usec_since(struct timeval *start);
+
+static ipslr_model_timing_t *ipslr_model_timing(ipslr_handle_t *p) {
+    return p->model && p->model->timing ? p->model->timing : &default_model_timing;
+}
+static int command(ipslr_handle_t *p, int a, int b, int c);
+static int read_status(ipslr_handle_t *p, uint8_t *buf);
+static int ipslr_transport_read(ipslr_handle_t *p, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen);
+static int ipslr_transport_write(ipslr_handle_t *p, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen);
+static int ipslr_transport_submit(ipslr_handle_t *p, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                                  uint8_t *buf, uint32_t bufLen, int *pack_id);
+static int ipslr_transport_complete(ipslr_handle_t *p, int pack_id);
+static int ipslr_async_drain(ipslr_handle_t *p);
+static void ipslr_command_sent(ipslr_handle_t *p, int a, int b);
+static int ipslr_trace_write(ipslr_handle_t *p, const char *filename);
+static int get_status(ipslr_handle_t *p);
+static int get_result(ipslr_handle_t *p);
+static int read_result(ipslr_handle_t *p, uint8_t *buf, uint32_t n);
 
 void hexdump(uint8_t *buf, uint32_t bufLen);
 
-static pslr_progress_callback_t progress_callback = NULL;
-
 user_file_format_t file_formats[3] = {
     { USER_FILE_FORMAT_PEF, "PEF", "pef"},
     { USER_FILE_FORMAT_DNG, "DNG", "dng"},
@@ -111,6 +141,11 @@ user_file_format_t file_formats[3] = {
 const char* valid_vendors[3] = {"PENTAX", "SAMSUNG", "RICOHIMG"};
 const char* valid_models[3] = {"DIGITAL_CAMERA", "DSC", "Digital Camera"};
 
+static bool ipslr_is_camera_drive(const char *vendorId, const char *productId) {
+    return find_in_array( valid_vendors, sizeof(valid_vendors)/sizeof(valid_vendors[0]), (char *) vendorId) != -1
+           && find_in_array( valid_models, sizeof(valid_models)/sizeof(valid_models[0]), (char *) productId) != -1;
+}
+
 // x18 subcommands to change camera properties
 // X18_n: unknown effect
 typedef enum {
@@ -189,19 +224,19 @@ typedef enum {
 /* a different write_args function needs to be done with slightly changed */
 /* command sequence. Original function was ipslr_write_args(). */
 
-int pslr_get_buffer_status(pslr_handle_t *h, uint32_t *x, uint32_t *y) {
+static int ipslr_get_buffer_status(pslr_handle_t *h, uint32_t *x, uint32_t *y) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     DPRINT("[C]\t\tipslr_get_buffer_status()\n");
     uint8_t buf[8];
     int n;
 
-    CHECK(command(p->fd, 0x02, 0x00, 0));
-    n = get_result(p->fd);
+    CHECK(command(p, 0x02, 0x00, 0));
+    n = get_result(p);
     DPRINT("[C]\t\tipslr_get_buffer_status() bytes: %d\n",n);
     if (n!= 8) {
         return PSLR_READ_ERROR;
     }
-    CHECK(read_result(p->fd, buf, n));
+    CHECK(read_result(p, buf, n));
     int i;
     for (i=0; i<n; ++i) {
         DPRINT("[C]\t\tbuf[%d]=%02x\n",i,buf[i]);
@@ -217,13 +252,23 @@ int pslr_get_buffer_status(pslr_handle_t *h, uint32_t *x, uint32_t *y) {
     return PSLR_OK;
 }
 
+int pslr_get_buffer_status(pslr_handle_t *h, uint32_t *x, uint32_t *y) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_get_buffer_status(h, x, y);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 /* Commands in form 23 XX YY. I know it is stupid, but ipslr_cmd functions  */
 /* are sooooo handy.                                                        */
 static int ipslr_cmd_23_XX(ipslr_handle_t *p, char XX, char YY, uint32_t mode) {
     DPRINT("[C]\t\tipslr_cmd_23_XX(%x, %x, mode=%x)\n", XX, YY, mode);
     CHECK(ipslr_write_args(p, 1, mode));
-    CHECK(command(p->fd, 0x23, XX, YY));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x23, XX, YY));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
@@ -237,8 +282,8 @@ static int ipslr_cmd_23_06(ipslr_handle_t *p, char debug_on_off) {
     } else {
         CHECK(ipslr_write_args_special(p, 4,1,1,0,0));
     }
-    CHECK(command(p->fd, 0x23, 0x06, 0x14));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x23, 0x06, 0x14));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
@@ -248,8 +293,8 @@ static int ipslr_cmd_23_04(ipslr_handle_t *p) {
     DPRINT("[C]\t\tipslr_cmd_23_04()\n");
     CHECK(ipslr_write_args(p, 1, 3)); // posebni ARGS-i
     CHECK(ipslr_write_args_special(p, 1, 1)); // posebni ARGS-i
-    CHECK(command(p->fd, 0x23, 0x04, 0x08));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x23, 0x04, 0x08));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
@@ -262,10 +307,10 @@ int debug_onoff(ipslr_handle_t *p, char debug_mode) {
     ipslr_cmd_00_09(p,1);
 
     ipslr_cmd_23_XX(p,0x07,0x04,3);
-    read_result(p->fd,buf,0x10);
+    read_result(p,buf,0x10);
 
     ipslr_cmd_23_XX(p,0x05,0x04,3);
-    read_result(p->fd,buf,0x04);
+    read_result(p,buf,0x04);
     ipslr_status(p,buf);
 
     if (debug_mode==0) {
@@ -298,7 +343,7 @@ user_file_format_t *get_file_format_t( user_file_format uff ) {
     return NULL;
 }
 
-int pslr_set_user_file_format(pslr_handle_t h, user_file_format uff) {
+static int ipslr_set_user_file_format(pslr_handle_t h, user_file_format uff) {
     switch ( uff ) {
         case USER_FILE_FORMAT_PEF:
             pslr_set_image_format(h, PSLR_IMAGE_FORMAT_RAW);
@@ -317,6 +362,16 @@ int pslr_set_user_file_format(pslr_handle_t h, user_file_format uff) {
     return PSLR_OK;
 }
 
+int pslr_set_user_file_format(pslr_handle_t h, user_file_format uff) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_user_file_format(h, uff);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 user_file_format get_user_file_format( pslr_status *st ) {
     int rawfmt = st->raw_format;
     int imgfmt = st->image_format;
@@ -362,6 +417,24 @@ pslr_gui_exposure_mode_t exposure_mode_conversion( pslr_exposure_mode_t exp ) {
     return 0;
 }
 
+static ipslr_handle_t *ipslr_handle_new(FDTYPE fd, pslr_transport_t *transport) {
+    ipslr_handle_t *p = calloc(1, sizeof (ipslr_handle_t));
+    pthread_mutexattr_t attr;
+
+    if (p == NULL) {
+        return NULL;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&p->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&p->status_lock, NULL);
+    p->fd = fd;
+    p->transport = transport;
+    p->status_cache_ttl = STATUS_CACHE_TTL;
+    return p;
+}
+
 pslr_handle_t pslr_init( char *model, char *device ) {
     FDTYPE fd;
     char vendorId[20];
@@ -369,11 +442,12 @@ pslr_handle_t pslr_init( char *model, char *device ) {
     int driveNum;
     char **drives;
     const char *camera_name;
+    ipslr_handle_t *p;
 
     DPRINT("[C]\tplsr_init()\n");
 
     if ( device == NULL ) {
-        drives = get_drives(&driveNum);
+        drives = get_drives_matching(&driveNum, ipslr_is_camera_drive);
     } else {
         driveNum = 1;
         drives = malloc( driveNum * sizeof(char*) );
@@ -384,37 +458,41 @@ pslr_handle_t pslr_init( char *model, char *device ) {
     DPRINT("driveNum:%d\n",driveNum);
     int i;
     for ( i=0; i<driveNum; ++i ) {
-        pslr_result result = get_drive_info( drives[i], &fd, vendorId, sizeof(vendorId), productId, sizeof(productId));
+        pslr_transport_t *transport = pslr_virtual_is_device( drives[i] ) ? &pslr_virtual_transport : &pslr_scsi_transport;
+        pslr_result result = transport->get_drive_info( drives[i], &fd, vendorId, sizeof(vendorId), productId, sizeof(productId));
 
         DPRINT("\tChecking drive:  %s %s %s\n", drives[i], vendorId, productId);
-        if ( find_in_array( valid_vendors, sizeof(valid_vendors)/sizeof(valid_vendors[0]),vendorId) != -1
-                && find_in_array( valid_models, sizeof(valid_models)/sizeof(valid_models[0]), productId) != -1 ) {
+        if ( ipslr_is_camera_drive( vendorId, productId ) ) {
             if ( result == PSLR_OK ) {
                 DPRINT("\tFound camera %s %s\n", vendorId, productId);
-                pslr.fd = fd;
+                p = ipslr_handle_new(fd, transport);
+                if ( p == NULL ) {
+                    transport->close_drive( &fd );
+                    continue;
+                }
                 if ( model != NULL ) {
                     // user specified the camera model
-                    camera_name = pslr_camera_name( &pslr );
+                    camera_name = pslr_camera_name( p );
                     DPRINT("\tName of the camera: %s\n", camera_name);
-                    if ( str_comparison_i( camera_name, model, strlen( camera_name) ) == 0 ) {
-                        return &pslr;
+                    if ( camera_name != NULL && str_comparison_i( camera_name, model, strlen( camera_name) ) == 0 ) {
+                        return p;
                     } else {
                         DPRINT("\tIgnoring camera %s %s\n", vendorId, productId);
-                        pslr_shutdown ( &pslr );
-                        pslr.id = 0;
-                        pslr.model = NULL;
+                        pslr_shutdown ( p );
                     }
                 } else {
-                    return &pslr;
+                    return p;
                 }
             } else {
                 DPRINT("\tCannot get drive info of Pentax camera. Please do not forget to install the program using 'make install'\n");
                 // found the camera but communication is not possible
-                close_drive( &fd );
                 continue;
             }
         } else {
-            close_drive( &fd );
+            // fd is only set if the drive was opened
+            if ( result == PSLR_OK ) {
+                transport->close_drive( &fd );
+            }
             continue;
         }
     }
@@ -422,7 +500,53 @@ pslr_handle_t pslr_init( char *model, char *device ) {
     return NULL;
 }
 
-int pslr_connect(pslr_handle_t h) {
+int pslr_hotplug_open(void) {
+    return hotplug_open();
+}
+
+int pslr_hotplug_wait(int fd, int timeout_ms) {
+    return hotplug_wait(fd, timeout_ms);
+}
+
+void pslr_hotplug_close(int fd) {
+    hotplug_close(fd);
+}
+
+pslr_handle_t pslr_init_wait(char *model, char *device, int hotplug_fd, int timeout_ms) {
+    struct timeval start_time;
+    pslr_handle_t h;
+    int settle_ms = 0;
+    int left = -1;
+
+    DPRINT("[C]\tpslr_init_wait(%d)\n", timeout_ms);
+    gettimeofday(&start_time, NULL);
+    while (!(h = pslr_init(model, device))) {
+        if (timeout_ms >= 0) {
+            left = timeout_ms - (int) (ipslr_usec_since(&start_time) / 1000);
+            if (left <= 0) {
+                return NULL;
+            }
+        }
+        if (hotplug_fd == -1) {
+            sleep_sec((left < 0 || left > 1000 ? 1000 : left) / 1000.0);
+        } else {
+            // udev may not have set up the device node yet, retry for a while
+            int wait = settle_ms > 0 && (left < 0 || left > settle_ms) ? settle_ms : left;
+            int r = hotplug_wait(hotplug_fd, wait);
+            if (r == -1) {
+                DPRINT("\thotplug events failed, polling\n");
+                hotplug_fd = -1;
+            } else if (r == 1) {
+                settle_ms = HOTPLUG_SETTLE_MS;
+            } else if (settle_ms > 0) {
+                settle_ms = settle_ms < HOTPLUG_SETTLE_MAX_MS ? settle_ms * 2 : 0;
+            }
+        }
+    }
+    return h;
+}
+
+static int ipslr_connect(pslr_handle_t h) {
     DPRINT("[C]\tpslr_connect()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     uint8_t statusbuf[28];
@@ -448,7 +572,17 @@ int pslr_connect(pslr_handle_t h) {
     return 0;
 }
 
-int pslr_disconnect(pslr_handle_t h) {
+int pslr_connect(pslr_handle_t h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_connect(h);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_disconnect(pslr_handle_t h) {
     DPRINT("[C]\tpslr_disconnect()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     uint8_t statusbuf[28];
@@ -458,26 +592,62 @@ int pslr_disconnect(pslr_handle_t h) {
     return PSLR_OK;
 }
 
+int pslr_disconnect(pslr_handle_t h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_disconnect(h);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 int pslr_shutdown(pslr_handle_t h) {
     DPRINT("[C]\tpslr_shutdown()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    close_drive(&p->fd);
+    int i;
+    for (i = 0; i < POLL_STATS_SIZE; ++i) {
+        pslr_poll_stats_t *st = &p->poll_stats[i];
+        if (st->count > 0) {
+            DPRINT("\tpoll %02X %02X: %d commands %d polls avg %d us max %d us total %d ms\n", st->command >> 8, st->command & 0xff,
+                   st->count, st->polls, st->avg_usec, st->max_usec, (int) (st->total_usec / 1000));
+        }
+    }
+    DPRINT("\tstatus cache: %d hits %d misses %d invalidations %d coalesced\n", p->status_cache_stats.hits,
+           p->status_cache_stats.misses, p->status_cache_stats.invalidations, p->status_cache_stats.coalesced);
+    if (p->shutter_stats.count > 0) {
+        DPRINT("\tshutter lag: %d presses last %d us min %d us avg %d us max %d us\n", p->shutter_stats.count,
+               p->shutter_stats.last_usec, p->shutter_stats.min_usec, p->shutter_stats.avg_usec, p->shutter_stats.max_usec);
+    }
+    pthread_mutex_lock(&p->lock);
+    p->transport->close_drive(&p->fd);
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->status_lock);
+    free(p->trace_file);
+    free(p);
     return PSLR_OK;
 }
 
 int pslr_shutter(pslr_handle_t h) {
     DPRINT("[C]\tpslr_shutter()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_press_shutter(p, true);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_press_shutter(p, true);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_focus(pslr_handle_t h) {
     DPRINT("[C]\tpslr_focus()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_press_shutter(p, false);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_press_shutter(p, false);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
-int pslr_get_status(pslr_handle_t h, pslr_status *ps) {
+static int ipslr_get_status(pslr_handle_t h, pslr_status *ps) {
     DPRINT("[C]\tpslr_get_status()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     memset( ps, 0, sizeof( pslr_status ));
@@ -490,6 +660,32 @@ int pslr_get_status(pslr_handle_t h, pslr_status *ps) {
     return PSLR_OK;
 }
 
+/* A call that comes in while another thread reads the full status waits
+   for that transfer and takes its result, whatever the cache TTL is. */
+int pslr_get_status(pslr_handle_t h, pslr_status *ps) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    bool reading;
+    uint32_t reads;
+    int ret;
+
+    pthread_mutex_lock(&p->status_lock);
+    reading = p->status_reading;
+    reads = p->status_reads;
+    pthread_mutex_unlock(&p->status_lock);
+
+    pthread_mutex_lock(&p->lock);
+    if (reading && p->status_reads != reads && p->status_cache_valid) {
+        DPRINT("[C]\tpslr_get_status() coalesced\n");
+        ++p->status_cache_stats.coalesced;
+        memcpy(ps, &p->status, sizeof (pslr_status));
+        ret = PSLR_OK;
+    } else {
+        ret = ipslr_get_status(h, ps);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 char *format_rational( pslr_rational_t rational, char * fmt ) {
     char *ret = malloc(32);
     if ( rational.denom == 0 ) {
@@ -571,7 +767,8 @@ char *collect_status_info( pslr_handle_t h, pslr_status status ) {
     sprintf(strbuffer+strlen(strbuffer),"%-32s: %.2f\n", "manual mode ev", (1.0 * status.manual_mode_ev / 10));
     sprintf(strbuffer+strlen(strbuffer),"%-32s: %s\n", "lens", get_lens_name(status.lens_id1, status.lens_id2));
     sprintf(strbuffer+strlen(strbuffer),"%-32s: %.2fV %.2fV %.2fV %.2fV\n", "battery", 0.01 * status.battery_1, 0.01 * status.battery_2, 0.01 * status.battery_3, 0.01 * status.battery_4);
-    sprintf(strbuffer+strlen(strbuffer),"%-32s: %s\n", "buffer mask", int_to_binary(status.bufmask));
+    char bufmask_bits[sizeof(status.bufmask)*8+1];
+    sprintf(strbuffer+strlen(strbuffer),"%-32s: %s\n", "buffer mask", int_to_binary(status.bufmask, bufmask_bits));
     return strbuffer;
 }
 
@@ -614,7 +811,7 @@ char *collect_settings_info( pslr_handle_t h, pslr_settings settings ) {
 }
 
 
-int pslr_get_status_buffer(pslr_handle_t h, uint8_t *st_buf) {
+static int ipslr_get_status_buffer(pslr_handle_t h, uint8_t *st_buf) {
     DPRINT("[C]\tpslr_get_status_buffer()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     memset( st_buf, 0, MAX_STATUS_BUF_SIZE);
@@ -624,16 +821,28 @@ int pslr_get_status_buffer(pslr_handle_t h, uint8_t *st_buf) {
     return PSLR_OK;
 }
 
+int pslr_get_status_buffer(pslr_handle_t h, uint8_t *st_buf) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_get_status_buffer(h, st_buf);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 int pslr_get_settings_buffer(pslr_handle_t h, uint8_t *st_buf) {
     DPRINT("[C]\tpslr_get_settings_buffer()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
     memset( st_buf, 0, SETTINGS_BUFFER_SIZE);
     memcpy(st_buf, p->settings_buffer, SETTINGS_BUFFER_SIZE);
+    pthread_mutex_unlock(&p->lock);
     return PSLR_OK;
 }
 
-int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
-                    uint8_t **ppData, uint32_t *pLen) {
+static int ipslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
+                            uint8_t **ppData, uint32_t *pLen) {
     DPRINT("[C]\tpslr_get_buffer()\n");
     uint8_t *buf = 0;
     int ret;
@@ -648,9 +857,14 @@ int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resol
         return PSLR_NO_MEMORY;
     }
 
-    uint32_t bytes = pslr_buffer_read(h, buf, size);
+    uint32_t bytes = 0;
+    uint32_t n;
+    while ( bytes < size && (n = pslr_buffer_read(h, buf + bytes, size - bytes)) > 0 ) {
+        bytes += n;
+    }
 
     if ( bytes != size ) {
+        free(buf);
         return PSLR_READ_ERROR;
     }
     pslr_buffer_close(h);
@@ -664,11 +878,70 @@ int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resol
     return PSLR_OK;
 }
 
+int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution,
+                    uint8_t **ppData, uint32_t *pLen) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_get_buffer(h, bufno, type, resolution, ppData, pLen);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 int pslr_set_progress_callback(pslr_handle_t h, pslr_progress_callback_t cb, uintptr_t user_data) {
-    progress_callback = cb;
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    p->progress_callback = cb;
+    pthread_mutex_unlock(&p->lock);
     return PSLR_OK;
 }
 
+int pslr_set_download_progress_callback(pslr_handle_t h, pslr_download_progress_callback_t cb, uintptr_t user_data) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    p->download_progress_callback = cb;
+    p->download_progress_user_data = user_data;
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_set_block_size_probe(pslr_handle_t h, bool probe) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    p->block_size_probe = probe;
+    if (!probe && p->block_size > BLKSZ) {
+        p->block_size = BLKSZ;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_get_download_stats(pslr_handle_t h, pslr_download_stats_t *stats) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    memcpy(stats, &p->download_stats, sizeof (pslr_download_stats_t));
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+static void ipslr_download_stats_start(ipslr_handle_t *p, uint32_t total) {
+    memset(&p->download_stats, 0, sizeof (p->download_stats));
+    p->download_stats.total = total;
+    p->download_transactions_start = p->transactions;
+    gettimeofday(&p->download_start, NULL);
+}
+
+static void ipslr_download_stats_update(ipslr_handle_t *p, uint32_t bytes) {
+    pslr_download_stats_t *st = &p->download_stats;
+    uint32_t usec = ipslr_usec_since(&p->download_start);
+    st->current += bytes;
+    st->block_size = p->block_size;
+    st->transactions = p->transactions - p->download_transactions_start;
+    st->mb_per_sec = usec > 0 ? 1.0 * st->current / usec : 0;
+    st->transactions_per_mb = st->current > 0 ? 1048576.0 * st->transactions / st->current : 0;
+}
+
 int ipslr_handle_command_x18( ipslr_handle_t *p, bool cmd9_wrap, int subcommand, int argnum,  ...) {
     DPRINT("[C]\t\tipslr_handle_command_x18(0x%x, %d)\n", subcommand, argnum);
     if ( cmd9_wrap ) {
@@ -687,8 +960,8 @@ int ipslr_handle_command_x18( ipslr_handle_t *p, bool cmd9_wrap, int subcommand,
     }
     va_end(ap);
     CHECK(ipslr_write_args(p, argnum, args[0], args[1], args[2], args[3]));
-    CHECK(command(p->fd, 0x18, subcommand, 4 * argnum));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x18, subcommand, 4 * argnum));
+    CHECK(get_status(p));
     if ( cmd9_wrap ) {
         CHECK(ipslr_cmd_00_09(p, 2));
     }
@@ -704,77 +977,113 @@ int pslr_test( pslr_handle_t h, bool cmd9_wrap, int subcommand, int argnum,  int
 int pslr_set_shutter(pslr_handle_t h, pslr_rational_t value) {
     DPRINT("[C]\tpslr_set_shutter(%x %x)\n", value.nom, value.denom);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_SHUTTER, 2, value.nom, value.denom, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_SHUTTER, 2, value.nom, value.denom, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_aperture(pslr_handle_t h, pslr_rational_t value) {
     DPRINT("[C]\tpslr_set_aperture(%x %x)\n", value.nom, value.denom);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, false, X18_APERTURE, 3, value.nom, value.denom, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, false, X18_APERTURE, 3, value.nom, value.denom, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_iso(pslr_handle_t h, uint32_t value, uint32_t auto_min_value, uint32_t auto_max_value) {
     DPRINT("[C]\tpslr_set_iso(0x%X, auto_min=%X, auto_max=%X)\n", value, auto_min_value, auto_max_value);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_ISO, 3, value, auto_min_value, auto_max_value);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_ISO, 3, value, auto_min_value, auto_max_value);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_ec(pslr_handle_t h, pslr_rational_t value) {
     DPRINT("[C]\tpslr_set_ec(0x%X 0x%X)\n", value.nom, value.denom);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_EC, 2, value.nom, value.denom, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_EC, 2, value.nom, value.denom, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_white_balance(pslr_handle_t h, pslr_white_balance_mode_t wb_mode) {
     DPRINT("[C]\tpslr_set_white_balance(0x%X)\n", wb_mode);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_WHITE_BALANCE, 1, wb_mode);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_WHITE_BALANCE, 1, wb_mode);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_white_balance_adjustment(pslr_handle_t h, pslr_white_balance_mode_t wb_mode, uint32_t wbadj_mg, uint32_t wbadj_ba) {
     DPRINT("[C]\tpslr_set_white_balance_adjustment(mode=0x%X, tint=0x%X, temp=0x%X)\n", wb_mode, wbadj_mg, wbadj_ba);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_WHITE_BALANCE_ADJ, 3, wb_mode, wbadj_mg, wbadj_ba);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_WHITE_BALANCE_ADJ, 3, wb_mode, wbadj_mg, wbadj_ba);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 
 int pslr_set_flash_mode(pslr_handle_t h, pslr_flash_mode_t value) {
     DPRINT("[C]\tpslr_set_flash_mode(%X)\n", value);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_FLASH_MODE, 1, value, 0, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_FLASH_MODE, 1, value, 0, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_flash_exposure_compensation(pslr_handle_t h, pslr_rational_t value) {
     DPRINT("[C]\tpslr_set_flash_exposure_compensation(%X %X)\n", value.nom, value.denom);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_FLASH_EXPOSURE_COMPENSATION, 2, value.nom, value.denom, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_FLASH_EXPOSURE_COMPENSATION, 2, value.nom, value.denom, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_drive_mode(pslr_handle_t h, pslr_drive_mode_t drive_mode) {
     DPRINT("[C]\tpslr_set_drive_mode(%X)\n", drive_mode);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_DRIVE_MODE, 1, drive_mode, 0, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_DRIVE_MODE, 1, drive_mode, 0, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_ae_metering_mode(pslr_handle_t h, pslr_ae_metering_t ae_metering_mode) {
     DPRINT("[C]\tpslr_set_ae_metering_mode(%X)\n", ae_metering_mode);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_AE_METERING_MODE, 1, ae_metering_mode, 0, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_AE_METERING_MODE, 1, ae_metering_mode, 0, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_af_mode(pslr_handle_t h, pslr_af_mode_t af_mode) {
     DPRINT("[C]\tpslr_set_af_mode(%X)\n", af_mode);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_AF_MODE, 1, af_mode, 0, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_AF_MODE, 1, af_mode, 0, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_set_af_point_sel(pslr_handle_t h, pslr_af_point_sel_t af_point_sel) {
     DPRINT("[C]\tpslr_set_af_point_sel(%X)\n", af_point_sel);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_AF_POINT_SEL, 1, af_point_sel, 0, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_AF_POINT_SEL, 1, af_point_sel, 0, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
-int pslr_set_jpeg_stars(pslr_handle_t h, int jpeg_stars ) {
+static int ipslr_set_jpeg_stars(pslr_handle_t h, int jpeg_stars ) {
     DPRINT("[C]\tpslr_set_jpeg_stars(%X)\n", jpeg_stars);
     int hwqual;
     ipslr_handle_t *p = (ipslr_handle_t *) h;
@@ -785,13 +1094,26 @@ int pslr_set_jpeg_stars(pslr_handle_t h, int jpeg_stars ) {
     return ipslr_handle_command_x18( p, true, X18_JPEG_STARS, 2, 1, hwqual, 0);
 }
 
+int pslr_set_jpeg_stars(pslr_handle_t h, int jpeg_stars ) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_jpeg_stars(h, jpeg_stars);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 int _get_user_jpeg_resolution( ipslr_model_info_t *model, int hwres ) {
     return model->jpeg_resolutions[hwres];
 }
 
 int pslr_get_jpeg_resolution(pslr_handle_t h, int hwres) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return _get_user_jpeg_resolution( p->model, hwres );
+    pthread_mutex_lock(&p->lock);
+    int ret = _get_user_jpeg_resolution( p->model, hwres );
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int _get_hw_jpeg_resolution( ipslr_model_info_t *model, int megapixel) {
@@ -805,11 +1127,14 @@ int _get_hw_jpeg_resolution( ipslr_model_info_t *model, int megapixel) {
 int pslr_set_jpeg_resolution(pslr_handle_t h, int megapixel) {
     DPRINT("[C]\tpslr_set_jpeg_resolution(%X)\n", megapixel);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
     int hwres = _get_hw_jpeg_resolution( p->model, megapixel );
-    return ipslr_handle_command_x18( p, true, X18_JPEG_RESOLUTION, 2, 1, hwres, 0);
+    int ret = ipslr_handle_command_x18( p, true, X18_JPEG_RESOLUTION, 2, 1, hwres, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
-int pslr_set_jpeg_image_tone(pslr_handle_t h, pslr_jpeg_image_tone_t image_tone) {
+static int ipslr_set_jpeg_image_tone(pslr_handle_t h, pslr_jpeg_image_tone_t image_tone) {
     DPRINT("[C]\tpslr_set_jpeg_image_tone(%X)\n", image_tone);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     if (image_tone < 0 || image_tone > PSLR_JPEG_IMAGE_TONE_MAX) {
@@ -818,7 +1143,17 @@ int pslr_set_jpeg_image_tone(pslr_handle_t h, pslr_jpeg_image_tone_t image_tone)
     return ipslr_handle_command_x18( p, true, X18_JPEG_IMAGE_TONE, 1, image_tone, 0, 0);
 }
 
-int pslr_set_jpeg_sharpness(pslr_handle_t h, int32_t sharpness) {
+int pslr_set_jpeg_image_tone(pslr_handle_t h, pslr_jpeg_image_tone_t image_tone) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_jpeg_image_tone(h, image_tone);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_jpeg_sharpness(pslr_handle_t h, int32_t sharpness) {
     DPRINT("[C]\tpslr_set_jpeg_sharpness(%X)\n", sharpness);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int hw_sharpness = sharpness + (pslr_get_model_jpeg_property_levels( h )-1) / 2;
@@ -828,7 +1163,17 @@ int pslr_set_jpeg_sharpness(pslr_handle_t h, int32_t sharpness) {
     return ipslr_handle_command_x18( p, false, X18_JPEG_SHARPNESS, 2, 0, hw_sharpness, 0);
 }
 
-int pslr_set_jpeg_contrast(pslr_handle_t h, int32_t contrast) {
+int pslr_set_jpeg_sharpness(pslr_handle_t h, int32_t sharpness) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_jpeg_sharpness(h, sharpness);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_jpeg_contrast(pslr_handle_t h, int32_t contrast) {
     DPRINT("[C]\tpslr_set_jpeg_contrast(%X)\n", contrast);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int hw_contrast = contrast + (pslr_get_model_jpeg_property_levels( h )-1) / 2;
@@ -838,7 +1183,17 @@ int pslr_set_jpeg_contrast(pslr_handle_t h, int32_t contrast) {
     return ipslr_handle_command_x18( p, false, X18_JPEG_CONTRAST, 2, 0, hw_contrast, 0);
 }
 
-int pslr_set_jpeg_hue(pslr_handle_t h, int32_t hue) {
+int pslr_set_jpeg_contrast(pslr_handle_t h, int32_t contrast) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_jpeg_contrast(h, contrast);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_jpeg_hue(pslr_handle_t h, int32_t hue) {
     DPRINT("[C]\tpslr_set_jpeg_hue(%X)\n", hue);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int hw_hue = hue + (pslr_get_model_jpeg_property_levels( h )-1) / 2;
@@ -850,7 +1205,17 @@ int pslr_set_jpeg_hue(pslr_handle_t h, int32_t hue) {
     return ipslr_handle_command_x18( p, false, X18_JPEG_HUE, 2, 0, hw_hue, 0);
 }
 
-int pslr_set_jpeg_saturation(pslr_handle_t h, int32_t saturation) {
+int pslr_set_jpeg_hue(pslr_handle_t h, int32_t hue) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_jpeg_hue(h, hue);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_jpeg_saturation(pslr_handle_t h, int32_t saturation) {
     DPRINT("[C]\tpslr_set_jpeg_saturation(%X)\n", saturation);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int hw_saturation = saturation + (pslr_get_model_jpeg_property_levels( h )-1) / 2;
@@ -860,7 +1225,17 @@ int pslr_set_jpeg_saturation(pslr_handle_t h, int32_t saturation) {
     return ipslr_handle_command_x18( p, false, X18_JPEG_SATURATION, 2, 0, hw_saturation, 0);
 }
 
-int pslr_set_image_format(pslr_handle_t h, pslr_image_format_t format) {
+int pslr_set_jpeg_saturation(pslr_handle_t h, int32_t saturation) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_jpeg_saturation(h, saturation);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_image_format(pslr_handle_t h, pslr_image_format_t format) {
     DPRINT("[C]\tpslr_set_image_format(%X)\n", format);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     if (format < 0 || format > PSLR_IMAGE_FORMAT_MAX) {
@@ -869,7 +1244,17 @@ int pslr_set_image_format(pslr_handle_t h, pslr_image_format_t format) {
     return ipslr_handle_command_x18( p, true, X18_IMAGE_FORMAT, 2, 1, format, 0);
 }
 
-int pslr_set_raw_format(pslr_handle_t h, pslr_raw_format_t format) {
+int pslr_set_image_format(pslr_handle_t h, pslr_image_format_t format) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_image_format(h, format);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_raw_format(pslr_handle_t h, pslr_raw_format_t format) {
     DPRINT("[C]\tpslr_set_raw_format(%X)\n", format);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     if (format < 0 || format > PSLR_RAW_FORMAT_MAX) {
@@ -878,7 +1263,17 @@ int pslr_set_raw_format(pslr_handle_t h, pslr_raw_format_t format) {
     return ipslr_handle_command_x18( p, true, X18_RAW_FORMAT, 2, 1, format, 0);
 }
 
-int pslr_set_color_space(pslr_handle_t h, pslr_color_space_t color_space) {
+int pslr_set_raw_format(pslr_handle_t h, pslr_raw_format_t format) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_raw_format(h, format);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_color_space(pslr_handle_t h, pslr_color_space_t color_space) {
     DPRINT("[C]\tpslr_set_raw_format(%X)\n", color_space);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     if (color_space < 0 || color_space > PSLR_COLOR_SPACE_MAX) {
@@ -887,87 +1282,438 @@ int pslr_set_color_space(pslr_handle_t h, pslr_color_space_t color_space) {
     return ipslr_handle_command_x18( p, true, X18_COLOR_SPACE, 1, color_space, 0, 0);
 }
 
+int pslr_set_color_space(pslr_handle_t h, pslr_color_space_t color_space) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
 
-int pslr_delete_buffer(pslr_handle_t h, int bufno) {
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_color_space(h, color_space);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+
+static int ipslr_delete_buffer(pslr_handle_t h, int bufno) {
     DPRINT("[C]\tpslr_delete_buffer(%X)\n", bufno);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     if (bufno < 0 || bufno > 9) {
         return PSLR_PARAM;
     }
     CHECK(ipslr_write_args(p, 1, bufno));
-    CHECK(command(p->fd, 0x02, 0x03, 0x04));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x02, 0x03, 0x04));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
-int pslr_green_button(pslr_handle_t h) {
+int pslr_delete_buffer(pslr_handle_t h, int bufno) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_delete_buffer(h, bufno);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_green_button(pslr_handle_t h) {
     DPRINT("[C]\tpslr_green_button()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    CHECK(command(p->fd, 0x10, X10_GREEN, 0x00));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x10, X10_GREEN, 0x00));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
-int pslr_dust_removal(pslr_handle_t h) {
+int pslr_green_button(pslr_handle_t h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_green_button(h);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_dust_removal(pslr_handle_t h) {
     DPRINT("[C]\tpslr_dust_removal()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    CHECK(command(p->fd, 0x10, X10_DUST, 0x00));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x10, X10_DUST, 0x00));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
-int pslr_bulb(pslr_handle_t h, bool on ) {
+int pslr_dust_removal(pslr_handle_t h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_dust_removal(h);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_bulb(pslr_handle_t h, bool on ) {
     DPRINT("[C]\tpslr_bulb(%d)\n", on);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     CHECK(ipslr_write_args(p, 1, on ? 1 : 0));
-    CHECK(command(p->fd, 0x10, X10_BULB, 0x04));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x10, X10_BULB, 0x04));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
-int pslr_button_test(pslr_handle_t h, int bno, int arg) {
+int pslr_bulb(pslr_handle_t h, bool on ) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_bulb(h, on);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_button_test(pslr_handle_t h, int bno, int arg) {
     DPRINT("[C]\tpslr_button_test(%X, %X)\n", bno, arg);
     int r;
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     CHECK(ipslr_write_args(p, 1, arg));
-    CHECK(command(p->fd, 0x10, bno, 4));
-    r = get_status(p->fd);
+    CHECK(command(p, 0x10, bno, 4));
+    r = get_status(p);
     DPRINT("\tbutton result code: 0x%x\n", r);
     return PSLR_OK;
 }
 
+int pslr_button_test(pslr_handle_t h, int bno, int arg) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
 
-int pslr_ae_lock(pslr_handle_t h, bool lock) {
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_button_test(h, bno, arg);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+
+static int ipslr_ae_lock(pslr_handle_t h, bool lock) {
     DPRINT("[C]\tpslr_ae_lock(%X)\n", lock);
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     if (lock) {
-        CHECK(command(p->fd, 0x10, X10_AE_LOCK, 0x00));
+        CHECK(command(p, 0x10, X10_AE_LOCK, 0x00));
     } else {
-        CHECK(command(p->fd, 0x10, X10_AE_UNLOCK, 0x00));
+        CHECK(command(p, 0x10, X10_AE_UNLOCK, 0x00));
     }
-    CHECK(get_status(p->fd));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
-int pslr_set_exposure_mode(pslr_handle_t h, pslr_exposure_mode_t mode) {
-    DPRINT("[C]\tpslr_set_exposure_mode(%X)\n", mode);
+int pslr_ae_lock(pslr_handle_t h, bool lock) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
 
-    if (mode < 0 || mode >= PSLR_EXPOSURE_MODE_MAX) {
-        return PSLR_PARAM;
-    }
-    return ipslr_handle_command_x18( p, true, X18_EXPOSURE_MODE, 2, 1, mode, 0);
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_ae_lock(h, lock);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
-int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int bufres) {
-    DPRINT("[C]\tpslr_buffer_open(#%X, type=%X, res=%X)\n", bufno, buftype, bufres);
-    pslr_buffer_segment_info info;
-    uint16_t bufs;
-    uint32_t buf_total = 0;
-    int i, j;
-    int ret;
+typedef enum {
+    SYNC_ARM,
+    SYNC_DISARM,
+    SYNC_SHUTTER,
+    SYNC_QUIT
+} ipslr_sync_op_t;
+
+typedef struct {
+    pslr_sync_group_t *group;
+    int index;
+} ipslr_sync_worker_t;
+
+/* One I/O thread per camera. Every operation runs between the start and
+   the done barrier; the shutter additionally waits on the fire barrier
+   after the arguments are written, so only the command itself remains.
+   The workers only join the barriers once all of them are started; if a
+   thread cannot be created, the gate sends the others home instead. */
+struct pslr_sync_group {
+    int count;
+    pslr_handle_t *handles;
+    pthread_t *threads;
+    ipslr_sync_worker_t *workers;
+    pthread_barrier_t start;
+    pthread_barrier_t fire;
+    pthread_barrier_t done;
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate;
+    int gate_state;       // 0: workers wait, 1: all started, -1: quit
+    ipslr_sync_op_t op;
+    pslr_sync_result_t *results;
+};
+
+static int64_t ipslr_monotonic_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ipslr_sync_shutter(pslr_sync_group_t *g, ipslr_handle_t *p, pslr_sync_result_t *result) {
+    int64_t accepted;
+
+    pthread_mutex_lock(&p->lock);
+    result->result = ipslr_write_args(p, 1, 2);
+    pthread_barrier_wait(&g->fire);
+    if (result->result == PSLR_OK) {
+        result->issue_usec = ipslr_monotonic_usec();
+        result->result = command(p, 0x10, X10_SHUTTER, 0x04);
+        if (result->result == PSLR_OK) {
+            get_status(p);
+        }
+        accepted = ipslr_monotonic_usec();
+        result->accept_usec = accepted - result->issue_usec;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* AF is skipped on manual focus and AE lock in the manual exposure modes,
+   the bodies ignore them there */
+static void ipslr_sync_arm(pslr_handle_t h, pslr_sync_result_t *result) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pslr_status status;
+
+    pthread_mutex_lock(&p->lock);
+    result->result = ipslr_get_status(h, &status);
+    if (result->result == PSLR_OK && status.af_mode != PSLR_AF_MODE_MF) {
+        result->result = ipslr_press_shutter(p, false);
+        result->focused = result->result == PSLR_OK;
+    }
+    if (result->result == PSLR_OK && status.exposure_mode != PSLR_GUI_EXPOSURE_MODE_M &&
+            status.exposure_mode != PSLR_GUI_EXPOSURE_MODE_B && status.exposure_mode != PSLR_GUI_EXPOSURE_MODE_X) {
+        result->result = ipslr_ae_lock(h, true);
+        result->ae_locked = result->result == PSLR_OK;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *ipslr_sync_worker(void *arg) {
+    ipslr_sync_worker_t *w = (ipslr_sync_worker_t *) arg;
+    pslr_sync_group_t *g = w->group;
+    pslr_handle_t h = g->handles[w->index];
+    pslr_sync_result_t *result = &g->results[w->index];
+    int gate_state;
+
+    pthread_mutex_lock(&g->gate_lock);
+    while (g->gate_state == 0) {
+        pthread_cond_wait(&g->gate, &g->gate_lock);
+    }
+    gate_state = g->gate_state;
+    pthread_mutex_unlock(&g->gate_lock);
+    if (gate_state < 0) {
+        return NULL;
+    }
+    while (true) {
+        pthread_barrier_wait(&g->start);
+        switch (g->op) {
+            case SYNC_ARM:
+                ipslr_sync_arm(h, result);
+                break;
+            case SYNC_DISARM:
+                result->result = pslr_ae_lock(h, false);
+                break;
+            case SYNC_SHUTTER:
+                ipslr_sync_shutter(g, (ipslr_handle_t *) h, result);
+                break;
+            case SYNC_QUIT:
+                return NULL;
+        }
+        pthread_barrier_wait(&g->done);
+    }
+}
+
+static int ipslr_sync_run(pslr_sync_group_t *g, ipslr_sync_op_t op) {
+    int i;
+    int ret = PSLR_OK;
+
+    memset(g->results, 0, g->count * sizeof (pslr_sync_result_t));
+    g->op = op;
+    pthread_barrier_wait(&g->start);
+    if (op == SYNC_QUIT) {
+        return PSLR_OK;
+    }
+    if (op == SYNC_SHUTTER) {
+        pthread_barrier_wait(&g->fire);
+    }
+    pthread_barrier_wait(&g->done);
+    for (i = 0; i < g->count; ++i) {
+        if (g->results[i].result != PSLR_OK) {
+            ret = g->results[i].result;
+        }
+    }
+    return ret;
+}
+
+pslr_sync_group_t *pslr_sync_open(char **devices, int count) {
+    pslr_sync_group_t *g;
+    int i;
+    int opened;
+    int started;
+
+    DPRINT("[C]\tpslr_sync_open(%d)\n", count);
+    if (count < 1) {
+        return NULL;
+    }
+    g = calloc(1, sizeof (pslr_sync_group_t));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->count = count;
+    g->handles = calloc(count, sizeof (pslr_handle_t));
+    g->threads = calloc(count, sizeof (pthread_t));
+    g->workers = calloc(count, sizeof (ipslr_sync_worker_t));
+    g->results = calloc(count, sizeof (pslr_sync_result_t));
+    if (!g->handles || !g->threads || !g->workers || !g->results) {
+        opened = 0;
+        goto fail;
+    }
+    for (opened = 0; opened < count; ++opened) {
+        g->handles[opened] = pslr_init(NULL, devices[opened]);
+        if (g->handles[opened] == NULL) {
+            DPRINT("\tcannot open %s\n", devices[opened]);
+            goto fail;
+        }
+        if (pslr_connect(g->handles[opened]) != PSLR_OK) {
+            DPRINT("\tcannot connect %s\n", devices[opened]);
+            pslr_shutdown(g->handles[opened]);
+            goto fail;
+        }
+    }
+    pthread_barrier_init(&g->start, NULL, count + 1);
+    pthread_barrier_init(&g->fire, NULL, count + 1);
+    pthread_barrier_init(&g->done, NULL, count + 1);
+    pthread_mutex_init(&g->gate_lock, NULL);
+    pthread_cond_init(&g->gate, NULL);
+    for (started = 0; started < count; ++started) {
+        g->workers[started].group = g;
+        g->workers[started].index = started;
+        if (pthread_create(&g->threads[started], NULL, ipslr_sync_worker, &g->workers[started]) != 0) {
+            DPRINT("\tcannot start the thread of %s\n", devices[started]);
+            break;
+        }
+    }
+    pthread_mutex_lock(&g->gate_lock);
+    g->gate_state = started == count ? 1 : -1;
+    pthread_cond_broadcast(&g->gate);
+    pthread_mutex_unlock(&g->gate_lock);
+    if (started == count) {
+        return g;
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(g->threads[i], NULL);
+    }
+    pthread_barrier_destroy(&g->start);
+    pthread_barrier_destroy(&g->fire);
+    pthread_barrier_destroy(&g->done);
+    pthread_mutex_destroy(&g->gate_lock);
+    pthread_cond_destroy(&g->gate);
+
+fail:
+    for (i = 0; i < opened; ++i) {
+        pslr_disconnect(g->handles[i]);
+        pslr_shutdown(g->handles[i]);
+    }
+    free(g->handles);
+    free(g->threads);
+    free(g->workers);
+    free(g->results);
+    free(g);
+    return NULL;
+}
+
+int pslr_sync_count(pslr_sync_group_t *g) {
+    return g->count;
+}
+
+pslr_handle_t pslr_sync_handle(pslr_sync_group_t *g, int index) {
+    return index >= 0 && index < g->count ? g->handles[index] : NULL;
+}
+
+int pslr_sync_arm(pslr_sync_group_t *g, bool arm) {
+    DPRINT("[C]\tpslr_sync_arm(%d)\n", arm);
+    return ipslr_sync_run(g, arm ? SYNC_ARM : SYNC_DISARM);
+}
+
+int pslr_sync_shutter(pslr_sync_group_t *g, pslr_sync_result_t *results) {
+    int64_t first = 0;
+    int ret;
+    int i;
+
+    DPRINT("[C]\tpslr_sync_shutter()\n");
+    ret = ipslr_sync_run(g, SYNC_SHUTTER);
+    for (i = 0; i < g->count; ++i) {
+        if (g->results[i].issue_usec != 0 && (first == 0 || g->results[i].issue_usec < first)) {
+            first = g->results[i].issue_usec;
+        }
+    }
+    for (i = 0; i < g->count; ++i) {
+        if (g->results[i].issue_usec != 0) {
+            g->results[i].skew_usec = g->results[i].issue_usec - first;
+        }
+        DPRINT("\tcamera %d: result %d skew %d us accepted after %d us\n", i, g->results[i].result,
+               g->results[i].skew_usec, g->results[i].accept_usec);
+    }
+    if (results) {
+        memcpy(results, g->results, g->count * sizeof (pslr_sync_result_t));
+    }
+    return ret;
+}
+
+void pslr_sync_close(pslr_sync_group_t *g) {
+    int i;
+
+    DPRINT("[C]\tpslr_sync_close()\n");
+    ipslr_sync_run(g, SYNC_QUIT);
+    for (i = 0; i < g->count; ++i) {
+        pthread_join(g->threads[i], NULL);
+        pslr_disconnect(g->handles[i]);
+        pslr_shutdown(g->handles[i]);
+    }
+    pthread_barrier_destroy(&g->start);
+    pthread_barrier_destroy(&g->fire);
+    pthread_barrier_destroy(&g->done);
+    pthread_mutex_destroy(&g->gate_lock);
+    pthread_cond_destroy(&g->gate);
+    free(g->handles);
+    free(g->threads);
+    free(g->workers);
+    free(g->results);
+    free(g);
+}
+
+static int ipslr_set_exposure_mode(pslr_handle_t h, pslr_exposure_mode_t mode) {
+    DPRINT("[C]\tpslr_set_exposure_mode(%X)\n", mode);
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+
+    if (mode < 0 || mode >= PSLR_EXPOSURE_MODE_MAX) {
+        return PSLR_PARAM;
+    }
+    return ipslr_handle_command_x18( p, true, X18_EXPOSURE_MODE, 2, 1, mode, 0);
+}
+
+int pslr_set_exposure_mode(pslr_handle_t h, pslr_exposure_mode_t mode) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_exposure_mode(h, mode);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int bufres) {
+    DPRINT("[C]\tpslr_buffer_open(#%X, type=%X, res=%X)\n", bufno, buftype, bufres);
+    pslr_buffer_segment_info info;
+    uint16_t bufs;
+    uint32_t buf_total = 0;
+    int i, j;
+    int ret;
     int retry = 0;
     int retry2 = 0;
+    struct timeval start_time;
 
     ipslr_handle_t *p = (ipslr_handle_t *) h;
 
@@ -1009,6 +1755,7 @@ int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int b
 
     i = 0;
     j = 0;
+    gettimeofday(&start_time, NULL);
     do {
         CHECK(ipslr_buffer_segment_info(p, &info));
         DPRINT("\t%d: Addr: 0x%X Len: %d(0x%08X) B=%d\n", i, info.addr, info.length, info.length, info.b);
@@ -1027,21 +1774,29 @@ int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int b
         buf_total += info.length;
         i++;
     } while (i < 9 && info.b != 2);
+    DPRINT("\tsegment enumeration: %d infos, %d segments in %d ms\n", i, j, ipslr_usec_since(&start_time) / 1000);
     p->segment_count = j;
     p->offset = 0;
+    ipslr_download_stats_start(p, pslr_buffer_get_size(h));
     return PSLR_OK;
 }
 
-uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
+int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type buftype, int bufres) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_buffer_open(h, bufno, buftype, bufres);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+/* Address of the current offset and end of its segment, returns the
+   bytes left in the segment */
+static uint32_t ipslr_buffer_position(ipslr_handle_t *p, uint32_t *addr, uint32_t *end) {
     int i;
     uint32_t pos = 0;
     uint32_t seg_offs;
-    uint32_t addr;
-    uint32_t blksz;
-    int ret;
-
-    DPRINT("[C]\tpslr_buffer_read(%d)\n", size);
 
     /* Find current segment */
     for (i = 0; i < p->segment_count; i++) {
@@ -1052,21 +1807,30 @@ uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
     }
 
     seg_offs = p->offset - pos;
-    addr = p->segments[i].addr + seg_offs;
+    *addr = p->segments[i].addr + seg_offs;
+    *end = p->segments[i].addr + p->segments[i].length;
+    return p->segments[i].length - seg_offs;
+}
+
+static uint32_t ipslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    uint32_t addr;
+    uint32_t end;
+    uint32_t blksz;
+    int ret;
+
+    DPRINT("[C]\tpslr_buffer_read(%d)\n", size);
 
     /* Compute block size */
-    blksz = size;
-    if (blksz > p->segments[i].length - seg_offs) {
-        blksz = p->segments[i].length - seg_offs;
-    }
-    if (blksz > BLKSZ) {
-        blksz = BLKSZ;
+    blksz = ipslr_buffer_position(p, &addr, &end);
+    if (blksz > size) {
+        blksz = size;
     }
 
 //    DPRINT("File offset %d segment: %d offset %d address 0x%x read size %d\n", p->offset,
 //           i, seg_offs, addr, blksz);
 
-    ret = ipslr_download(p, addr, blksz, buf);
+    ret = ipslr_download(p, addr, blksz, buf, end);
     if (ret != PSLR_OK) {
         return 0;
     }
@@ -1074,40 +1838,213 @@ uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
     return blksz;
 }
 
-uint32_t pslr_fullmemory_read(pslr_handle_t h, uint8_t *buf, uint32_t offset, uint32_t size) {
+uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    uint32_t ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_buffer_read(h, buf, size);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+/* Single producer single consumer ring between the USB reader thread
+   and the thread calling the sink. head is only written by the reader,
+   tail only by the sink side, both under lock. A lock and a condition
+   per MAX_BLKSZ block costs nothing next to the transfer, so the indices
+   are not lock-free atomics. */
+typedef struct {
+    ipslr_handle_t *p;
+    uint8_t *data;
+    uint32_t length[PIPELINE_BLOCKS];
+    uint32_t head;
+    uint32_t tail;
+    bool done;
+    bool abort;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* signalled on every change above */
+} ipslr_pipeline_t;
+
+static void *ipslr_pipeline_reader(void *arg) {
+    ipslr_pipeline_t *pl = (ipslr_pipeline_t *) arg;
+    uint32_t head = 0;
+    uint32_t bytes;
+
+    pthread_mutex_lock(&pl->lock);
+    while (!pl->abort) {
+        if (head - pl->tail == PIPELINE_BLOCKS) {
+            pthread_cond_wait(&pl->cond, &pl->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pl->lock);
+        bytes = pslr_buffer_read((pslr_handle_t) pl->p, pl->data + (head % PIPELINE_BLOCKS) * MAX_BLKSZ, MAX_BLKSZ);
+        pthread_mutex_lock(&pl->lock);
+        if (bytes == 0) {
+            break;
+        }
+        pl->length[head % PIPELINE_BLOCKS] = bytes;
+        pl->head = ++head;
+        pthread_cond_signal(&pl->cond);
+    }
+    pl->done = true;
+    pthread_cond_signal(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+/* One block at a time into the mapped reserved buffer, the sink gets the
+   mapped pages. The next command may reuse the buffer, so nothing is sent
+   to the camera until the sink returns; the lock keeps other threads out. */
+static int ipslr_buffer_save_mapped(ipslr_handle_t *p, pslr_buffer_sink_t sink, uintptr_t user_data) {
+    pthread_mutex_lock(&p->lock);
+    uint32_t length = pslr_buffer_get_size((pslr_handle_t) p);
+    uint32_t current = 0;
+    uint32_t addr;
+    uint32_t end;
+    uint32_t size;
+    int r;
+
+    DPRINT("[C]\tpslr_buffer_save(%d) mapped\n", length);
+    while (current < length) {
+        size = ipslr_buffer_position(p, &addr, &end);
+        if (size > p->map_size) {
+            size = p->map_size;
+        }
+        if (size == 0 || ipslr_download(p, addr, size, NULL, end) != PSLR_OK) {
+            break;
+        }
+        p->offset += p->map_length;
+        r = sink(p->map, p->map_length, user_data);
+        // the status read after the block may reuse the mapped buffer
+        get_status(p);
+        if (r != 0) {
+            break;
+        }
+        current += p->map_length;
+    }
+    DPRINT("\tbuffer save: %d/%d bytes\n", current, length);
+    int ret = current == length ? PSLR_OK : PSLR_READ_ERROR;
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int pslr_buffer_save(pslr_handle_t h, pslr_buffer_sink_t sink, uintptr_t user_data) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    ipslr_pipeline_t pl;
+    pthread_t reader;
+    uint32_t length = pslr_buffer_get_size(h);
+    uint32_t current = 0;
+    uint32_t slot;
+    int r;
+
+    if (p->map_download) {
+        return ipslr_buffer_save_mapped(p, sink, user_data);
+    }
+    DPRINT("[C]\tpslr_buffer_save(%d)\n", length);
+    memset(&pl, 0, sizeof (pl));
+    pl.p = p;
+    pl.data = malloc(PIPELINE_BLOCKS * MAX_BLKSZ);
+    if (!pl.data) {
+        return PSLR_NO_MEMORY;
+    }
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+    if (pthread_create(&reader, NULL, ipslr_pipeline_reader, &pl) != 0) {
+        pthread_cond_destroy(&pl.cond);
+        pthread_mutex_destroy(&pl.lock);
+        free(pl.data);
+        return PSLR_DEVICE_ERROR;
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    while (true) {
+        if (pl.tail == pl.head) {
+            if (pl.done) {
+                break;
+            }
+            pthread_cond_wait(&pl.cond, &pl.lock);
+            continue;
+        }
+        slot = pl.tail % PIPELINE_BLOCKS;
+        pthread_mutex_unlock(&pl.lock);
+        r = sink(pl.data + slot * MAX_BLKSZ, pl.length[slot], user_data);
+        pthread_mutex_lock(&pl.lock);
+        if (r != 0) {
+            pl.abort = true;
+            pthread_cond_signal(&pl.cond);
+            break;
+        }
+        current += pl.length[slot];
+        pl.tail++;
+        pthread_cond_signal(&pl.cond);
+    }
+    pthread_mutex_unlock(&pl.lock);
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&pl.cond);
+    pthread_mutex_destroy(&pl.lock);
+    free(pl.data);
+    DPRINT("\tbuffer save: %d/%d bytes\n", current, length);
+    return current == length ? PSLR_OK : PSLR_READ_ERROR;
+}
+
+static uint32_t ipslr_fullmemory_read(pslr_handle_t h, uint8_t *buf, uint32_t offset, uint32_t size) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int ret;
 
     DPRINT("[C]\tpslr_fullmemory_read(%d)\n", size);
 
-    ret = ipslr_download(p, offset, size, buf);
+    ipslr_download_stats_start(p, size);
+    ret = ipslr_download(p, offset, size, buf, 0);
     if (ret != PSLR_OK) {
         return 0;
     }
     return size;
 }
 
+uint32_t pslr_fullmemory_read(pslr_handle_t h, uint8_t *buf, uint32_t offset, uint32_t size) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    uint32_t ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_fullmemory_read(h, buf, offset, size);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 uint32_t pslr_buffer_get_size(pslr_handle_t h) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
     int i;
     uint32_t len = 0;
     for (i = 0; i < p->segment_count; i++) {
         len += p->segments[i].length;
     }
     DPRINT("\tbuffer get size:%d\n",len);
-    return len;
+    uint32_t ret = len;
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 void pslr_buffer_close(pslr_handle_t h) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    DPRINT("\tdownload: %d/%d bytes %.2f MB/s %.1f transactions/MB block %d\n", p->download_stats.current, p->download_stats.total,
+           p->download_stats.mb_per_sec, p->download_stats.transactions_per_mb, p->download_stats.block_size);
+    // a download request queued for the next block is not read any more
+    ipslr_async_drain(p);
+    p->download_prepared = false;
     memset(&p->segments[0], 0, sizeof (p->segments));
     p->offset = 0;
     p->segment_count = 0;
+    pthread_mutex_unlock(&p->lock);
 }
 
 int pslr_select_af_point(pslr_handle_t h, uint32_t point) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
-    return ipslr_handle_command_x18( p, true, X18_AF_POINT, 1, point, 0, 0);
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_handle_command_x18( p, true, X18_AF_POINT, 1, point, 0, 0);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
 }
 
 int pslr_get_model_max_jpeg_stars(pslr_handle_t h) {
@@ -1190,7 +2127,7 @@ bool pslr_get_model_has_settings_parser(pslr_handle_t h) {
     return p->model->setting_defs != NULL;
 }
 
-const char *pslr_camera_name(pslr_handle_t h) {
+static const char *ipslr_camera_name(pslr_handle_t h) {
     DPRINT("[C]\tpslr_camera_name()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     int ret;
@@ -1203,13 +2140,21 @@ const char *pslr_camera_name(pslr_handle_t h) {
     if (p->model) {
         return p->model->name;
     } else {
-        static char unk_name[256];
-        snprintf(unk_name, sizeof (unk_name), "ID#%x", p->id);
-        unk_name[sizeof (unk_name) - 1] = '\0';
-        return unk_name;
+        snprintf(p->unknown_name, sizeof (p->unknown_name), "ID#%x", p->id);
+        return p->unknown_name;
     }
 }
 
+const char *pslr_camera_name(pslr_handle_t h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    const char *ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_camera_name(h);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 pslr_buffer_type pslr_get_jpeg_buffer_type(pslr_handle_t h, int jpeg_stars) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     return 2 + get_hw_jpeg_quality( p->model, jpeg_stars );
@@ -1220,24 +2165,24 @@ pslr_buffer_type pslr_get_jpeg_buffer_type(pslr_handle_t h, int jpeg_stars) {
 static int ipslr_set_mode(ipslr_handle_t *p, uint32_t mode) {
     DPRINT("[C]\t\tipslr_set_mode(0x%x)\n", mode);
     CHECK(ipslr_write_args(p, 1, mode));
-    CHECK(command(p->fd, 0, 0, 4));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0, 0, 4));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
 static int ipslr_cmd_00_09(ipslr_handle_t *p, uint32_t mode) {
     DPRINT("[C]\t\tipslr_cmd_00_09(0x%x)\n", mode);
     CHECK(ipslr_write_args(p, 1, mode));
-    CHECK(command(p->fd, 0, 9, 4));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0, 9, 4));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
 static int ipslr_cmd_10_0a(ipslr_handle_t *p, uint32_t mode) {
     DPRINT("[C]\t\tipslr_cmd_10_0a(0x%x)\n", mode);
     CHECK(ipslr_write_args(p, 1, mode));
-    CHECK(command(p->fd, 0x10, X10_CONNECT, 4));
-    CHECK(get_status(p->fd));
+    CHECK(command(p, 0x10, X10_CONNECT, 4));
+    CHECK(get_status(p));
     return PSLR_OK;
 }
 
@@ -1245,33 +2190,234 @@ static int ipslr_cmd_00_05(ipslr_handle_t *p) {
     DPRINT("[C]\t\tipslr_cmd_00_05()\n");
     int n;
     uint8_t buf[0xb8];
-    CHECK(command(p->fd, 0x00, 0x05, 0x00));
-    n = get_result(p->fd);
+    CHECK(command(p, 0x00, 0x05, 0x00));
+    n = get_result(p);
     if (n != 0xb8) {
         DPRINT("\tonly got %d bytes\n", n);
         return PSLR_READ_ERROR;
     }
-    CHECK(read_result(p->fd, buf, n));
+    CHECK(read_result(p, buf, n));
     return PSLR_OK;
 }
 
 static int ipslr_status(ipslr_handle_t *p, uint8_t *buf) {
     int n;
     DPRINT("[C]\t\tipslr_status()\n");
-    CHECK(command(p->fd, 0, 1, 0));
-    n = get_result(p->fd);
+    CHECK(command(p, 0, 1, 0));
+    n = get_result(p);
     if (n == 16 || n == 28) {
-        return read_result(p->fd, buf, n);
+        return read_result(p, buf, n);
     } else {
         return PSLR_READ_ERROR;
     }
 }
 
+/* Commands that only read from the camera keep the status cache. */
+static bool ipslr_command_keeps_status(int a, int b) {
+    switch (a) {
+        case 0x00:
+            return b == 0x01 || b == 0x04 || b == 0x05 || b == 0x08;
+        case 0x01:  // firmware
+        case 0x04:  // segment info
+        case 0x06:  // download
+            return true;
+        case 0x02:
+            return b == 0x00;  // buffer mask
+        case 0x20:
+            return b == 0x06 || b == 0x08 || b == 0x09;  // datetime, settings
+        default:
+            return false;
+    }
+}
+
+static void ipslr_status_cache_command(ipslr_handle_t *p, int a, int b) {
+    if (p->status_cache_valid && !ipslr_command_keeps_status(a, b)) {
+        p->status_cache_valid = false;
+        ++p->status_cache_stats.invalidations;
+    }
+}
+
+static int ipslr_status_full_read(ipslr_handle_t *p, pslr_status *status);
+
+typedef struct {
+    uint32_t change;
+    uint16_t offset;
+    uint16_t size;
+} ipslr_status_field_t;
+
+#define STATUS_FIELD(change, field) \
+    { PSLR_STATUS_CHANGE_ ## change, offsetof(pslr_status, field), sizeof (((pslr_status *) 0)->field) }
+
+static const ipslr_status_field_t ipslr_status_fields[] = {
+    STATUS_FIELD(BUFMASK, bufmask),
+    STATUS_FIELD(ISO, current_iso),
+    STATUS_FIELD(ISO, fixed_iso),
+    STATUS_FIELD(ISO, auto_iso_min),
+    STATUS_FIELD(ISO, auto_iso_max),
+    STATUS_FIELD(ISO, custom_sensitivity_steps),
+    STATUS_FIELD(SHUTTER_SPEED, current_shutter_speed),
+    STATUS_FIELD(SHUTTER_SPEED, set_shutter_speed),
+    STATUS_FIELD(SHUTTER_SPEED, max_shutter_speed),
+    STATUS_FIELD(APERTURE, current_aperture),
+    STATUS_FIELD(APERTURE, set_aperture),
+    STATUS_FIELD(EXPOSURE, exposure_mode),
+    STATUS_FIELD(EXPOSURE, scene_mode),
+    STATUS_FIELD(EXPOSURE, user_mode_flag),
+    STATUS_FIELD(EXPOSURE, ae_metering_mode),
+    STATUS_FIELD(EXPOSURE, light_meter_flags),
+    STATUS_FIELD(EXPOSURE, ec),
+    STATUS_FIELD(EXPOSURE, custom_ev_steps),
+    STATUS_FIELD(EXPOSURE, manual_mode_ev),
+    STATUS_FIELD(BRACKETING, auto_bracket_mode),
+    STATUS_FIELD(BRACKETING, auto_bracket_ev),
+    STATUS_FIELD(BRACKETING, auto_bracket_picture_count),
+    STATUS_FIELD(BRACKETING, auto_bracket_picture_counter),
+    STATUS_FIELD(IMAGE_FORMAT, image_format),
+    STATUS_FIELD(IMAGE_FORMAT, raw_format),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_resolution),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_saturation),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_quality),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_contrast),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_sharpness),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_image_tone),
+    STATUS_FIELD(IMAGE_FORMAT, jpeg_hue),
+    STATUS_FIELD(IMAGE_FORMAT, color_space),
+    STATUS_FIELD(FOCUS, focus),
+    STATUS_FIELD(FOCUS, af_mode),
+    STATUS_FIELD(FOCUS, af_point_select),
+    STATUS_FIELD(FOCUS, selected_af_point),
+    STATUS_FIELD(FOCUS, focused_af_point),
+    STATUS_FIELD(DRIVE, drive_mode),
+    STATUS_FIELD(DRIVE, shake_reduction),
+    STATUS_FIELD(WHITE_BALANCE, white_balance_mode),
+    STATUS_FIELD(WHITE_BALANCE, white_balance_adjust_mg),
+    STATUS_FIELD(WHITE_BALANCE, white_balance_adjust_ba),
+    STATUS_FIELD(FLASH, flash_mode),
+    STATUS_FIELD(FLASH, flash_exposure_compensation),
+    STATUS_FIELD(LENS, lens_id1),
+    STATUS_FIELD(LENS, lens_id2),
+    STATUS_FIELD(LENS, lens_max_aperture),
+    STATUS_FIELD(LENS, lens_min_aperture),
+    STATUS_FIELD(LENS, zoom),
+    STATUS_FIELD(BATTERY, battery_1),
+    STATUS_FIELD(BATTERY, battery_2),
+    STATUS_FIELD(BATTERY, battery_3),
+    STATUS_FIELD(BATTERY, battery_4)
+};
+
+static uint32_t ipslr_status_compare(const pslr_status *a, const pslr_status *b) {
+    uint32_t changes = 0;
+    unsigned int i;
+    for (i = 0; i < sizeof (ipslr_status_fields) / sizeof (ipslr_status_fields[0]); ++i) {
+        const ipslr_status_field_t *f = &ipslr_status_fields[i];
+        if (!(changes & f->change) &&
+                memcmp((const uint8_t *) a + f->offset, (const uint8_t *) b + f->offset, f->size)) {
+            changes |= f->change;
+        }
+    }
+    return changes;
+}
+
+static uint32_t ipslr_status_change_of(uint16_t offset) {
+    unsigned int i;
+    for (i = 0; i < sizeof (ipslr_status_fields) / sizeof (ipslr_status_fields[0]); ++i) {
+        const ipslr_status_field_t *f = &ipslr_status_fields[i];
+        if (offset >= f->offset && offset < f->offset + f->size) {
+            return f->change;
+        }
+    }
+    return PSLR_STATUS_CHANGE_OTHER;
+}
+
+/* Updates p->status from p->status_buffer and reports the changed field
+   groups. An unchanged buffer is not parsed at all; otherwise only the
+   fields of the model's layout table whose bytes changed are re-derived.
+   The first status and models without a layout table get a full parse. */
+static void ipslr_status_delta(ipslr_handle_t *p, uint32_t n) {
+    pslr_status old_status;
+    uint16_t changed[STATUS_DELTA_MAX];
+    uint32_t changes = 0;
+    int count = -1;
+    int i;
+
+    if (n == p->status_last_length && !memcmp(p->status_buffer, p->status_last_buffer, n)) {
+        DPRINT("\tstatus unchanged\n");
+        return;
+    }
+    memcpy(&old_status, &p->status, sizeof (pslr_status));
+    if (n == p->status_last_length) {
+        count = ipslr_status_update(p, &p->status, p->status_last_buffer, changed, STATUS_DELTA_MAX);
+    }
+    if (count >= 0 && count <= STATUS_DELTA_MAX) {
+        for (i = 0; i < count; i++) {
+            if (changed[i] == offsetof(pslr_status, exposure_mode) && p->model->need_exposure_mode_conversion) {
+                p->status.exposure_mode = exposure_mode_conversion( p->status.exposure_mode );
+            }
+            changes |= ipslr_status_change_of(changed[i]);
+        }
+    } else {
+        (*p->model->status_parser_function)(p, &p->status);
+        if ( p->model->need_exposure_mode_conversion ) {
+            p->status.exposure_mode = exposure_mode_conversion( p->status.exposure_mode );
+        }
+        changes = p->status_last_length == 0 ? PSLR_STATUS_CHANGE_ALL : ipslr_status_compare(&old_status, &p->status);
+    }
+    if (changes == 0) {
+        // bytes no parser reads
+        changes = PSLR_STATUS_CHANGE_OTHER;
+    }
+    memcpy(p->status_last_buffer, p->status_buffer, n);
+    p->status_last_length = n;
+    p->status_changes |= changes;
+    DPRINT("\tstatus changes: 0x%x\n", changes);
+    if (p->status_change_callback && (changes & p->status_change_mask)) {
+        (*p->status_change_callback)(p, changes & p->status_change_mask, &old_status, &p->status,
+                                     p->status_change_user_data);
+    }
+}
+
+/* Serves the status from the cache while it is younger than the TTL.
+   Concurrent pslr_get_status callers are coalesced there, with the
+   status_reads count of the transfers into p->status. */
 static int ipslr_status_full(ipslr_handle_t *p, pslr_status *status) {
+    struct timeval start_time;
+    int ret;
+
+    if (p->status_cache_valid && ipslr_usec_since(&p->status_cache_time) < p->status_cache_ttl) {
+        DPRINT("[C]\t\tipslr_status_full() cached\n");
+        ++p->status_cache_stats.hits;
+        if (status != &p->status) {
+            memcpy(status, &p->status, sizeof (pslr_status));
+        }
+        return PSLR_OK;
+    }
+    ++p->status_cache_stats.misses;
+    gettimeofday(&start_time, NULL);
+    if (status != &p->status) {
+        return ipslr_status_full_read(p, status);
+    }
+    pthread_mutex_lock(&p->status_lock);
+    p->status_reading = true;
+    pthread_mutex_unlock(&p->status_lock);
+    ret = ipslr_status_full_read(p, status);
+    if (ret == PSLR_OK) {
+        p->status_cache_valid = true;
+        p->status_cache_time = start_time;
+    }
+    pthread_mutex_lock(&p->status_lock);
+    p->status_reading = false;
+    if (ret == PSLR_OK) {
+        ++p->status_reads;
+    }
+    pthread_mutex_unlock(&p->status_lock);
+    return ret;
+}
+
+static int ipslr_status_full_read(ipslr_handle_t *p, pslr_status *status) {
     int n;
     DPRINT("[C]\t\tipslr_status_full()\n");
-    CHECK(command(p->fd, 0, 8, 0));
-    n = get_result(p->fd);
+    CHECK(command(p, 0, 8, 0));
+    n = get_result(p);
     DPRINT("\tread %d bytes\n", n);
     int expected_bufsize = p->model != NULL ? p->model->buffer_size : 0;
     if ( p->model == NULL ) {
@@ -1279,7 +2425,7 @@ static int ipslr_status_full(ipslr_handle_t *p, pslr_status *status) {
     }
     DPRINT("\texpected_bufsize: %d\n",expected_bufsize);
 
-    CHECK(read_result(p->fd, p->status_buffer, n > MAX_STATUS_BUF_SIZE ? MAX_STATUS_BUF_SIZE: n));
+    CHECK(read_result(p, p->status_buffer, n > MAX_STATUS_BUF_SIZE ? MAX_STATUS_BUF_SIZE: n));
 
     if ( expected_bufsize == 0 || !p->model->status_parser_function ) {
         // limited support only
@@ -1289,6 +2435,10 @@ static int ipslr_status_full(ipslr_handle_t *p, pslr_status *status) {
         return PSLR_READ_ERROR;
     } else {
         // everything OK
+        if (status == &p->status) {
+            ipslr_status_delta(p, n);
+            return PSLR_OK;
+        }
         (*p->model->status_parser_function)(p, status);
         if ( p->model->need_exposure_mode_conversion ) {
             status->exposure_mode = exposure_mode_conversion( status->exposure_mode );
@@ -1299,14 +2449,37 @@ static int ipslr_status_full(ipslr_handle_t *p, pslr_status *status) {
 
 // fullpress: take picture
 // halfpress: autofocus
+static void ipslr_shutter_lag(ipslr_handle_t *p, uint32_t usec) {
+    pslr_shutter_stats_t *st = &p->shutter_stats;
+    st->last_usec = usec;
+    if (st->count == 0 || usec < st->min_usec) {
+        st->min_usec = usec;
+    }
+    if (usec > st->max_usec) {
+        st->max_usec = usec;
+    }
+    ++st->count;
+    st->total_usec += usec;
+    st->avg_usec = st->total_usec / st->count;
+    DPRINT("\t\tshutter lag: %d us\n", usec);
+}
+
 static int ipslr_press_shutter(ipslr_handle_t *p, bool fullpress) {
     DPRINT("[C]\t\tipslr_press_shutter(fullpress = %s)\n", (fullpress ? "true" : "false"));
+    struct timeval start_time;
     int r;
-    CHECK(ipslr_status_full(p, &p->status));
-    DPRINT("\t\tbefore: mask=0x%x\n", p->status.bufmask);
+    gettimeofday(&start_time, NULL);
+    // the status is only read for the debug output
+    if (!p->fast_shutter) {
+        CHECK(ipslr_status_full(p, &p->status));
+        DPRINT("\t\tbefore: mask=0x%x\n", p->status.bufmask);
+    }
     CHECK(ipslr_write_args(p, 1, fullpress ? 2 : 1));
-    CHECK(command(p->fd, 0x10, X10_SHUTTER, 0x04));
-    r = get_status(p->fd);
+    CHECK(command(p, 0x10, X10_SHUTTER, 0x04));
+    r = get_status(p);
+    if (fullpress) {
+        ipslr_shutter_lag(p, ipslr_usec_since(&start_time));
+    }
     DPRINT("\t\tshutter result code: 0x%x\n", r);
     return PSLR_OK;
 }
@@ -1316,13 +2489,13 @@ static int ipslr_select_buffer(ipslr_handle_t *p, int bufno, pslr_buffer_type bu
     DPRINT("\t\tSelect buffer %d,%d,%d,0\n", bufno, buftype, bufres);
     if ( !p->model->old_scsi_command ) {
         CHECK(ipslr_write_args(p, 4, bufno, buftype, bufres, 0));
-        CHECK(command(p->fd, 0x02, 0x01, 0x10));
+        CHECK(command(p, 0x02, 0x01, 0x10));
     } else {
         /* older cameras: 3-arg select buffer */
         CHECK(ipslr_write_args(p, 4, bufno, buftype, bufres));
-        CHECK(command(p->fd, 0x02, 0x01, 0x0c));
+        CHECK(command(p, 0x02, 0x01, 0x0c));
     }
-    r = get_status(p->fd);
+    r = get_status(p);
     if (r != 0) {
         return PSLR_COMMAND_ERROR;
     }
@@ -1333,9 +2506,11 @@ static int ipslr_next_segment(ipslr_handle_t *p) {
     DPRINT("[C]\t\tipslr_next_segment()\n");
     int r;
     CHECK(ipslr_write_args(p, 1, 0));
-    CHECK(command(p->fd, 0x04, 0x01, 0x04));
-    usleep(100000); // needed !! 100 too short, 1000 not short enough for PEF
-    r = get_status(p->fd);
+    CHECK(command(p, 0x04, 0x01, 0x04));
+    if ( ipslr_model_timing(p)->next_segment_delay ) {
+        usleep(ipslr_model_timing(p)->next_segment_delay);
+    }
+    r = get_status(p);
     if (r == 0) {
         return PSLR_OK;
     }
@@ -1346,16 +2521,18 @@ static int ipslr_buffer_segment_info(ipslr_handle_t *p, pslr_buffer_segment_info
     DPRINT("[C]\t\tipslr_buffer_segment_info()\n");
     uint8_t buf[16];
     uint32_t n;
-    int num_try = 20;
+    uint32_t delay = ipslr_model_timing(p)->segment_info_retry_delay;
+    struct timeval start_time;
 
+    gettimeofday(&start_time, NULL);
     pInfo->b = 0;
-    while ( pInfo->b == 0 && --num_try > 0 ) {
-        CHECK(command(p->fd, 0x04, 0x00, 0x00));
-        n = get_result(p->fd);
+    while ( pInfo->b == 0 && ipslr_usec_since(&start_time) < SEGMENT_INFO_TIMEOUT ) {
+        CHECK(command(p, 0x04, 0x00, 0x00));
+        n = get_result(p);
         if (n != 16) {
             return PSLR_READ_ERROR;
         }
-        CHECK(read_result(p->fd, buf, 16));
+        CHECK(read_result(p, buf, 16));
 
         //  use the right function based on the endian.
         get_uint32_func get_uint32_func_ptr;
@@ -1370,50 +2547,157 @@ static int ipslr_buffer_segment_info(ipslr_handle_t *p, pslr_buffer_segment_info
         pInfo->addr = (*get_uint32_func_ptr)(&buf[8]);
         pInfo->length = (*get_uint32_func_ptr)(&buf[12]);
         if ( pInfo-> b == 0 ) {
-            DPRINT("\tWaiting for segment info addr: 0x%x len: %d B=%d\n", pInfo->addr, pInfo->length, pInfo->b);
-            sleep_sec( 0.1 );
+            DPRINT("\tWaiting %d us for segment info addr: 0x%x len: %d B=%d\n", delay, pInfo->addr, pInfo->length, pInfo->b);
+            usleep(delay);
+            delay = delay * 2 < SEGMENT_INFO_MAX_DELAY ? delay * 2 : SEGMENT_INFO_MAX_DELAY;
         }
     }
     return PSLR_OK;
 }
 
-static int ipslr_download(ipslr_handle_t *p, uint32_t addr, uint32_t length, uint8_t *buf) {
+/* Download requests can be queued only with all arguments in one write */
+static bool ipslr_download_can_queue(ipslr_handle_t *p) {
+    return p->async && p->model != NULL && !p->model->old_scsi_command;
+}
+
+/* Asks the camera for a block (arguments and command 0x06). When queued,
+   both writes go out back to back and are completed later. */
+static int ipslr_download_prepare(ipslr_handle_t *p, uint32_t addr, uint32_t block) {
+    uint8_t argsCmd[8] = {0xf0, 0x4f, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00};
+    uint8_t cmd[8] = {0xf0, 0x24, 0x06, 0x00, 0x08, 0x00, 0x00, 0x00};
+    uint8_t args[8];
+    int pack_id;
+
+    if (ipslr_download_can_queue(p)) {
+        DPRINT("[C]\t\t\tqueue download request(0x%X, %d)\n", addr, block);
+        if (p->model->is_little_endian) {
+            set_uint32_le(addr, &args[0]);
+            set_uint32_le(block, &args[4]);
+        } else {
+            set_uint32_be(addr, &args[0]);
+            set_uint32_be(block, &args[4]);
+        }
+        CHECK(ipslr_transport_submit(p, true, argsCmd, sizeof (argsCmd), args, sizeof (args), &pack_id));
+        CHECK(ipslr_transport_submit(p, true, cmd, sizeof (cmd), 0, 0, &pack_id));
+        ipslr_command_sent(p, 0x06, 0x00);
+    } else {
+        CHECK(ipslr_write_args(p, 2, addr, block));
+        CHECK(command(p, 0x06, 0x00, 0x08));
+    }
+    p->download_prepared = true;
+    p->download_prepared_addr = addr;
+    p->download_prepared_length = block;
+    return PSLR_OK;
+}
+
+/* Blocks are BLKSZ. With pslr_set_block_size_probe the size doubles
+   after every full block until MAX_BLKSZ or until the transport refuses
+   a block; the last working size is kept for the handle. With queued commands the request of the next block, up to end
+   (0: addr + length), is sent behind the data read; a later call for
+   exactly that block starts with its status. A NULL buf reads a single
+   block into the mapped reserved buffer, its size goes to p->map_length. */
+static bool ipslr_block_size_probing(ipslr_handle_t *p) {
+    return p->block_size_probe && !p->block_size_probed;
+}
+
+static int ipslr_download(ipslr_handle_t *p, uint32_t addr, uint32_t length, uint8_t *buf, uint32_t end) {
     DPRINT("[C]\t\tipslr_download(address = 0x%X, length = %d)\n", addr, length);
     uint8_t downloadCmd[8] = {0xf0, 0x24, 0x06, 0x02, 0x00, 0x00, 0x00, 0x00};
     uint32_t block;
+    uint32_t next;
     int n;
     int retry;
+    int pack_id;
     uint32_t length_start = length;
 
+    if (p->block_size == 0) {
+        p->block_size = BLKSZ;
+    }
+    if (end < addr + length) {
+        end = addr + length;
+    }
     retry = 0;
     while (length > 0) {
-        if (length > BLKSZ) {
-            block = BLKSZ;
+        if (length > p->block_size) {
+            block = p->block_size;
         } else {
             block = length;
         }
 
-        //DPRINT("Get 0x%x bytes from 0x%x\n", block, addr);
-        CHECK(ipslr_write_args(p, 2, addr, block));
-        CHECK(command(p->fd, 0x06, 0x00, 0x08));
-        get_status(p->fd);
+        if (buf == NULL && length > block) {
+            length = length_start = block;
+        }
 
-        n = scsi_read(p->fd, downloadCmd, sizeof (downloadCmd), buf, block);
-        get_status(p->fd);
+        //DPRINT("Get 0x%x bytes from 0x%x\n", block, addr);
+        if (!p->download_prepared || p->download_prepared_addr != addr || p->download_prepared_length != block) {
+            CHECK(ipslr_download_prepare(p, addr, block));
+        }
+        p->download_prepared = false;
+        CHECK(ipslr_async_drain(p));
+        get_status(p);
+
+        // the next block, sized as if this one succeeds
+        next = p->block_size;
+        if (block == p->block_size && ipslr_block_size_probing(p) && p->block_size < MAX_BLKSZ) {
+            next *= 2;
+        }
+        if (next > end - addr - block) {
+            next = end - addr - block;
+        }
+        if (buf == NULL && next > p->map_size) {
+            next = p->map_size;
+        }
+        if (next > 0 && ipslr_download_can_queue(p)) {
+            CHECK(ipslr_transport_submit(p, false, downloadCmd, sizeof (downloadCmd), buf, block, &pack_id));
+            CHECK(ipslr_download_prepare(p, addr + block, next));
+            n = ipslr_transport_complete(p, pack_id);
+            // the camera starts on the queued request only now
+            gettimeofday(&p->command_time, NULL);
+        } else {
+            n = ipslr_transport_read(p, downloadCmd, sizeof (downloadCmd), buf, block);
+        }
 
-        if (n < 0) {
+        if (n < 0 || (n < block && block > BLKSZ)) {
+            get_status(p);
+            if (block > BLKSZ && ipslr_block_size_probing(p)) {
+                // too big for the camera or the host, stay with the last good one
+                p->block_size = block / 2;
+                p->block_size_probed = true;
+                DPRINT("\tblock size %d refused, using %d\n", block, p->block_size);
+                continue;
+            }
             if (retry < BLOCK_RETRY) {
                 retry++;
                 continue;
             }
             return PSLR_READ_ERROR;
         }
-        buf += n;
+        if (buf == NULL) {
+            // any command could overwrite the mapped block, the caller polls the status
+            p->map_length = n;
+            length = n;
+        } else {
+            buf += n;
+        }
         length -= n;
         addr += n;
         retry = 0;
-        if (progress_callback) {
-            progress_callback(length_start - length, length_start);
+        if (buf != NULL) {
+            get_status(p);
+        }
+        if (n == p->block_size && ipslr_block_size_probing(p)) {
+            if (p->block_size < MAX_BLKSZ) {
+                p->block_size *= 2;
+            } else {
+                p->block_size_probed = true;
+            }
+        }
+        ipslr_download_stats_update(p, n);
+        if (p->progress_callback) {
+            p->progress_callback(length_start - length, length_start);
+        }
+        if (p->download_progress_callback) {
+            p->download_progress_callback(&p->download_stats, p->download_progress_user_data);
         }
     }
     return PSLR_OK;
@@ -1424,12 +2708,12 @@ static int ipslr_identify(ipslr_handle_t *p) {
     uint8_t idbuf[8];
     int n;
 
-    CHECK(command(p->fd, 0, 4, 0));
-    n = get_result(p->fd);
+    CHECK(command(p, 0, 4, 0));
+    n = get_result(p);
     if (n != 8) {
         return PSLR_READ_ERROR;
     }
-    CHECK(read_result(p->fd, idbuf, 8));
+    CHECK(read_result(p, idbuf, 8));
     //  Check the camera endian, which affect ID
     if (idbuf[0] == 0) {
         p->id = get_uint32_be(&idbuf[0]);
@@ -1441,19 +2725,19 @@ static int ipslr_identify(ipslr_handle_t *p) {
     return PSLR_OK;
 }
 
-int pslr_read_datetime(pslr_handle_t *h, int *year, int *month, int *day, int *hour, int *min, int *sec) {
+static int ipslr_read_datetime(pslr_handle_t *h, int *year, int *month, int *day, int *hour, int *min, int *sec) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     DPRINT("[C]\t\tipslr_read_datetime()\n");
     uint8_t idbuf[800];
     int n;
 
-    CHECK(command(p->fd, 0x20, 0x06, 0));
-    n = get_result(p->fd);
+    CHECK(command(p, 0x20, 0x06, 0));
+    n = get_result(p);
     DPRINT("[C]\t\tipslr_read_datetime() bytes: %d\n",n);
     if (n!= 24) {
         return PSLR_READ_ERROR;
     }
-    CHECK(read_result(p->fd, idbuf, n));
+    CHECK(read_result(p, idbuf, n));
     get_uint32_func get_uint32_func_ptr;
 
     if (p->model->is_little_endian) {
@@ -1470,19 +2754,29 @@ int pslr_read_datetime(pslr_handle_t *h, int *year, int *month, int *day, int *h
     return PSLR_OK;
 }
 
-int pslr_read_dspinfo(pslr_handle_t *h, char* firmware) {
+int pslr_read_datetime(pslr_handle_t *h, int *year, int *month, int *day, int *hour, int *min, int *sec) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_read_datetime(h, year, month, day, hour, min, sec);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_read_dspinfo(pslr_handle_t *h, char* firmware) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     DPRINT("[C]\t\tipslr_read_dspinfo()\n");
     uint8_t buf[4];
     int n;
 
-    CHECK(command(p->fd, 0x01, 0x01, 0));
-    n = get_result(p->fd);
+    CHECK(command(p, 0x01, 0x01, 0));
+    n = get_result(p);
     DPRINT("[C]\t\tipslr_read_dspinfo() bytes: %d\n",n);
     if (n!= 4) {
         return PSLR_READ_ERROR;
     }
-    CHECK(read_result(p->fd, buf, n));
+    CHECK(read_result(p, buf, n));
     if (p->model->is_little_endian) {
         snprintf( firmware, 16, "%d.%02d.%02d.%02d", buf[3], buf[2], buf[1], buf[0]);
     } else {
@@ -1491,20 +2785,30 @@ int pslr_read_dspinfo(pslr_handle_t *h, char* firmware) {
     return PSLR_OK;
 }
 
-int pslr_read_setting(pslr_handle_t *h, int offset, uint32_t *value) {
+int pslr_read_dspinfo(pslr_handle_t *h, char* firmware) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_read_dspinfo(h, firmware);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_read_setting(pslr_handle_t *h, int offset, uint32_t *value) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     DPRINT("[C]\t\tipslr_read_setting(%d)\n", offset);
     uint8_t buf[4];
     int n;
 
     CHECK(ipslr_write_args(p, 1, offset));
-    CHECK(command(p->fd, 0x20, 0x09, 4));
-    n = get_result(p->fd);
+    CHECK(command(p, 0x20, 0x09, 4));
+    n = get_result(p);
     DPRINT("[C]\t\tipslr_read_setting() bytes: %d\n",n);
     if (n!= 4) {
         return PSLR_READ_ERROR;
     }
-    CHECK(read_result(p->fd, buf, n));
+    CHECK(read_result(p, buf, n));
     get_uint32_func get_uint32_func_ptr;
     if (p->model->is_little_endian) {
         get_uint32_func_ptr = get_uint32_le;
@@ -1515,18 +2819,39 @@ int pslr_read_setting(pslr_handle_t *h, int offset, uint32_t *value) {
     return PSLR_OK;
 }
 
-int pslr_write_setting(pslr_handle_t *h, int offset, uint32_t value) {
+int pslr_read_setting(pslr_handle_t *h, int offset, uint32_t *value) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_read_setting(h, offset, value);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_write_setting(pslr_handle_t *h, int offset, uint32_t value) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     DPRINT("[C]\t\tipslr_write_setting(%d)=%d\n", offset, value);
     CHECK(ipslr_cmd_00_09(p, 1));
     CHECK(ipslr_write_args(p, 2, offset, value));
-    CHECK(command(p->fd, 0x20, 0x08, 8));
+    CHECK(command(p, 0x20, 0x08, 8));
     CHECK(ipslr_cmd_00_09(p, 2));
     return PSLR_OK;
 }
 
+int pslr_write_setting(pslr_handle_t *h, int offset, uint32_t value) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_write_setting(h, offset, value);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 int pslr_write_setting_by_name(pslr_handle_t *h, char *name, uint32_t value) {
     ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
     pslr_setting_def_t *setting_def = find_setting_by_name(p->model->setting_defs, p->model->setting_defs_length, name);
     if (setting_def != NULL) {
         if (setting_def->length == 1) {
@@ -1536,25 +2861,200 @@ int pslr_write_setting_by_name(pslr_handle_t *h, char *name, uint32_t value) {
             pslr_write_setting(h, setting_def->address+1, value & 0xff);
         }
     }
+    pthread_mutex_unlock(&p->lock);
     return PSLR_OK;
 }
 
-int pslr_read_settings(pslr_handle_t *h) {
-    ipslr_handle_t *p = (ipslr_handle_t *) h;
-    int index=0;
+static int ipslr_read_settings_offsets(ipslr_handle_t *p, bool *wanted) {
+    struct timeval start_time;
+    int index;
     uint32_t value;
     int ret;
-    while (index<SETTINGS_BUFFER_SIZE) {
-        if ( (ret = pslr_read_setting(h, index, &value)) != PSLR_OK ) {
+
+    gettimeofday(&start_time, NULL);
+    p->settings_stats.reads = 0;
+    for (index = 0; index < SETTINGS_BUFFER_SIZE; ++index) {
+        if ( wanted && !wanted[index] ) {
+            continue;
+        }
+        if ( (ret = pslr_read_setting((pslr_handle_t) p, index, &value)) != PSLR_OK ) {
             return ret;
         }
         p->settings_buffer[index] = value;
-        ++index;
+        ++p->settings_stats.reads;
     }
+    p->settings_stats.full_scan = wanted == NULL;
+    p->settings_stats.usec = ipslr_usec_since(&start_time);
+    DPRINT("\tsettings read: %d offsets in %d ms%s\n", p->settings_stats.reads, p->settings_stats.usec / 1000,
+           p->settings_stats.full_scan ? " (full scan)" : "");
     return PSLR_OK;
 }
 
-int pslr_get_settings(pslr_handle_t h, pslr_settings *ps) {
+// reads only the bytes the model's setting_defs refer to, each of them once
+int pslr_read_settings(pslr_handle_t *h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    bool wanted[SETTINGS_BUFFER_SIZE];
+    int i, j;
+
+    memset(wanted, 0, sizeof (wanted));
+    if ( p->model && p->model->setting_defs ) {
+        for (i = 0; i < p->model->setting_defs_length; ++i) {
+            for (j = 0; j < p->model->setting_defs[i].length; ++j) {
+                if ( p->model->setting_defs[i].address + j < SETTINGS_BUFFER_SIZE ) {
+                    wanted[p->model->setting_defs[i].address + j] = true;
+                }
+            }
+        }
+    }
+    int ret = ipslr_read_settings_offsets(p, wanted);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int pslr_read_all_settings(pslr_handle_t *h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_read_settings_offsets(p, NULL);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int pslr_set_status_cache_ttl(pslr_handle_t h, uint32_t usec) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    p->status_cache_ttl = usec;
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_get_status_cache_ttl(pslr_handle_t h, uint32_t *usec) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    *usec = p->status_cache_ttl;
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_get_status_cache_stats(pslr_handle_t h, pslr_status_cache_stats_t *stats) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    memcpy(stats, &p->status_cache_stats, sizeof (pslr_status_cache_stats_t));
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_set_status_change_callback(pslr_handle_t h, uint32_t mask, pslr_status_change_callback_t cb,
+                                    uintptr_t user_data) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    p->status_change_mask = mask;
+    p->status_change_callback = cb;
+    p->status_change_user_data = user_data;
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+uint32_t pslr_get_status_changes(pslr_handle_t h) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    uint32_t changes = p->status_changes;
+    p->status_changes = 0;
+    uint32_t ret = changes;
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int pslr_set_fast_shutter(pslr_handle_t h, bool fast) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    p->fast_shutter = fast;
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+static int ipslr_set_mapped_download(pslr_handle_t h, bool mapped) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    uint32_t size = MAX_BLKSZ;
+    if (mapped && p->map == NULL) {
+        p->map = p->transport->map_reserved ? p->transport->map_reserved(p->fd, &size) : NULL;
+        if (p->map == NULL) {
+            return PSLR_PARAM;
+        }
+        p->map_size = size;
+    }
+    p->map_download = mapped;
+    return PSLR_OK;
+}
+
+int pslr_set_mapped_download(pslr_handle_t h, bool mapped) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_mapped_download(h, mapped);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int ipslr_set_queued_commands(ipslr_handle_t *p, bool queued) {
+    if (queued && !p->async) {
+        p->async = p->transport->async_open && p->transport->async_open(p->fd);
+        if (!p->async) {
+            return PSLR_PARAM;
+        }
+    } else if (!queued && p->async) {
+        ipslr_async_drain(p);
+        p->download_prepared = false;
+        p->async = false;
+    }
+    return PSLR_OK;
+}
+
+int pslr_set_queued_commands(pslr_handle_t h, bool queued) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_set_queued_commands(p, queued);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int pslr_trace_dump(pslr_handle_t h, const char *filename) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    int ret = ipslr_trace_write(p, filename);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+int pslr_set_trace_file(pslr_handle_t h, const char *filename) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    free(p->trace_file);
+    p->trace_file = filename ? strdup(filename) : NULL;
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_get_shutter_stats(pslr_handle_t h, pslr_shutter_stats_t *stats) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    memcpy(stats, &p->shutter_stats, sizeof (pslr_shutter_stats_t));
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+int pslr_get_settings_stats(pslr_handle_t h, pslr_settings_stats_t *stats) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    memcpy(stats, &p->settings_stats, sizeof (pslr_settings_stats_t));
+    pthread_mutex_unlock(&p->lock);
+    return PSLR_OK;
+}
+
+static int ipslr_get_settings(pslr_handle_t h, pslr_settings *ps) {
     DPRINT("[C]\tpslr_get_settings()\n");
     ipslr_handle_t *p = (ipslr_handle_t *) h;
     memset( ps, 0, sizeof( pslr_settings ));
@@ -1574,16 +3074,26 @@ int pslr_get_settings(pslr_handle_t h, pslr_settings *ps) {
     return PSLR_OK;
 }
 
+int pslr_get_settings(pslr_handle_t h, pslr_settings *ps) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    ret = ipslr_get_settings(h, ps);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
 
 static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
     va_list ap;
     uint8_t cmd[8] = {0xf0, 0x4f, cmd_2, 0x00, 0x00, 0x00, 0x00, 0x00};
     uint8_t buf[4 * n];
-    FDTYPE fd = p->fd;
     int res;
     int i;
     uint32_t data;
 
+    p->download_prepared = false;
     // print debug info
     va_start(ap, n);
     DPRINT("[C]\t\t\t_ipslr_write_args(cmd_2 = 0x%x, {", cmd_2);
@@ -1611,7 +3121,7 @@ static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
         cmd[4] = 4 * n;
 
 
-        res = scsi_write(fd, cmd, sizeof (cmd), buf, 4 * n);
+        res = ipslr_transport_write(p, cmd, sizeof (cmd), buf, 4 * n);
         if (res != PSLR_OK) {
             va_end(ap);
             return res;
@@ -1629,7 +3139,7 @@ static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
 
             cmd[4] = 4;
             cmd[2] = i * 4;
-            res = scsi_write(fd, cmd, sizeof (cmd), buf, 4);
+            res = ipslr_transport_write(p, cmd, sizeof (cmd), buf, 4);
             if (res != PSLR_OK) {
                 va_end(ap);
                 return res;
@@ -1642,23 +3152,297 @@ static int _ipslr_write_args(uint8_t cmd_2, ipslr_handle_t *p, int n, ...) {
 
 /* ----------------------------------------------------------------------- */
 
-static int command(FDTYPE fd, int a, int b, int c) {
-    DPRINT("[C]\t\t\tcommand(fd=%x, %x, %x, %x)\n", fd, a, b, c);
+static int command(ipslr_handle_t *p, int a, int b, int c) {
+    DPRINT("[C]\t\t\tcommand(fd=%x, %x, %x, %x)\n", p->fd, a, b, c);
     uint8_t cmd[8] = {0xf0, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
     cmd[2] = a;
     cmd[3] = b;
     cmd[4] = c;
 
-    CHECK(scsi_write(fd, cmd, sizeof (cmd), 0, 0));
+    p->download_prepared = false;
+    CHECK(ipslr_transport_write(p, cmd, sizeof (cmd), 0, 0));
+    ipslr_command_sent(p, a, b);
     return PSLR_OK;
 }
 
-static int read_status(FDTYPE fd, uint8_t *buf) {
+static void ipslr_command_sent(ipslr_handle_t *p, int a, int b) {
+    ipslr_status_cache_command(p, a, b);
+    p->last_command = a << 8 | b;
+    p->command_pending = true;
+    gettimeofday(&p->command_time, NULL);
+}
+
+static uint64_t ipslr_trace_now(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* Records the start of a transaction in the ring, returns its index */
+static uint32_t ipslr_trace_begin(ipslr_handle_t *p, uint8_t *cmd, uint32_t cmdLen, uint32_t length, uint8_t flags) {
+    uint32_t t = p->trace_count++;
+    ipslr_trace_entry_t *e = &p->trace[t % TRACE_SIZE];
+    memset(e->cdb, 0, sizeof (e->cdb));
+    memcpy(e->cdb, cmd, cmdLen < sizeof (e->cdb) ? cmdLen : sizeof (e->cdb));
+    e->length = length;
+    e->flags = flags;
+    e->result = 0;
+    e->duration = 0;
+    e->start = ipslr_trace_now();
+    return t;
+}
+
+/* Reads return bytes or a negative error, blocking writes a positive error.
+   Failed and slow transactions dump the ring to trace_file, once a second
+   at most. */
+static int ipslr_trace_end(ipslr_handle_t *p, uint32_t t, int result) {
+    ipslr_trace_entry_t *e = &p->trace[t % TRACE_SIZE];
+    bool failed;
+    if (p->trace_count - t > TRACE_SIZE) {
+        return result; // overwritten while queued
+    }
+    e->duration = ipslr_trace_now() - e->start;
+    e->result = result;
+    failed = (e->flags & (TRACE_WRITE | TRACE_QUEUED)) == TRACE_WRITE ? result != PSLR_OK : result < 0;
+    if (p->trace_file != NULL && (failed || e->duration > TRACE_SLOW_USEC) &&
+            e->start + e->duration > p->trace_dump_usec + 1000000) {
+        DPRINT("\t%s transaction, trace written to %s\n", failed ? "failed" : "slow", p->trace_file);
+        ipslr_trace_write(p, p->trace_file);
+        p->trace_dump_usec = e->start + e->duration;
+    }
+    return result;
+}
+
+/* The blocking calls are ordered behind the queued ones anyway, complete
+   those first so their pack_ids do not pile up. */
+static int ipslr_transport_read(ipslr_handle_t *p, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen) {
+    uint32_t t;
+    ipslr_async_drain(p);
+    ++p->transactions;
+    t = ipslr_trace_begin(p, cmd, cmdLen, bufLen, 0);
+    return ipslr_trace_end(p, t, p->transport->read(p->fd, cmd, cmdLen, buf, bufLen));
+}
+
+static int ipslr_transport_write(ipslr_handle_t *p, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen) {
+    uint32_t t;
+    ipslr_async_drain(p);
+    ++p->transactions;
+    t = ipslr_trace_begin(p, cmd, cmdLen, bufLen, TRACE_WRITE);
+    return ipslr_trace_end(p, t, p->transport->write(p->fd, cmd, cmdLen, buf, bufLen));
+}
+
+/* Only for p->async. buf must stay valid until the command completes. */
+static int ipslr_transport_submit(ipslr_handle_t *p, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                                  uint8_t *buf, uint32_t bufLen, int *pack_id) {
+    uint32_t t;
+    int r;
+    if (p->async_pending_count == ASYNC_PENDING_MAX) {
+        CHECK(ipslr_async_drain(p));
+    }
+    *pack_id = ++p->async_pack_id;
+    ++p->transactions;
+    t = ipslr_trace_begin(p, cmd, cmdLen, bufLen, TRACE_QUEUED | (toDevice ? TRACE_WRITE : 0));
+    r = p->transport->submit(p->fd, *pack_id, toDevice, cmd, cmdLen, buf, bufLen);
+    if (r != PSLR_OK) {
+        ipslr_trace_end(p, t, -r);
+        return r;
+    }
+    p->async_trace[p->async_pending_count] = t;
+    p->async_pending[p->async_pending_count++] = *pack_id;
+    return PSLR_OK;
+}
+
+/* Returns like the blocking read: bytes or a negative error */
+static int ipslr_transport_complete(ipslr_handle_t *p, int pack_id) {
+    uint32_t t;
+    int i;
+    for (i = 0; i < p->async_pending_count && p->async_pending[i] != pack_id; ++i) {
+    }
+    if (i == p->async_pending_count) {
+        return -PSLR_PARAM;
+    }
+    t = p->async_trace[i];
+    memmove(&p->async_pending[i], &p->async_pending[i + 1], (p->async_pending_count - i - 1) * sizeof (int));
+    memmove(&p->async_trace[i], &p->async_trace[i + 1], (p->async_pending_count - i - 1) * sizeof (uint32_t));
+    --p->async_pending_count;
+    return ipslr_trace_end(p, t, p->transport->complete(p->fd, pack_id));
+}
+
+/* Completes the queued commands in order, returns the first error */
+static int ipslr_async_drain(ipslr_handle_t *p) {
+    int ret = PSLR_OK;
+    int r;
+    while (p->async_pending_count > 0) {
+        r = ipslr_transport_complete(p, p->async_pending[0]);
+        if (r < 0 && ret == PSLR_OK) {
+            DPRINT("\tqueued command failed: %d\n", -r);
+            ret = -r;
+            p->download_prepared = false;
+        }
+    }
+    return ret;
+}
+
+static void ipslr_trace_name(ipslr_trace_entry_t *e, char *name, size_t size) {
+    switch (e->cdb[1]) {
+        case 0x24:
+            if (e->cdb[2] == 0x06 && e->cdb[3] == 0x02) {
+                snprintf(name, size, "download");
+            } else {
+                snprintf(name, size, "command %02X %02X", e->cdb[2], e->cdb[3]);
+            }
+            break;
+        case 0x26:
+            snprintf(name, size, "status");
+            break;
+        case 0x49:
+            snprintf(name, size, "read result");
+            break;
+        case 0x4f:
+            snprintf(name, size, "write args");
+            break;
+        default:
+            snprintf(name, size, "%02X %02X", e->cdb[0], e->cdb[1]);
+    }
+}
+
+/* Chrome trace event format, opens in chrome://tracing and Perfetto */
+static int ipslr_trace_write(ipslr_handle_t *p, const char *filename) {
+    FILE *f = fopen(filename, "w");
+    ipslr_trace_entry_t *e;
+    char name[32];
+    uint32_t i;
+    uint32_t first = p->trace_count > TRACE_SIZE ? p->trace_count - TRACE_SIZE : 0;
+
+    if (f == NULL) {
+        DPRINT("\tCannot open trace file %s\n", filename);
+        return PSLR_PARAM;
+    }
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"blocking\"}},\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"queued\"}}");
+    for (i = first; i != p->trace_count; ++i) {
+        e = &p->trace[i % TRACE_SIZE];
+        ipslr_trace_name(e, name, sizeof (name));
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"scsi\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"cdb\":\"%02X %02X %02X %02X %02X %02X %02X %02X\",\"dir\":\"%s\",\"length\":%u,\"result\":%d}}",
+                name, (unsigned long long) e->start, e->duration, e->flags & TRACE_QUEUED ? 2 : 1,
+                e->cdb[0], e->cdb[1], e->cdb[2], e->cdb[3], e->cdb[4], e->cdb[5], e->cdb[6], e->cdb[7],
+                e->flags & TRACE_WRITE ? "out" : "in", e->length, e->result);
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        return PSLR_PARAM;
+    }
+    return PSLR_OK;
+}
+
+static uint32_t ipslr_usec_since(struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000000 + now.tv_usec - start->tv_usec;
+}
+
+static pslr_poll_stats_t *ipslr_poll_stats(ipslr_handle_t *p, uint16_t command) {
+    int i = command % POLL_STATS_SIZE;
+    int n;
+    for (n = 0; n < POLL_STATS_SIZE; ++n, i = (i + 1) % POLL_STATS_SIZE) {
+        if (p->poll_stats[i].count == 0 && p->poll_stats[i].polls == 0) {
+            p->poll_stats[i].command = command;
+            ++p->poll_stats_count;
+            return &p->poll_stats[i];
+        }
+        if (p->poll_stats[i].command == command) {
+            return &p->poll_stats[i];
+        }
+    }
+    return NULL;
+}
+
+/* First wait until the learned completion time of the command, then back
+   off exponentially from POLL_MIN_INTERVAL up to POLL_INTERVAL. */
+static uint32_t ipslr_poll_delay(pslr_poll_stats_t *stats, int attempt, uint32_t elapsed) {
+    uint32_t delay;
+    if (attempt == 0 && stats && stats->count > 0 && stats->avg_usec > elapsed + POLL_MIN_INTERVAL) {
+        delay = stats->avg_usec - elapsed;
+    } else {
+        delay = POLL_MIN_INTERVAL << (attempt < 10 ? attempt : 10);
+    }
+    return delay < POLL_INTERVAL ? delay : POLL_INTERVAL;
+}
+
+/* Polls the status until done() accepts it. Latency is learned only for
+   the first poll after a command, later ones (e.g. after a data read)
+   just back off. */
+static int ipslr_poll_status(ipslr_handle_t *p, uint8_t *statusbuf, bool (*done)(uint8_t *statusbuf)) {
+    pslr_poll_stats_t *stats = NULL;
+    bool learn = p->command_pending;
+    struct timeval start;
+    uint32_t elapsed;
+    int attempt = 0;
+
+    if (learn) {
+        stats = ipslr_poll_stats(p, p->last_command);
+        start = p->command_time;
+        p->command_pending = false;
+    } else {
+        gettimeofday(&start, NULL);
+    }
+    while (1) {
+        CHECK(read_status(p, statusbuf));
+        if (stats) {
+            ++stats->polls;
+        }
+        if (done(statusbuf)) {
+            break;
+        }
+        usleep(ipslr_poll_delay(stats, attempt++, ipslr_usec_since(&start)));
+    }
+    if (stats) {
+        elapsed = ipslr_usec_since(&start);
+        if (stats->count == 0) {
+            stats->avg_usec = elapsed;
+        } else {
+            stats->avg_usec += ((int64_t) elapsed - stats->avg_usec) >> POLL_EWMA_SHIFT;
+        }
+        if (elapsed > stats->max_usec) {
+            stats->max_usec = elapsed;
+        }
+        stats->total_usec += elapsed;
+        ++stats->count;
+    }
+    return PSLR_OK;
+}
+
+static bool ipslr_status_done(uint8_t *statusbuf) {
+    return statusbuf[7] != 0x01;
+}
+
+static bool ipslr_result_done(uint8_t *statusbuf) {
+    return statusbuf[6] == 0x01;
+}
+
+int pslr_get_poll_stats(pslr_handle_t h, pslr_poll_stats_t *stats, int max) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    pthread_mutex_lock(&p->lock);
+    int i;
+    int n = 0;
+    for (i = 0; i < POLL_STATS_SIZE && n < max; ++i) {
+        if (p->poll_stats[i].count > 0) {
+            stats[n++] = p->poll_stats[i];
+        }
+    }
+    int ret = n;
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int read_status(ipslr_handle_t *p, uint8_t *buf) {
     uint8_t cmd[8] = {0xf0, 0x26, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     int n;
 
-    n = scsi_read(fd, cmd, 8, buf, 8);
+    n = ipslr_transport_read(p, cmd, 8, buf, 8);
     if (n != 8) {
         DPRINT("\tOnly got %d bytes\n", n);
         /* The *ist DS doesn't know to return the correct number of
@@ -1669,40 +3453,24 @@ static int read_status(FDTYPE fd, uint8_t *buf) {
     return PSLR_OK;
 }
 
-static int get_status(FDTYPE fd) {
-    DPRINT("[C]\t\t\tget_status(0x%x)\n", fd);
+static int get_status(ipslr_handle_t *p) {
+    DPRINT("[C]\t\t\tget_status(0x%x)\n", p->fd);
 
     uint8_t statusbuf[8];
     memset(statusbuf,0,8);
 
-    while (1) {
-        CHECK(read_status(fd, statusbuf));
-        DPRINT("[R]\t\t\t\t => ERROR: 0x%02X\n", statusbuf[7]);
-        if (statusbuf[7] != 0x01) {
-            break;
-        }
-        usleep(POLL_INTERVAL);
-    }
+    CHECK(ipslr_poll_status(p, statusbuf, ipslr_status_done));
+    DPRINT("[R]\t\t\t\t => ERROR: 0x%02X\n", statusbuf[7]);
     if (statusbuf[7] != 0) {
         DPRINT("\tERROR: 0x%x\n", statusbuf[7]);
     }
     return statusbuf[7];
 }
 
-static int get_result(FDTYPE fd) {
-    DPRINT("[C]\t\t\tget_result(0x%x)\n", fd);
+static int get_result(ipslr_handle_t *p) {
+    DPRINT("[C]\t\t\tget_result(0x%x)\n", p->fd);
     uint8_t statusbuf[8];
-    while (1) {
-        //DPRINT("read out status\n");
-        CHECK(read_status(fd, statusbuf));
-        //hexdump_debug(statusbuf, 8);
-        if (statusbuf[6] == 0x01) {
-            break;
-        }
-        //DPRINT("Waiting for result\n");
-        //hexdump_debug(statusbuf, 8);
-        usleep(POLL_INTERVAL);
-    }
+    CHECK(ipslr_poll_status(p, statusbuf, ipslr_result_done));
     if ((statusbuf[7] & 0xff) != 0) {
         DPRINT("\tERROR: 0x%x\n", statusbuf[7]);
         return -1;
@@ -1713,13 +3481,13 @@ static int get_result(FDTYPE fd) {
     return statusbuf[0] | statusbuf[1] << 8 | statusbuf[2] << 16 | statusbuf[3] << 24;
 }
 
-static int read_result(FDTYPE fd, uint8_t *buf, uint32_t n) {
-    DPRINT("[C]\t\t\tread_result(0x%x, size=%d)\n", fd, n);
+static int read_result(ipslr_handle_t *p, uint8_t *buf, uint32_t n) {
+    DPRINT("[C]\t\t\tread_result(0x%x, size=%d)\n", p->fd, n);
     uint8_t cmd[8] = {0xf0, 0x49, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
     int r;
     int i;
     set_uint32_le(n, &cmd[4]);
-    r = scsi_read(fd, cmd, sizeof (cmd), buf, n);
+    r = ipslr_transport_read(p, cmd, sizeof (cmd), buf, n);
     if (r != n) {
         return PSLR_READ_ERROR;
     }  else {
@@ -127,10 +127,24 @@ typedef struct {
 } pslr_buffer_segment_info;
 
 typedef void (*pslr_progress_callback_t)(uint32_t current, uint32_t total);
+typedef void (*pslr_download_progress_callback_t)(pslr_download_stats_t *stats, uintptr_t user_data);
+
+/* returns non-zero to abort the download */
+typedef int (*pslr_buffer_sink_t)(const uint8_t *buf, uint32_t length, uintptr_t user_data);
 
 void sleep_sec(double sec);
 
+/* Every call returns a new handle, released by pslr_shutdown. A handle
+   can be shared between threads, its calls are serialized. */
 pslr_handle_t pslr_init(char *model, char *device);
+/* Kernel hotplug events for pslr_init_wait, -1 where not supported. */
+int pslr_hotplug_open(void);
+int pslr_hotplug_wait(int fd, int timeout_ms);
+void pslr_hotplug_close(int fd);
+/* pslr_init retried for timeout_ms (0: once, -1: forever). With a
+   hotplug descriptor it retries when a SCSI device is added, otherwise
+   once a second. */
+pslr_handle_t pslr_init_wait(char *model, char *device, int hotplug_fd, int timeout_ms);
 int pslr_connect(pslr_handle_t h);
 int pslr_disconnect(pslr_handle_t h);
 int pslr_shutdown(pslr_handle_t h);
@@ -152,6 +166,11 @@ int pslr_get_buffer(pslr_handle_t h, int bufno, pslr_buffer_type type, int resol
 
 int pslr_set_progress_callback(pslr_handle_t h, pslr_progress_callback_t cb,
                                uintptr_t user_data);
+int pslr_set_download_progress_callback(pslr_handle_t h, pslr_download_progress_callback_t cb,
+                                        uintptr_t user_data);
+/* try download blocks above 64 KiB, up to 1 MiB, off by default */
+int pslr_set_block_size_probe(pslr_handle_t h, bool probe);
+int pslr_get_download_stats(pslr_handle_t h, pslr_download_stats_t *stats);
 
 int pslr_set_shutter(pslr_handle_t h, pslr_rational_t value);
 int pslr_set_aperture(pslr_handle_t h, pslr_rational_t value);
@@ -196,10 +215,36 @@ int pslr_bulb(pslr_handle_t h, bool on );
 
 int pslr_buffer_open(pslr_handle_t h, int bufno, pslr_buffer_type type, int resolution);
 uint32_t pslr_buffer_read(pslr_handle_t h, uint8_t *buf, uint32_t size);
+/* Downloads the open buffer on a reader thread while the calling thread
+   passes the blocks to sink, so USB and disk transfers overlap */
+int pslr_buffer_save(pslr_handle_t h, pslr_buffer_sink_t sink, uintptr_t user_data);
 uint32_t pslr_fullmemory_read(pslr_handle_t h, uint8_t *buf, uint32_t offset, uint32_t size);
 void pslr_buffer_close(pslr_handle_t h);
 uint32_t pslr_buffer_get_size(pslr_handle_t h);
 
+/* Synchronized trigger of several cameras. Each camera gets its own
+   handle and I/O thread; pslr_sync_arm focuses and locks AE on all of
+   them where the camera settings allow it (false unlocks AE),
+   pslr_sync_shutter fires them together. */
+typedef struct pslr_sync_group pslr_sync_group_t;
+
+typedef struct {
+    int result;           // PSLR_OK or the error of this camera
+    int64_t issue_usec;   // CLOCK_MONOTONIC time the shutter command was sent
+    int32_t skew_usec;    // issue time after the first camera of the group
+    uint32_t accept_usec; // shutter command sent until the camera finished it
+    bool focused;         // pslr_sync_arm: AF was run
+    bool ae_locked;       // pslr_sync_arm: AE was locked
+} pslr_sync_result_t;
+
+pslr_sync_group_t *pslr_sync_open(char **devices, int count);
+int pslr_sync_count(pslr_sync_group_t *g);
+pslr_handle_t pslr_sync_handle(pslr_sync_group_t *g, int index);
+int pslr_sync_arm(pslr_sync_group_t *g, bool arm);
+/* results: pslr_sync_count entries or NULL */
+int pslr_sync_shutter(pslr_sync_group_t *g, pslr_sync_result_t *results);
+void pslr_sync_close(pslr_sync_group_t *g);
+
 int pslr_set_exposure_mode(pslr_handle_t h, pslr_exposure_mode_t mode);
 int pslr_select_af_point(pslr_handle_t h, uint32_t point);
 
@@ -232,6 +277,39 @@ int pslr_read_setting(pslr_handle_t *h, int offset, uint32_t *value);
 int pslr_write_setting(pslr_handle_t *h, int offset, uint32_t value);
 int pslr_write_setting_by_name(pslr_handle_t *h, char *name, uint32_t value);
 int pslr_read_settings(pslr_handle_t *h);
+int pslr_read_all_settings(pslr_handle_t *h);
+int pslr_get_settings_stats(pslr_handle_t h, pslr_settings_stats_t *stats);
+int pslr_get_poll_stats(pslr_handle_t h, pslr_poll_stats_t *stats, int max);
+/* fast: press the shutter without reading the full status first */
+int pslr_set_fast_shutter(pslr_handle_t h, bool fast);
+/* pslr_buffer_save reads into the mapped SCSI reserved buffer and passes
+   the mapped pages to the sink, no copy but no USB/sink overlap either.
+   PSLR_PARAM where the transport cannot map it. */
+int pslr_set_mapped_download(pslr_handle_t h, bool mapped);
+/* queued: the request of the next download block is sent behind the data
+   read of the current one (Linux SG v3). PSLR_PARAM where the transport
+   cannot queue. */
+int pslr_set_queued_commands(pslr_handle_t h, bool queued);
+/* writes the last transactions as a Chrome trace / Perfetto JSON file */
+int pslr_trace_dump(pslr_handle_t h, const char *filename);
+/* failed or very slow transactions dump the trace to filename, NULL stops */
+int pslr_set_trace_file(pslr_handle_t h, const char *filename);
+int pslr_get_shutter_stats(pslr_handle_t h, pslr_shutter_stats_t *stats);
+/* full status reads younger than usec are served from the handle,
+   0 (the default) reads the camera every time */
+int pslr_set_status_cache_ttl(pslr_handle_t h, uint32_t usec);
+int pslr_get_status_cache_ttl(pslr_handle_t h, uint32_t *usec);
+int pslr_get_status_cache_stats(pslr_handle_t h, pslr_status_cache_stats_t *stats);
+
+typedef void (*pslr_status_change_callback_t)(void *h, uint32_t changes, const pslr_status *old_status,
+        const pslr_status *new_status, uintptr_t user_data);
+
+/* cb is called with the pslr_status_change_t groups in mask that changed
+   when a new full status is read */
+int pslr_set_status_change_callback(pslr_handle_t h, uint32_t mask, pslr_status_change_callback_t cb,
+                                    uintptr_t user_data);
+/* returns the changed groups since the previous call */
+uint32_t pslr_get_status_changes(pslr_handle_t h);
 
 pslr_gui_exposure_mode_t exposure_mode_conversion( pslr_exposure_mode_t exp );
 char *format_rational( pslr_rational_t rational, char * fmt );
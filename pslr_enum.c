@@ -38,6 +38,9 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 const char* pslr_color_space_str[PSLR_COLOR_SPACE_MAX] = {
     "sRGB",
@@ -217,18 +220,134 @@ int find_in_array( const char** array, int length, char* str ) {
 }
 
 const char *get_pslr_str( const char** array, int length, int value ) {
+    // valid until the next unknown value in the same thread
+    static __thread char unknown[32];
     if (value >=0 && value < length) {
         return array[value];
     } else {
-        char *ret = malloc(128);
-        sprintf (ret, "Unknown value: %d", value);
-        return ret;
+        snprintf(unknown, sizeof(unknown), "Unknown value: %d", value);
+        return unknown;
     }
 }
 
+/* The parsed string tables are looked up in tries built on first use.
+   Nodes are lowercase characters, a node where an entry ends stores its
+   index, so the deepest such node on the path of the string is the
+   longest matching prefix, as in find_in_array. */
+
+#define ENUM_TRIE_NODES 512
+
+typedef struct {
+    char c;
+    int8_t value;        // index of the entry ending here, -1: none
+    uint16_t child;      // first child, 0: none
+    uint16_t sibling;
+} enum_trie_node_t;
+
+typedef struct {
+    const char **array;
+    int length;
+    uint16_t root;       // 0: not built, use find_in_array
+} enum_trie_t;
+
+#define ENUM_TRIE(array) { array, sizeof(array)/sizeof(array[0]), 0 }
+
+static enum_trie_t color_space_trie = ENUM_TRIE(pslr_color_space_str);
+static enum_trie_t af_mode_trie = ENUM_TRIE(pslr_af_mode_str);
+static enum_trie_t ae_metering_trie = ENUM_TRIE(pslr_ae_metering_str);
+static enum_trie_t flash_mode_trie = ENUM_TRIE(pslr_flash_mode_str);
+static enum_trie_t drive_mode_trie = ENUM_TRIE(pslr_drive_mode_str);
+static enum_trie_t af_point_sel_trie = ENUM_TRIE(pslr_af_point_sel_str);
+static enum_trie_t jpeg_image_tone_trie = ENUM_TRIE(pslr_jpeg_image_tone_str);
+static enum_trie_t white_balance_mode_trie = ENUM_TRIE(pslr_white_balance_mode_str);
+
+static enum_trie_t *enum_tries[] = {
+    &color_space_trie, &af_mode_trie, &ae_metering_trie, &flash_mode_trie, &drive_mode_trie,
+    &af_point_sel_trie, &jpeg_image_tone_trie, &white_balance_mode_trie
+};
+
+static enum_trie_node_t enum_trie_nodes[ENUM_TRIE_NODES];
+static int enum_trie_node_count = 1; // node 0 is the 'none' link
+static pthread_once_t enum_trie_once = PTHREAD_ONCE_INIT;
+
+static int enum_trie_new_node(char c, uint16_t sibling) {
+    if (enum_trie_node_count == ENUM_TRIE_NODES) {
+        return 0;
+    }
+    enum_trie_node_t *node = &enum_trie_nodes[enum_trie_node_count];
+    node->c = c;
+    node->value = -1;
+    node->child = 0;
+    node->sibling = sibling;
+    return enum_trie_node_count++;
+}
+
+static bool enum_trie_insert(uint16_t root, const char *str, int value) {
+    uint16_t node = root;
+    uint16_t child;
+    for (; *str; ++str) {
+        char c = tolower((unsigned char) *str);
+        for (child = enum_trie_nodes[node].child; child && enum_trie_nodes[child].c != c; child = enum_trie_nodes[child].sibling) {
+        }
+        if (!child) {
+            child = enum_trie_new_node(c, enum_trie_nodes[node].child);
+            if (!child) {
+                return false;
+            }
+            enum_trie_nodes[node].child = child;
+        }
+        node = child;
+    }
+    // duplicated names: the first one wins
+    if (enum_trie_nodes[node].value < 0) {
+        enum_trie_nodes[node].value = value;
+    }
+    return true;
+}
+
+static void enum_trie_build(void) {
+    unsigned int t;
+    int i;
+    for (t = 0; t < sizeof(enum_tries)/sizeof(enum_tries[0]); ++t) {
+        enum_trie_t *trie = enum_tries[t];
+        uint16_t root = enum_trie_new_node('\0', 0);
+        for (i = 0; root && i < trie->length; ++i) {
+            if (!enum_trie_insert(root, trie->array[i], i)) {
+                root = 0;
+            }
+        }
+        trie->root = root;
+    }
+}
+
+static int find_in_trie( enum_trie_t *trie, char *str ) {
+    uint16_t node;
+    int found_index = -1;
+    pthread_once(&enum_trie_once, enum_trie_build);
+    if (!trie->root) {
+        return find_in_array(trie->array, trie->length, str);
+    }
+    if (str == NULL) {
+        return -1;
+    }
+    node = trie->root;
+    for (; *str; ++str) {
+        char c = tolower((unsigned char) *str);
+        for (node = enum_trie_nodes[node].child; node && enum_trie_nodes[node].c != c; node = enum_trie_nodes[node].sibling) {
+        }
+        if (!node) {
+            break;
+        }
+        if (enum_trie_nodes[node].value >= 0) {
+            found_index = enum_trie_nodes[node].value;
+        }
+    }
+    return found_index;
+}
+
 
 pslr_color_space_t get_pslr_color_space( char *str ) {
-    return find_in_array( pslr_color_space_str, sizeof(pslr_color_space_str)/sizeof(pslr_color_space_str[0]),str);
+    return find_in_trie( &color_space_trie, str );
 }
 
 const char *get_pslr_color_space_str( pslr_color_space_t value ) {
@@ -236,7 +355,7 @@ const char *get_pslr_color_space_str( pslr_color_space_t value ) {
 }
 
 pslr_af_mode_t get_pslr_af_mode( char *str ) {
-    return find_in_array( pslr_af_mode_str, sizeof(pslr_af_mode_str)/sizeof(pslr_af_mode_str[0]),str);
+    return find_in_trie( &af_mode_trie, str );
 }
 
 const char *get_pslr_af_mode_str( pslr_af_mode_t value ) {
@@ -244,7 +363,7 @@ const char *get_pslr_af_mode_str( pslr_af_mode_t value ) {
 }
 
 pslr_ae_metering_t get_pslr_ae_metering( char *str ) {
-    return find_in_array( pslr_ae_metering_str, sizeof(pslr_ae_metering_str)/sizeof(pslr_ae_metering_str[0]),str);
+    return find_in_trie( &ae_metering_trie, str );
 }
 
 const char *get_pslr_ae_metering_str( pslr_ae_metering_t value ) {
@@ -252,7 +371,7 @@ const char *get_pslr_ae_metering_str( pslr_ae_metering_t value ) {
 }
 
 pslr_flash_mode_t get_pslr_flash_mode( char *str ) {
-    return find_in_array( pslr_flash_mode_str, sizeof(pslr_flash_mode_str)/sizeof(pslr_flash_mode_str[0]),str);
+    return find_in_trie( &flash_mode_trie, str );
 }
 
 const char *get_pslr_flash_mode_str( pslr_flash_mode_t value ) {
@@ -260,7 +379,7 @@ const char *get_pslr_flash_mode_str( pslr_flash_mode_t value ) {
 }
 
 pslr_drive_mode_t get_pslr_drive_mode( char *str ) {
-    return find_in_array( pslr_drive_mode_str, sizeof(pslr_drive_mode_str)/sizeof(pslr_drive_mode_str[0]),str);
+    return find_in_trie( &drive_mode_trie, str );
 }
 
 const char *get_pslr_drive_mode_str( pslr_drive_mode_t value ) {
@@ -268,7 +387,7 @@ const char *get_pslr_drive_mode_str( pslr_drive_mode_t value ) {
 }
 
 pslr_af_point_sel_t get_pslr_af_point_sel( char *str ) {
-    return find_in_array( pslr_af_point_sel_str, sizeof(pslr_af_point_sel_str)/sizeof(pslr_af_point_sel_str[0]),str);
+    return find_in_trie( &af_point_sel_trie, str );
 }
 
 const char *get_pslr_af_point_sel_str( pslr_af_point_sel_t value ) {
@@ -276,7 +395,7 @@ const char *get_pslr_af_point_sel_str( pslr_af_point_sel_t value ) {
 }
 
 pslr_jpeg_image_tone_t get_pslr_jpeg_image_tone( char *str ) {
-    return find_in_array( pslr_jpeg_image_tone_str, sizeof(pslr_jpeg_image_tone_str)/sizeof(pslr_jpeg_image_tone_str[0]),str);
+    return find_in_trie( &jpeg_image_tone_trie, str );
 }
 
 const char *get_pslr_jpeg_image_tone_str( pslr_jpeg_image_tone_t value ) {
@@ -284,7 +403,7 @@ const char *get_pslr_jpeg_image_tone_str( pslr_jpeg_image_tone_t value ) {
 }
 
 pslr_white_balance_mode_t get_pslr_white_balance_mode( char *str ) {
-    return find_in_array( pslr_white_balance_mode_str, sizeof(pslr_white_balance_mode_str)/sizeof(pslr_white_balance_mode_str[0]),str);
+    return find_in_trie( &white_balance_mode_trie, str );
 }
 
 const char *get_pslr_white_balance_mode_str( pslr_white_balance_mode_t value ) {
@@ -29,23 +29,33 @@
 #include "pslr_lens.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
-static const struct {
+typedef struct {
     uint32_t id1;
     uint32_t id2;
     const char *name;
-} lens_id[] = {
+} lens_id_t;
+
+/* sorted by (id1, id2), see the exiftool_pentax target in the Makefile */
+static const lens_id_t lens_id[] = {
 #include "exiftool_pentax_lens.txt"
 };
 
-const char *get_lens_name( uint32_t id1, uint32_t id2) {
-    int lens_num = sizeof(lens_id)/sizeof(lens_id[0]);
-    int i;
-    for ( i=0; i<lens_num; ++i ) {
-        if ( lens_id[i].id1 == id1 &&
-                lens_id[i].id2 == id2 ) {
-            return lens_id[i].name;
-        }
+static int lens_id_compare(const void *a, const void *b) {
+    const lens_id_t *x = a;
+    const lens_id_t *y = b;
+    if (x->id1 != y->id1) {
+        return x->id1 < y->id1 ? -1 : 1;
+    }
+    if (x->id2 != y->id2) {
+        return x->id2 < y->id2 ? -1 : 1;
     }
-    return "";
+    return 0;
+}
+
+const char *get_lens_name( uint32_t id1, uint32_t id2) {
+    lens_id_t key = { id1, id2, NULL };
+    const lens_id_t *lens = bsearch(&key, lens_id, sizeof(lens_id)/sizeof(lens_id[0]), sizeof(lens_id[0]), lens_id_compare);
+    return lens != NULL ? lens->name : "";
 }
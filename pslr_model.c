@@ -33,6 +33,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,31 +42,6 @@
 
 #include "pslr_model.h"
 
-static uint8_t lastbuf[MAX_STATUS_BUF_SIZE];
-static int first = 1;
-
-static void ipslr_status_diff(uint8_t *buf) {
-    int n;
-    int diffs;
-    if (first) {
-        hexdump(buf, MAX_STATUS_BUF_SIZE);
-        memcpy(lastbuf, buf, MAX_STATUS_BUF_SIZE);
-        first = 0;
-    }
-
-    diffs = 0;
-    for (n = 0; n < MAX_STATUS_BUF_SIZE; n++) {
-        if (lastbuf[n] != buf[n]) {
-            DPRINT("\t\tbuf[%03X] last %02Xh %3d new %02Xh %3d\n", n, lastbuf[n], lastbuf[n], buf[n], buf[n]);
-            diffs++;
-        }
-    }
-    if (diffs) {
-        DPRINT("---------------------------\n");
-        memcpy(lastbuf, buf, MAX_STATUS_BUF_SIZE);
-    }
-}
-
 uint16_t get_uint16_be(uint8_t *buf) {
     uint16_t res;
     res = buf[0] << 8 | buf[1];
@@ -153,8 +129,8 @@ void hexdump_debug(uint8_t *buf, uint32_t bufLen) {
 
 // based on http://stackoverflow.com/a/657202/21348
 
-const char* int_to_binary( uint16_t x ) {
-    static char b[sizeof(uint16_t)*8+1] = {0};
+/* b needs sizeof(uint16_t)*8+1 chars */
+const char* int_to_binary( uint16_t x, char *b ) {
     int y;
     long long z;
     for (z=(1LL<<sizeof(uint16_t)*8)-1,y=0; z>0; z>>=1,y++) {
@@ -194,513 +170,604 @@ int get_hw_jpeg_quality( ipslr_model_info_t *model, int user_jpeg_stars) {
 }
 
 
-void ipslr_status_parse_k10d(ipslr_handle_t  *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
-    }
-    memset(status, 0, sizeof (*status));
-    status->bufmask = get_uint16_be(&buf[0x16]);
-    status->user_mode_flag = get_uint32_be(&buf[0x1c]);
-    status->set_shutter_speed.nom = get_uint32_be(&buf[0x2c]);
-    status->set_shutter_speed.denom = get_uint32_be(&buf[0x30]);
-    status->set_aperture.nom = get_uint32_be(&buf[0x34]);
-    status->set_aperture.denom = get_uint32_be(&buf[0x38]);
-    status->ec.nom = get_uint32_be(&buf[0x3c]);
-    status->ec.denom = get_uint32_be(&buf[0x40]);
-    status->fixed_iso = get_uint32_be(&buf[0x60]);
-    status->image_format = get_uint32_be(&buf[0x78]);
-    status->jpeg_resolution = get_uint32_be(&buf[0x7c]);
-    status->jpeg_quality = _get_user_jpeg_stars( p->model, get_uint32_be(&buf[0x80]));
-    status->raw_format = get_uint32_be(&buf[0x84]);
-    status->jpeg_image_tone = get_uint32_be(&buf[0x88]);
-    status->jpeg_saturation = get_uint32_be(&buf[0x8c]);
-    status->jpeg_sharpness = get_uint32_be(&buf[0x90]);
-    status->jpeg_contrast = get_uint32_be(&buf[0x94]);
-    status->custom_ev_steps = get_uint32_be(&buf[0x9c]);
-    status->custom_sensitivity_steps = get_uint32_be(&buf[0xa0]);
-    status->af_point_select = get_uint32_be(&buf[0xbc]);
-    status->selected_af_point = get_uint32_be(&buf[0xc0]);
-    status->exposure_mode = get_uint32_be(&buf[0xac]);
-    status->current_shutter_speed.nom = get_uint32_be(&buf[0xf4]);
-    status->current_shutter_speed.denom = get_uint32_be(&buf[0xf8]);
-    status->current_aperture.nom = get_uint32_be(&buf[0xfc]);
-    status->current_aperture.denom = get_uint32_be(&buf[0x100]);
-    status->current_iso = get_uint32_be(&buf[0x11c]);
-    status->light_meter_flags = get_uint32_be(&buf[0x124]);
-    status->lens_min_aperture.nom = get_uint32_be(&buf[0x12c]);
-    status->lens_min_aperture.denom = get_uint32_be(&buf[0x130]);
-    status->lens_max_aperture.nom = get_uint32_be(&buf[0x134]);
-    status->lens_max_aperture.denom = get_uint32_be(&buf[0x138]);
-    status->focused_af_point = get_uint32_be(&buf[0x150]);
-    status->zoom.nom = get_uint32_be(&buf[0x16c]);
-    status->zoom.denom = get_uint32_be(&buf[0x170]);
-    status->focus = get_int32_be(&buf[0x174]);
-}
+typedef enum {
+    STATUS_TRANSFORM_ID_RAW,
+    STATUS_TRANSFORM_ID_STARS,
+    STATUS_TRANSFORM_ID_LENS_ID
+} ipslr_status_transform_t;
 
-void ipslr_status_parse_k20d(ipslr_handle_t *p, pslr_status *status) {
+typedef struct {
+    const char *name;
+    uint16_t offset;
+    uint8_t width;
+    bool little_endian;
+    uint16_t status_offset;         // of the field in pslr_status
+    uint8_t status_size;
+    uint8_t transform;              // ipslr_status_transform_t
+} ipslr_status_field_def_t;
 
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+static uint32_t ipslr_status_field_value(const ipslr_status_field_def_t *def, uint8_t *buf) {
+    if (def->width == 2) {
+        return def->little_endian ? get_uint16_le(buf) : get_uint16_be(buf);
     }
-    memset(status, 0, sizeof (*status));
-    status->bufmask = get_uint16_be( &buf[0x16]);
-    status->user_mode_flag = get_uint32_be(&buf[0x1c]);
-    status->set_shutter_speed.nom = get_uint32_be(&buf[0x2c]);
-    status->set_shutter_speed.denom = get_uint32_be(&buf[0x30]);
-    status->set_aperture.nom = get_uint32_be(&buf[0x34]);
-    status->set_aperture.denom = get_uint32_be(&buf[0x38]);
-    status->ec.nom = get_uint32_be(&buf[0x3c]);
-    status->ec.denom = get_uint32_be(&buf[0x40]);
-    status->fixed_iso = get_uint32_be(&buf[0x60]);
-    status->image_format = get_uint32_be(&buf[0x78]);
-    status->jpeg_resolution = get_uint32_be(&buf[0x7c]);
-    status->jpeg_quality = _get_user_jpeg_stars( p->model, get_uint32_be(&buf[0x80]));
-    status->raw_format = get_uint32_be(&buf[0x84]);
-    status->jpeg_image_tone = get_uint32_be(&buf[0x88]);
-    status->jpeg_saturation = get_uint32_be(&buf[0x8c]); // commands do now work for it?
-    status->jpeg_sharpness = get_uint32_be(&buf[0x90]); // commands do now work for it?
-    status->jpeg_contrast = get_uint32_be(&buf[0x94]); // commands do now work for it?
-    status->custom_ev_steps = get_uint32_be(&buf[0x9c]);
-    status->custom_sensitivity_steps = get_uint32_be(&buf[0xa0]);
-    status->ae_metering_mode = get_uint32_be(&buf[0xb4]); // same as c4
-    status->af_mode = get_uint32_be(&buf[0xb8]);
-    status->af_point_select = get_uint32_be(&buf[0xbc]); // not sure
-    status->selected_af_point = get_uint32_be(&buf[0xc0]);
-    status->exposure_mode = get_uint32_be(&buf[0xac]);
-    status->current_shutter_speed.nom = get_uint32_be(&buf[0x108]);
-    status->current_shutter_speed.denom = get_uint32_be(&buf[0x10C]);
-    status->current_aperture.nom = get_uint32_be(&buf[0x110]);
-    status->current_aperture.denom = get_uint32_be(&buf[0x114]);
-    status->current_iso = get_uint32_be(&buf[0x130]);
-    status->light_meter_flags = get_uint32_be(&buf[0x138]);
-    status->lens_min_aperture.nom = get_uint32_be(&buf[0x140]);
-    status->lens_min_aperture.denom = get_uint32_be(&buf[0x144]);
-    status->lens_max_aperture.nom = get_uint32_be(&buf[0x148]);
-    status->lens_max_aperture.denom = get_uint32_be(&buf[0x14B]);
-    status->focused_af_point = get_uint32_be(&buf[0x160]); // unsure about it, a lot is changing when the camera focuses
-    status->zoom.nom = get_uint32_be(&buf[0x180]);
-    status->zoom.denom = get_uint32_be(&buf[0x184]);
-    status->focus = get_int32_be(&buf[0x188]); // current focus ring position?
-    // 0x158 current ev?
-    // 0x160 and 0x164 change when AF
-}
-
-void ipslr_status_parse_istds(ipslr_handle_t *p, pslr_status *status) {
-
-    uint8_t *buf = p->status_buffer;
-    /* *ist DS status block */
-    memset(status, 0, sizeof (*status));
-    status->bufmask = get_uint16_be(&buf[0x12]);
-    status->set_shutter_speed.nom = get_uint32_be(&buf[0x80]);
-    status->set_shutter_speed.denom = get_uint32_be(&buf[0x84]);
-    status->set_aperture.nom = get_uint32_be(&buf[0x88]);
-    status->set_aperture.denom = get_uint32_be(&buf[0x8c]);
-    status->lens_min_aperture.nom = get_uint32_be(&buf[0xb8]);
-    status->lens_min_aperture.denom = get_uint32_be(&buf[0xbc]);
-    status->lens_max_aperture.nom = get_uint32_be(&buf[0xc0]);
-    status->lens_max_aperture.denom = get_uint32_be(&buf[0xc4]);
-
-    // no DNG support so raw format is PEF
-    status->raw_format = PSLR_RAW_FORMAT_PEF;
+    return def->little_endian ? get_uint32_le(buf) : get_uint32_be(buf);
 }
 
-// some of the cameras share most of the status fields
-// this method is used for K-x, K-7, K-5, K-r
-//
-// some cameras also have this data block, but it's shifted a bit
-void ipslr_status_parse_common(ipslr_handle_t *p, pslr_status *status, int shift) {
-
-    uint8_t *buf = p->status_buffer;
-    get_uint32_func get_uint32_func_ptr;
-    get_int32_func get_int32_func_ptr;
-    get_uint16_func get_uint16_func_ptr;
-
-    if (p->model->is_little_endian) {
-        get_uint32_func_ptr = get_uint32_le;
-        get_int32_func_ptr = get_int32_le;
-        get_uint16_func_ptr = get_uint16_le;
-    } else {
-        get_uint32_func_ptr = get_uint32_be;
-        get_int32_func_ptr = get_int32_be;
-        get_uint16_func_ptr = get_uint16_be;
-    }
-
-    // 0x0C: 0x85 0xA5
-    // 0x0F: beginning 0 sometime changes to 1
-    // 0x14: LCD panel 2: turned off 3: on?
-    status->bufmask = (*get_uint16_func_ptr)( &buf[0x1E + shift]);
-    status->user_mode_flag = (*get_uint32_func_ptr)(&buf[0x24 + shift]);
-    status->flash_mode = (*get_uint32_func_ptr)(&buf[0x28 + shift]);
-    status->flash_exposure_compensation = (*get_int32_func_ptr)(&buf[0x2C + shift]);
-    status->set_shutter_speed.nom = (*get_uint32_func_ptr)(&buf[0x34 + shift]);
-    status->set_shutter_speed.denom = (*get_uint32_func_ptr)(&buf[0x38 + shift]);
-    status->set_aperture.nom = (*get_uint32_func_ptr)(&buf[0x3C + shift]);
-    status->set_aperture.denom = (*get_uint32_func_ptr)(&buf[0x40 + shift]);
-    status->ec.nom = (*get_uint32_func_ptr)(&buf[0x44 + shift]);
-    status->ec.denom = (*get_uint32_func_ptr)(&buf[0x48 + shift]);
-    status->auto_bracket_mode = (*get_uint32_func_ptr)(&buf[0x4C + shift]);
-    status->auto_bracket_ev.nom = (*get_uint32_func_ptr)(&buf[0x50 + shift]);
-    status->auto_bracket_ev.denom = (*get_uint32_func_ptr)(&buf[0x54 + shift]);
-    status->auto_bracket_picture_count = (*get_uint32_func_ptr)(&buf[0x58 + shift]);
-    status->drive_mode = (*get_uint32_func_ptr)(&buf[0x5C + shift]);
-    status->fixed_iso = (*get_uint32_func_ptr)(&buf[0x68 + shift]);
-    status->auto_iso_min = (*get_uint32_func_ptr)(&buf[0x6C + shift]);
-    status->auto_iso_max = (*get_uint32_func_ptr)(&buf[0x70 + shift]);
-    status->white_balance_mode = (*get_uint32_func_ptr)(&buf[0x74 + shift]);
-    status->white_balance_adjust_mg = (*get_uint32_func_ptr)(&buf[0x78 + shift]); // 0: M7 7: 0 14: G7
-    status->white_balance_adjust_ba = (*get_uint32_func_ptr)(&buf[0x7C + shift]); // 0: B7 7: 0 14: A7
-    status->image_format = (*get_uint32_func_ptr)(&buf[0x80 + shift]);
-    status->jpeg_resolution = (*get_uint32_func_ptr)(&buf[0x84 + shift]);
-    status->jpeg_quality = _get_user_jpeg_stars( p->model, (*get_uint32_func_ptr)(&buf[0x88 + shift]));
-    status->raw_format = (*get_uint32_func_ptr)(&buf[0x8C + shift]);
-    status->jpeg_image_tone = (*get_uint32_func_ptr)(&buf[0x90 + shift]);
-    status->jpeg_saturation = (*get_uint32_func_ptr)(&buf[0x94 + shift]);
-    status->jpeg_sharpness = (*get_uint32_func_ptr)(&buf[0x98 + shift]);
-    status->jpeg_contrast = (*get_uint32_func_ptr)(&buf[0x9C + shift]);
-    status->color_space = (*get_uint32_func_ptr)(&buf[0xA0 + shift]);
-    status->custom_ev_steps = (*get_uint32_func_ptr)(&buf[0xA4 + shift]);
-    status->custom_sensitivity_steps = (*get_uint32_func_ptr)(&buf[0xa8 + shift]);
-    status->exposure_mode = (*get_uint32_func_ptr)(&buf[0xb4 + shift]);
-    status->scene_mode = (*get_uint32_func_ptr)(&buf[0xb8 + shift]);
-    status->ae_metering_mode = (*get_uint32_func_ptr)(&buf[0xbc + shift]); // same as cc
-    status->af_mode = (*get_uint32_func_ptr)(&buf[0xC0 + shift]);
-    status->af_point_select = (*get_uint32_func_ptr)(&buf[0xc4 + shift]);
-    status->selected_af_point = (*get_uint32_func_ptr)(&buf[0xc8 + shift]);
-    status->shake_reduction = (*get_uint32_func_ptr)(&buf[0xE0 + shift]);
-    status->auto_bracket_picture_counter = (*get_uint32_func_ptr)(&buf[0xE4 + shift]);
-    status->jpeg_hue = (*get_uint32_func_ptr)(&buf[0xFC + shift]);
-    status->current_shutter_speed.nom = (*get_uint32_func_ptr)(&buf[0x10C + shift]);
-    status->current_shutter_speed.denom = (*get_uint32_func_ptr)(&buf[0x110 + shift]);
-    status->current_aperture.nom = (*get_uint32_func_ptr)(&buf[0x114 + shift]);
-    status->current_aperture.denom = (*get_uint32_func_ptr)(&buf[0x118 + shift]);
-    status->max_shutter_speed.nom = (*get_uint32_func_ptr)(&buf[0x12C + shift]);
-    status->max_shutter_speed.denom = (*get_uint32_func_ptr)(&buf[0x130 + shift]);
-    status->current_iso = (*get_uint32_func_ptr)(&buf[0x134 + shift]);
-    status->light_meter_flags = (*get_uint32_func_ptr)(&buf[0x13C + shift]);
-    status->lens_min_aperture.nom = (*get_uint32_func_ptr)(&buf[0x144 + shift]);
-    status->lens_min_aperture.denom = (*get_uint32_func_ptr)(&buf[0x148 + shift]);
-    status->lens_max_aperture.nom = (*get_uint32_func_ptr)(&buf[0x14C + shift]);
-    status->lens_max_aperture.denom = (*get_uint32_func_ptr)(&buf[0x150 + shift]);
-    status->manual_mode_ev = (*get_int32_func_ptr)(&buf[0x15C + shift]);
-    status->focused_af_point = (*get_uint32_func_ptr)(&buf[0x168 + shift]); //d, unsure about it, a lot is changing when the camera focuses
-    // probably voltage*100
-    // battery_1 > battery2 ( noload vs load voltage?)
-    status->battery_1 = (*get_uint32_func_ptr)( &buf[0x170 + shift] );
-    status->battery_2 = (*get_uint32_func_ptr)( &buf[0x174 + shift] );
-    status->battery_3 = (*get_uint32_func_ptr)( &buf[0x180 + shift] );
-    status->battery_4 = (*get_uint32_func_ptr)( &buf[0x184 + shift] );
-
-}
-
-void ipslr_status_parse_kx(ipslr_handle_t *p, pslr_status *status) {
-
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+/* Prints the changed status fields of the layout, and the changed bytes
+   that no field of the layout covers. */
+static void ipslr_status_diff(ipslr_handle_t *p, uint8_t *buf, const ipslr_status_field_def_t *fields, int fields_length) {
+    uint8_t *lastbuf = p->status_diff_buffer;
+    bool covered[MAX_STATUS_BUF_SIZE];
+    int n;
+    int i, j;
+    int diffs;
+    if (!p->status_diff_init) {
+        hexdump(buf, MAX_STATUS_BUF_SIZE);
+        memcpy(lastbuf, buf, MAX_STATUS_BUF_SIZE);
+        p->status_diff_init = true;
     }
 
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0);
-    status->zoom.nom = get_uint32_be(&buf[0x198]);
-    status->zoom.denom = get_uint32_be(&buf[0x19C]);
-    status->focus = get_int32_be(&buf[0x1A0]);
-    status->lens_id1 = (get_uint32_be( &buf[0x188])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x194]);
-}
-
-// Vince: K-r support 2011-06-22
-//
-void ipslr_status_parse_kr(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+    diffs = 0;
+    memset(covered, 0, sizeof (covered));
+    for (i = 0; i < fields_length; i++) {
+        const ipslr_status_field_def_t *def = &fields[i];
+        // overridden by a later entry
+        for (j = i + 1; j < fields_length && strcmp(fields[j].name, def->name); j++) {
+        }
+        if (j < fields_length) {
+            continue;
+        }
+        memset(&covered[def->offset], 1, def->width);
+        if (memcmp(&lastbuf[def->offset], &buf[def->offset], def->width)) {
+            DPRINT("\t\t%-29s buf[%03X] last %u new %u\n", def->name, def->offset,
+                   ipslr_status_field_value(def, &lastbuf[def->offset]), ipslr_status_field_value(def, &buf[def->offset]));
+            diffs++;
+        }
     }
-
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    status->zoom.nom = get_uint32_be(&buf[0x19C]);
-    status->zoom.denom = get_uint32_be(&buf[0x1A0]);
-    status->focus = get_int32_be(&buf[0x1A4]);
-    status->lens_id1 = (get_uint32_be( &buf[0x18C])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x198]);
-}
-
-void ipslr_status_parse_k5(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+    for (n = 0; n < MAX_STATUS_BUF_SIZE; n++) {
+        if (!covered[n] && lastbuf[n] != buf[n]) {
+            DPRINT("\t\tbuf[%03X] last %02Xh %3d new %02Xh %3d\n", n, lastbuf[n], lastbuf[n], buf[n], buf[n]);
+            diffs++;
+        }
     }
-
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    status->zoom.nom = get_uint32_be(&buf[0x1A0]);
-    status->zoom.denom = get_uint32_be(&buf[0x1A4]);
-    status->focus = get_int32_be(&buf[0x1A8]); // ?
-    status->lens_id1 = (get_uint32_be( &buf[0x190])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x19C]);
-
-// TODO: check these fields
-//status.focused = getInt32(statusBuf, 0x164);
-}
-
-void ipslr_status_parse_k30(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+    if (diffs) {
+        DPRINT("---------------------------\n");
+        memcpy(lastbuf, buf, MAX_STATUS_BUF_SIZE);
     }
-
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    //~ status->jpeg_contrast -= 4;
-    //~ status->jpeg_hue -= 4;
-    //~ status->jpeg_sharpness -= 4;
-    //~ status->jpeg_saturation -= 4;
-    status->zoom.nom = get_uint32_be(&buf[0x1A0]);
-    status->zoom.denom = 100;
-    status->focus = get_int32_be(&buf[0x1A8]); // ?
-    status->lens_id1 = (get_uint32_be( &buf[0x190])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x19C]);
 }
 
-// status check seems to be the same as K30
-void ipslr_status_parse_k01(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
-    }
-
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    //~ status->jpeg_contrast -= 4;
-    //~ status->jpeg_hue -= 4;
-    //~ status->jpeg_sharpness -= 4;
-    //~ status->jpeg_saturation -= 4;
-    status->zoom.nom = get_uint32_be(&buf[0x1A0]); // - good for K01
-    status->zoom.denom = 100; // good for K-01
-    status->focus = get_int32_be(&buf[0x1A8]); // ? - good for K01
-    status->lens_id1 = (get_uint32_be( &buf[0x190])) & 0x0F; // - good for K01
-    status->lens_id2 = get_uint32_be( &buf[0x19C]); // - good for K01
-}
+/*
+   Status buffer layouts.
 
-void ipslr_status_parse_k50(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
-    }
+   Every layout is a list of F(field, type, endianness, offset, transform)
+   and C(field, value) entries. STATUS_PARSER expands a layout into a parser
+   with the reads inlined, and into the field table ipslr_status_diff uses
+   to name the changed bytes and ipslr_status_update uses to re-derive
+   only the changed fields. Later entries override earlier ones.
+ */
 
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    status->zoom.nom = get_uint32_be(&buf[0x1A0]);
-    status->zoom.denom = get_uint32_be(&buf[0x1A4]);
-    //    status->focus = get_int32_be(&buf[0x1A8]); // ?
-    status->lens_id1 = (get_uint32_be( &buf[0x190])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x19C]);
-}
+#define STATUS_FIELDS_K10D(F, C) \
+    F(bufmask,                       U16, BE, 0x16,  RAW) \
+    F(user_mode_flag,                U32, BE, 0x1c,  RAW) \
+    F(set_shutter_speed.nom,         U32, BE, 0x2c,  RAW) \
+    F(set_shutter_speed.denom,       U32, BE, 0x30,  RAW) \
+    F(set_aperture.nom,              U32, BE, 0x34,  RAW) \
+    F(set_aperture.denom,            U32, BE, 0x38,  RAW) \
+    F(ec.nom,                        U32, BE, 0x3c,  RAW) \
+    F(ec.denom,                      U32, BE, 0x40,  RAW) \
+    F(fixed_iso,                     U32, BE, 0x60,  RAW) \
+    F(image_format,                  U32, BE, 0x78,  RAW) \
+    F(jpeg_resolution,               U32, BE, 0x7c,  RAW) \
+    F(jpeg_quality,                  U32, BE, 0x80,  STARS) \
+    F(raw_format,                    U32, BE, 0x84,  RAW) \
+    F(jpeg_image_tone,               U32, BE, 0x88,  RAW) \
+    F(jpeg_saturation,               U32, BE, 0x8c,  RAW) \
+    F(jpeg_sharpness,                U32, BE, 0x90,  RAW) \
+    F(jpeg_contrast,                 U32, BE, 0x94,  RAW) \
+    F(custom_ev_steps,               U32, BE, 0x9c,  RAW) \
+    F(custom_sensitivity_steps,      U32, BE, 0xa0,  RAW) \
+    F(af_point_select,               U32, BE, 0xbc,  RAW) \
+    F(selected_af_point,             U32, BE, 0xc0,  RAW) \
+    F(exposure_mode,                 U32, BE, 0xac,  RAW) \
+    F(current_shutter_speed.nom,     U32, BE, 0xf4,  RAW) \
+    F(current_shutter_speed.denom,   U32, BE, 0xf8,  RAW) \
+    F(current_aperture.nom,          U32, BE, 0xfc,  RAW) \
+    F(current_aperture.denom,        U32, BE, 0x100, RAW) \
+    F(current_iso,                   U32, BE, 0x11c, RAW) \
+    F(light_meter_flags,             U32, BE, 0x124, RAW) \
+    F(lens_min_aperture.nom,         U32, BE, 0x12c, RAW) \
+    F(lens_min_aperture.denom,       U32, BE, 0x130, RAW) \
+    F(lens_max_aperture.nom,         U32, BE, 0x134, RAW) \
+    F(lens_max_aperture.denom,       U32, BE, 0x138, RAW) \
+    F(focused_af_point,              U32, BE, 0x150, RAW) \
+    F(zoom.nom,                      U32, BE, 0x16c, RAW) \
+    F(zoom.denom,                    U32, BE, 0x170, RAW) \
+    F(focus,                         I32, BE, 0x174, RAW)
+
+// 0x158 current ev?
+// 0x160 and 0x164 change when AF
+#define STATUS_FIELDS_K20D(F, C) \
+    F(bufmask,                       U16, BE, 0x16,  RAW) \
+    F(user_mode_flag,                U32, BE, 0x1c,  RAW) \
+    F(set_shutter_speed.nom,         U32, BE, 0x2c,  RAW) \
+    F(set_shutter_speed.denom,       U32, BE, 0x30,  RAW) \
+    F(set_aperture.nom,              U32, BE, 0x34,  RAW) \
+    F(set_aperture.denom,            U32, BE, 0x38,  RAW) \
+    F(ec.nom,                        U32, BE, 0x3c,  RAW) \
+    F(ec.denom,                      U32, BE, 0x40,  RAW) \
+    F(fixed_iso,                     U32, BE, 0x60,  RAW) \
+    F(image_format,                  U32, BE, 0x78,  RAW) \
+    F(jpeg_resolution,               U32, BE, 0x7c,  RAW) \
+    F(jpeg_quality,                  U32, BE, 0x80,  STARS) \
+    F(raw_format,                    U32, BE, 0x84,  RAW) \
+    F(jpeg_image_tone,               U32, BE, 0x88,  RAW) \
+    F(jpeg_saturation,               U32, BE, 0x8c,  RAW) /* commands do now work for it? */ \
+    F(jpeg_sharpness,                U32, BE, 0x90,  RAW) /* commands do now work for it? */ \
+    F(jpeg_contrast,                 U32, BE, 0x94,  RAW) /* commands do now work for it? */ \
+    F(custom_ev_steps,               U32, BE, 0x9c,  RAW) \
+    F(custom_sensitivity_steps,      U32, BE, 0xa0,  RAW) \
+    F(ae_metering_mode,              U32, BE, 0xb4,  RAW) /* same as c4 */ \
+    F(af_mode,                       U32, BE, 0xb8,  RAW) \
+    F(af_point_select,               U32, BE, 0xbc,  RAW) /* not sure */ \
+    F(selected_af_point,             U32, BE, 0xc0,  RAW) \
+    F(exposure_mode,                 U32, BE, 0xac,  RAW) \
+    F(current_shutter_speed.nom,     U32, BE, 0x108, RAW) \
+    F(current_shutter_speed.denom,   U32, BE, 0x10C, RAW) \
+    F(current_aperture.nom,          U32, BE, 0x110, RAW) \
+    F(current_aperture.denom,        U32, BE, 0x114, RAW) \
+    F(current_iso,                   U32, BE, 0x130, RAW) \
+    F(light_meter_flags,             U32, BE, 0x138, RAW) \
+    F(lens_min_aperture.nom,         U32, BE, 0x140, RAW) \
+    F(lens_min_aperture.denom,       U32, BE, 0x144, RAW) \
+    F(lens_max_aperture.nom,         U32, BE, 0x148, RAW) \
+    F(lens_max_aperture.denom,       U32, BE, 0x14B, RAW) \
+    F(focused_af_point,              U32, BE, 0x160, RAW) /* unsure about it, a lot is changing when the camera focuses */ \
+    F(zoom.nom,                      U32, BE, 0x180, RAW) \
+    F(zoom.denom,                    U32, BE, 0x184, RAW) \
+    F(focus,                         I32, BE, 0x188, RAW) /* current focus ring position? */
+
+/* *ist DS status block */
+#define STATUS_FIELDS_ISTDS(F, C) \
+    F(bufmask,                       U16, BE, 0x12,  RAW) \
+    F(set_shutter_speed.nom,         U32, BE, 0x80,  RAW) \
+    F(set_shutter_speed.denom,       U32, BE, 0x84,  RAW) \
+    F(set_aperture.nom,              U32, BE, 0x88,  RAW) \
+    F(set_aperture.denom,            U32, BE, 0x8c,  RAW) \
+    F(lens_min_aperture.nom,         U32, BE, 0xb8,  RAW) \
+    F(lens_min_aperture.denom,       U32, BE, 0xbc,  RAW) \
+    F(lens_max_aperture.nom,         U32, BE, 0xc0,  RAW) \
+    F(lens_max_aperture.denom,       U32, BE, 0xc4,  RAW) \
+    C(raw_format,                    PSLR_RAW_FORMAT_PEF) /* no DNG support so raw format is PEF */
 
-void ipslr_status_parse_k500(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
-    }
+// some of the cameras share most of the status fields
+// this block is used for K-x, K-7, K-5, K-r
+//
+// some cameras also have this data block, but it's shifted a bit
+//
+// 0x0C: 0x85 0xA5
+// 0x0F: beginning 0 sometime changes to 1
+// 0x14: LCD panel 2: turned off 3: on?
+#define STATUS_FIELDS_COMMON(F, E, S) \
+    F(bufmask,                       U16, E, 0x1E + S,  RAW) \
+    F(user_mode_flag,                U32, E, 0x24 + S,  RAW) \
+    F(flash_mode,                    U32, E, 0x28 + S,  RAW) \
+    F(flash_exposure_compensation,   I32, E, 0x2C + S,  RAW) \
+    F(set_shutter_speed.nom,         U32, E, 0x34 + S,  RAW) \
+    F(set_shutter_speed.denom,       U32, E, 0x38 + S,  RAW) \
+    F(set_aperture.nom,              U32, E, 0x3C + S,  RAW) \
+    F(set_aperture.denom,            U32, E, 0x40 + S,  RAW) \
+    F(ec.nom,                        U32, E, 0x44 + S,  RAW) \
+    F(ec.denom,                      U32, E, 0x48 + S,  RAW) \
+    F(auto_bracket_mode,             U32, E, 0x4C + S,  RAW) \
+    F(auto_bracket_ev.nom,           U32, E, 0x50 + S,  RAW) \
+    F(auto_bracket_ev.denom,         U32, E, 0x54 + S,  RAW) \
+    F(auto_bracket_picture_count,    U32, E, 0x58 + S,  RAW) \
+    F(drive_mode,                    U32, E, 0x5C + S,  RAW) \
+    F(fixed_iso,                     U32, E, 0x68 + S,  RAW) \
+    F(auto_iso_min,                  U32, E, 0x6C + S,  RAW) \
+    F(auto_iso_max,                  U32, E, 0x70 + S,  RAW) \
+    F(white_balance_mode,            U32, E, 0x74 + S,  RAW) \
+    F(white_balance_adjust_mg,       U32, E, 0x78 + S,  RAW) /* 0: M7 7: 0 14: G7 */ \
+    F(white_balance_adjust_ba,       U32, E, 0x7C + S,  RAW) /* 0: B7 7: 0 14: A7 */ \
+    F(image_format,                  U32, E, 0x80 + S,  RAW) \
+    F(jpeg_resolution,               U32, E, 0x84 + S,  RAW) \
+    F(jpeg_quality,                  U32, E, 0x88 + S,  STARS) \
+    F(raw_format,                    U32, E, 0x8C + S,  RAW) \
+    F(jpeg_image_tone,               U32, E, 0x90 + S,  RAW) \
+    F(jpeg_saturation,               U32, E, 0x94 + S,  RAW) \
+    F(jpeg_sharpness,                U32, E, 0x98 + S,  RAW) \
+    F(jpeg_contrast,                 U32, E, 0x9C + S,  RAW) \
+    F(color_space,                   U32, E, 0xA0 + S,  RAW) \
+    F(custom_ev_steps,               U32, E, 0xA4 + S,  RAW) \
+    F(custom_sensitivity_steps,      U32, E, 0xa8 + S,  RAW) \
+    F(exposure_mode,                 U32, E, 0xb4 + S,  RAW) \
+    F(scene_mode,                    U32, E, 0xb8 + S,  RAW) \
+    F(ae_metering_mode,              U32, E, 0xbc + S,  RAW) /* same as cc */ \
+    F(af_mode,                       U32, E, 0xC0 + S,  RAW) \
+    F(af_point_select,               U32, E, 0xc4 + S,  RAW) \
+    F(selected_af_point,             U32, E, 0xc8 + S,  RAW) \
+    F(shake_reduction,               U32, E, 0xE0 + S,  RAW) \
+    F(auto_bracket_picture_counter,  U32, E, 0xE4 + S,  RAW) \
+    F(jpeg_hue,                      U32, E, 0xFC + S,  RAW) \
+    F(current_shutter_speed.nom,     U32, E, 0x10C + S, RAW) \
+    F(current_shutter_speed.denom,   U32, E, 0x110 + S, RAW) \
+    F(current_aperture.nom,          U32, E, 0x114 + S, RAW) \
+    F(current_aperture.denom,        U32, E, 0x118 + S, RAW) \
+    F(max_shutter_speed.nom,         U32, E, 0x12C + S, RAW) \
+    F(max_shutter_speed.denom,       U32, E, 0x130 + S, RAW) \
+    F(current_iso,                   U32, E, 0x134 + S, RAW) \
+    F(light_meter_flags,             U32, E, 0x13C + S, RAW) \
+    F(lens_min_aperture.nom,         U32, E, 0x144 + S, RAW) \
+    F(lens_min_aperture.denom,       U32, E, 0x148 + S, RAW) \
+    F(lens_max_aperture.nom,         U32, E, 0x14C + S, RAW) \
+    F(lens_max_aperture.denom,       U32, E, 0x150 + S, RAW) \
+    F(manual_mode_ev,                I32, E, 0x15C + S, RAW) \
+    F(focused_af_point,              U32, E, 0x168 + S, RAW) /* unsure about it, a lot is changing when the camera focuses */ \
+    F(battery_1,                     U32, E, 0x170 + S, RAW) /* probably voltage*100 */ \
+    F(battery_2,                     U32, E, 0x174 + S, RAW) /* battery_1 > battery2 ( noload vs load voltage?) */ \
+    F(battery_3,                     U32, E, 0x180 + S, RAW) \
+    F(battery_4,                     U32, E, 0x184 + S, RAW)
+
+#define STATUS_FIELDS_KX(F, C) \
+    STATUS_FIELDS_COMMON(F, BE, 0) \
+    F(zoom.nom,                      U32, BE, 0x198, RAW) \
+    F(zoom.denom,                    U32, BE, 0x19C, RAW) \
+    F(focus,                         I32, BE, 0x1A0, RAW) \
+    F(lens_id1,                      U32, BE, 0x188, LENS_ID) \
+    F(lens_id2,                      U32, BE, 0x194, RAW)
 
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    status->zoom.nom = get_uint32_be(&buf[0x1A0]);
-    status->zoom.denom = get_uint32_be(&buf[0x1A4]);
-    //    status->focus = get_int32_be(&buf[0x1A8]); // ?
-    status->lens_id1 = (get_uint32_be( &buf[0x190])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x19C]);
-    // cannot read max_shutter_speed from status buffer, hardwire the values here
-    status->max_shutter_speed.nom = 1;
-    status->max_shutter_speed.denom = 6000;
-}
+// Vince: K-r support 2011-06-22
+#define STATUS_FIELDS_KR(F, C) \
+    STATUS_FIELDS_COMMON(F, BE, 0) \
+    F(zoom.nom,                      U32, BE, 0x19C, RAW) \
+    F(zoom.denom,                    U32, BE, 0x1A0, RAW) \
+    F(focus,                         I32, BE, 0x1A4, RAW) \
+    F(lens_id1,                      U32, BE, 0x18C, LENS_ID) \
+    F(lens_id2,                      U32, BE, 0x198, RAW)
 
-void ipslr_status_parse_km(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
-    }
+// TODO: check these fields
+//status.focused = getInt32(statusBuf, 0x164);
+#define STATUS_FIELDS_K5(F, C) \
+    STATUS_FIELDS_COMMON(F, BE, 0) \
+    F(zoom.nom,                      U32, BE, 0x1A0, RAW) \
+    F(zoom.denom,                    U32, BE, 0x1A4, RAW) \
+    F(focus,                         I32, BE, 0x1A8, RAW) /* ? */ \
+    F(lens_id1,                      U32, BE, 0x190, LENS_ID) \
+    F(lens_id2,                      U32, BE, 0x19C, RAW)
+
+// the K-01 status seems to be the same
+#define STATUS_FIELDS_K30(F, C) \
+    STATUS_FIELDS_COMMON(F, BE, 0) \
+    F(zoom.nom,                      U32, BE, 0x1A0, RAW) \
+    C(zoom.denom,                    100) \
+    F(focus,                         I32, BE, 0x1A8, RAW) /* ? */ \
+    F(lens_id1,                      U32, BE, 0x190, LENS_ID) \
+    F(lens_id2,                      U32, BE, 0x19C, RAW)
+
+#define STATUS_FIELDS_K50(F, C) \
+    STATUS_FIELDS_COMMON(F, BE, 0) \
+    F(zoom.nom,                      U32, BE, 0x1A0, RAW) \
+    F(zoom.denom,                    U32, BE, 0x1A4, RAW) \
+    F(lens_id1,                      U32, BE, 0x190, LENS_ID) \
+    F(lens_id2,                      U32, BE, 0x19C, RAW)
+
+// cannot read max_shutter_speed from status buffer, hardwire the values here
+#define STATUS_FIELDS_K500(F, C) \
+    STATUS_FIELDS_K50(F, C) \
+    C(max_shutter_speed.nom,         1) \
+    C(max_shutter_speed.denom,       6000)
 
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, -4);
-    status->zoom.nom = get_uint32_be(&buf[0x180]);
-    status->zoom.denom = get_uint32_be(&buf[0x184]);
-    status->lens_id1 = (get_uint32_be( &buf[0x170])) & 0x0F;
-    status->lens_id2 = get_uint32_be( &buf[0x17c]);
 // TODO
 // status.focused = getInt32(statusBuf, 0x164);
-}
+#define STATUS_FIELDS_KM(F, C) \
+    STATUS_FIELDS_COMMON(F, BE, -4) \
+    F(zoom.nom,                      U32, BE, 0x180, RAW) \
+    F(zoom.denom,                    U32, BE, 0x184, RAW) \
+    F(lens_id1,                      U32, BE, 0x170, LENS_ID) \
+    F(lens_id2,                      U32, BE, 0x17c, RAW)
 
 // K-3 returns data in little-endian
-void ipslr_status_parse_k3(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+#define STATUS_FIELDS_K3(F, C) \
+    STATUS_FIELDS_COMMON(F, LE, 0) \
+    F(bufmask,                       U16, LE, 0x1C,  RAW) \
+    F(zoom.nom,                      U32, LE, 0x1A0, RAW) \
+    F(zoom.denom,                    U32, LE, 0x1A4, RAW) \
+    F(focus,                         I32, LE, 0x1A8, RAW) \
+    F(lens_id1,                      U32, LE, 0x190, LENS_ID) \
+    F(lens_id2,                      U32, LE, 0x19C, RAW)
+
+#define STATUS_FIELDS_KS1(F, C) \
+    STATUS_FIELDS_K3(F, C) \
+    F(bufmask,                       U16, LE, 0x0C,  RAW)
+
+// the common block returns invalid values for some of the fields
+#define STATUS_FIELDS_K1(F, C) \
+    STATUS_FIELDS_COMMON(F, LE, 0) \
+    F(jpeg_hue,                      U32, LE, 0x100, RAW) \
+    F(current_shutter_speed.nom,     U32, LE, 0x110, RAW) \
+    F(current_shutter_speed.denom,   U32, LE, 0x114, RAW) \
+    F(current_aperture.nom,          U32, LE, 0x118, RAW) \
+    F(current_aperture.denom,        U32, LE, 0x11c, RAW) \
+    F(max_shutter_speed.nom,         U32, LE, 0x130, RAW) \
+    F(max_shutter_speed.denom,       U32, LE, 0x134, RAW) \
+    F(current_iso,                   U32, LE, 0x138, RAW) \
+    F(light_meter_flags,             U32, LE, 0x140, RAW) /* ? */ \
+    F(lens_min_aperture.nom,         U32, LE, 0x148, RAW) \
+    F(lens_min_aperture.denom,       U32, LE, 0x14c, RAW) \
+    F(lens_max_aperture.nom,         U32, LE, 0x150, RAW) \
+    F(lens_max_aperture.denom,       U32, LE, 0x154, RAW) \
+    F(manual_mode_ev,                U32, LE, 0x160, RAW) /* ? */ \
+    F(focused_af_point,              U32, LE, 0x16c, RAW) /* ? */ \
+    F(battery_1,                     U32, LE, 0x174, RAW) \
+    F(battery_2,                     U32, LE, 0x178, RAW) \
+    C(selected_af_point,             0) /* selected_af_point is invalid */ \
+    F(bufmask,                       U16, LE, 0x0C,  RAW) \
+    F(zoom.nom,                      U32, LE, 0x1A4, RAW) \
+    F(zoom.denom,                    U32, LE, 0x1A8, RAW) \
+    F(lens_id1,                      U32, LE, 0x194, LENS_ID) \
+    F(lens_id2,                      U32, LE, 0x1A0, RAW)
+
+#define STATUS_FIELDS_K70(F, C) \
+    STATUS_FIELDS_K1(F, C) \
+    F(auto_bracket_picture_counter,  U32, LE, 0xE8,  RAW) \
+    C(battery_3,                     0) \
+    C(battery_4,                     0) \
+    F(shake_reduction,               U32, LE, 0xe4,  RAW)
+
+// Drive mode: 0=Single shot, 1= Continous Hi, 2= Continous Low or Self timer 12s, 3=Self timer 2s
+// 4= remote, 5= remote 3s delay
+#define STATUS_FIELDS_K200D(F, C) \
+    F(bufmask,                       U16, BE, 0x16,  RAW) \
+    F(user_mode_flag,                U32, BE, 0x1c,  RAW) \
+    F(set_shutter_speed.nom,         U32, BE, 0x2c,  RAW) \
+    F(set_shutter_speed.denom,       U32, BE, 0x30,  RAW) \
+    F(current_aperture.nom,          U32, BE, 0x034, RAW) \
+    F(current_aperture.denom,        U32, BE, 0x038, RAW) \
+    F(set_aperture.nom,              U32, BE, 0x34,  RAW) \
+    F(set_aperture.denom,            U32, BE, 0x38,  RAW) \
+    F(ec.nom,                        U32, BE, 0x3c,  RAW) \
+    F(ec.denom,                      U32, BE, 0x40,  RAW) \
+    F(current_iso,                   U32, BE, 0x060, RAW) \
+    F(fixed_iso,                     U32, BE, 0x60,  RAW) \
+    F(auto_iso_min,                  U32, BE, 0x64,  RAW) \
+    F(auto_iso_max,                  U32, BE, 0x68,  RAW) \
+    F(image_format,                  U32, BE, 0x78,  RAW) \
+    F(jpeg_resolution,               U32, BE, 0x7c,  RAW) \
+    F(jpeg_quality,                  U32, BE, 0x80,  STARS) \
+    F(raw_format,                    U32, BE, 0x84,  RAW) \
+    F(jpeg_image_tone,               U32, BE, 0x88,  RAW) \
+    F(jpeg_saturation,               U32, BE, 0x8c,  RAW) \
+    F(jpeg_sharpness,                U32, BE, 0x90,  RAW) \
+    F(jpeg_contrast,                 U32, BE, 0x94,  RAW) \
+    F(exposure_mode,                 U32, BE, 0xac,  RAW) \
+    F(af_mode,                       U32, BE, 0xb8,  RAW) \
+    F(af_point_select,               U32, BE, 0xbc,  RAW) \
+    F(selected_af_point,             U32, BE, 0xc0,  RAW) \
+    F(drive_mode,                    U32, BE, 0xcc,  RAW) \
+    F(shake_reduction,               U32, BE, 0xda,  RAW) \
+    F(jpeg_hue,                      U32, BE, 0xf4,  RAW) \
+    F(current_shutter_speed.nom,     U32, BE, 0x0104, RAW) \
+    F(current_shutter_speed.denom,   U32, BE, 0x108, RAW) \
+    F(light_meter_flags,             U32, BE, 0x124, RAW) \
+    F(lens_min_aperture.nom,         U32, BE, 0x13c, RAW) \
+    F(lens_min_aperture.denom,       U32, BE, 0x140, RAW) \
+    F(lens_max_aperture.nom,         U32, BE, 0x144, RAW) \
+    F(lens_max_aperture.denom,       U32, BE, 0x148, RAW) \
+    F(focused_af_point,              U32, BE, 0x150, RAW) \
+    F(zoom.nom,                      U32, BE, 0x17c, RAW) \
+    F(zoom.denom,                    U32, BE, 0x180, RAW) \
+    F(focus,                         I32, BE, 0x184, RAW)
+
+// the readers are static so that they are inlined also in the -fPIC build
+static inline uint32_t status_read_u16_be(const uint8_t *buf) {
+    return buf[0] << 8 | buf[1];
+}
+
+static inline uint32_t status_read_u16_le(const uint8_t *buf) {
+    return buf[1] << 8 | buf[0];
+}
+
+static inline uint32_t status_read_u32_be(const uint8_t *buf) {
+    return (uint32_t) buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static inline uint32_t status_read_u32_le(const uint8_t *buf) {
+    return (uint32_t) buf[3] << 24 | buf[2] << 16 | buf[1] << 8 | buf[0];
+}
+
+#define STATUS_READ_U16_BE(off) status_read_u16_be(&buf[off])
+#define STATUS_READ_U16_LE(off) status_read_u16_le(&buf[off])
+#define STATUS_READ_U32_BE(off) status_read_u32_be(&buf[off])
+#define STATUS_READ_U32_LE(off) status_read_u32_le(&buf[off])
+#define STATUS_READ_I32_BE(off) (int32_t) status_read_u32_be(&buf[off])
+#define STATUS_READ_I32_LE(off) (int32_t) status_read_u32_le(&buf[off])
+
+#define STATUS_TRANSFORM_RAW(v) (v)
+#define STATUS_TRANSFORM_STARS(v) _get_user_jpeg_stars(p->model, (v))
+#define STATUS_TRANSFORM_LENS_ID(v) ((v) & 0x0F)
+
+#define STATUS_WIDTH_U16 2
+#define STATUS_WIDTH_U32 4
+#define STATUS_WIDTH_I32 4
+#define STATUS_IS_LE_BE false
+#define STATUS_IS_LE_LE true
+
+#define STATUS_PARSE_FIELD(field, type, endian, off, transform) \
+    status->field = STATUS_TRANSFORM_ ## transform(STATUS_READ_ ## type ## _ ## endian(off));
+#define STATUS_PARSE_CONST(field, value) \
+    status->field = (value);
+#define STATUS_DEF_FIELD(field, type, endian, off, transform) \
+    { #field, (off), STATUS_WIDTH_ ## type, STATUS_IS_LE_ ## endian, \
+      offsetof(pslr_status, field), sizeof (((pslr_status *) 0)->field), STATUS_TRANSFORM_ID_ ## transform },
+#define STATUS_DEF_CONST(field, value) \
+    { #field, 0, 0, false, offsetof(pslr_status, field), sizeof (((pslr_status *) 0)->field), STATUS_TRANSFORM_ID_RAW },
+
+#define STATUS_PARSER(name, layout) \
+    static const ipslr_status_field_def_t status_fields_ ## name[] = { \
+        layout(STATUS_DEF_FIELD, STATUS_DEF_CONST) \
+    }; \
+    void ipslr_status_parse_ ## name(ipslr_handle_t *p, pslr_status *status) { \
+        uint8_t *buf = p->status_buffer; \
+        if ( debug ) { \
+            ipslr_status_diff(p, buf, status_fields_ ## name, \
+                              sizeof (status_fields_ ## name) / sizeof (status_fields_ ## name[0])); \
+        } \
+        memset(status, 0, sizeof (*status)); \
+        layout(STATUS_PARSE_FIELD, STATUS_PARSE_CONST) \
     }
 
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    status->bufmask = get_uint16_le( &buf[0x1C]);
-    status->zoom.nom = get_uint32_le(&buf[0x1A0]);
-    status->zoom.denom = get_uint32_le(&buf[0x1A4]);
-    status->focus = get_int32_le(&buf[0x1A8]);
-    status->lens_id1 = (get_uint32_le( &buf[0x190])) & 0x0F;
-    status->lens_id2 = get_uint32_le( &buf[0x19C]);
-}
+STATUS_PARSER(k10d, STATUS_FIELDS_K10D)
+STATUS_PARSER(k20d, STATUS_FIELDS_K20D)
+STATUS_PARSER(istds, STATUS_FIELDS_ISTDS)
+STATUS_PARSER(kx, STATUS_FIELDS_KX)
+STATUS_PARSER(kr, STATUS_FIELDS_KR)
+STATUS_PARSER(k5, STATUS_FIELDS_K5)
+STATUS_PARSER(k30, STATUS_FIELDS_K30)
+STATUS_PARSER(k01, STATUS_FIELDS_K30)
+STATUS_PARSER(k50, STATUS_FIELDS_K50)
+STATUS_PARSER(k500, STATUS_FIELDS_K500)
+STATUS_PARSER(km, STATUS_FIELDS_KM)
+STATUS_PARSER(k3, STATUS_FIELDS_K3)
+STATUS_PARSER(ks1, STATUS_FIELDS_KS1)
+STATUS_PARSER(k1, STATUS_FIELDS_K1)
+STATUS_PARSER(k70, STATUS_FIELDS_K70)
+STATUS_PARSER(k200d, STATUS_FIELDS_K200D)
+
+typedef struct {
+    ipslr_status_parse_t parser;
+    const ipslr_status_field_def_t *fields;
+    int fields_length;
+} ipslr_status_layout_t;
+
+#define STATUS_LAYOUT(name) \
+    { ipslr_status_parse_ ## name, status_fields_ ## name, sizeof (status_fields_ ## name) / sizeof (status_fields_ ## name[0]) }
+
+static const ipslr_status_layout_t status_layouts[] = {
+    STATUS_LAYOUT(k10d),
+    STATUS_LAYOUT(k20d),
+    STATUS_LAYOUT(istds),
+    STATUS_LAYOUT(kx),
+    STATUS_LAYOUT(kr),
+    STATUS_LAYOUT(k5),
+    STATUS_LAYOUT(k30),
+    STATUS_LAYOUT(k01),
+    STATUS_LAYOUT(k50),
+    STATUS_LAYOUT(k500),
+    STATUS_LAYOUT(km),
+    STATUS_LAYOUT(k3),
+    STATUS_LAYOUT(ks1),
+    STATUS_LAYOUT(k1),
+    STATUS_LAYOUT(k70),
+    STATUS_LAYOUT(k200d)
+};
 
-void ipslr_status_parse_ks1(ipslr_handle_t *p, pslr_status *status) {
+static void ipslr_status_field_store(ipslr_handle_t *p, const ipslr_status_field_def_t *def, pslr_status *status) {
     uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
-    }
+    uint8_t *field = (uint8_t *) status + def->status_offset;
+    uint32_t v;
+    uint16_t v16;
 
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-    status->bufmask = get_uint16_le( &buf[0x0C]);
-    status->zoom.nom = get_uint32_le(&buf[0x1A0]);
-    status->zoom.denom = get_uint32_le(&buf[0x1A4]);
-    status->focus = get_int32_le(&buf[0x1A8]);
-    status->lens_id1 = (get_uint32_le( &buf[0x190])) & 0x0F;
-    status->lens_id2 = get_uint32_le( &buf[0x19C]);
+    if (def->width == 2) {
+        v = def->little_endian ? status_read_u16_le(&buf[def->offset]) : status_read_u16_be(&buf[def->offset]);
+    } else {
+        v = def->little_endian ? status_read_u32_le(&buf[def->offset]) : status_read_u32_be(&buf[def->offset]);
+    }
+    if (def->transform == STATUS_TRANSFORM_ID_STARS) {
+        v = _get_user_jpeg_stars(p->model, v);
+    } else if (def->transform == STATUS_TRANSFORM_ID_LENS_ID) {
+        v &= 0x0F;
+    }
+    if (def->status_size == 2) {
+        v16 = v;
+        memcpy(field, &v16, sizeof (v16));
+    } else {
+        memcpy(field, &v, sizeof (v));
+    }
 }
 
+/* Lists the entries of the layout that are not overridden by a later
+   one under every 8 byte word of the status buffer they cover. */
+static void ipslr_status_index(ipslr_handle_t *p, const ipslr_status_layout_t *layout) {
+    bool active[MAX_STATUS_FIELDS];
+    int count = 0;
+    int i, j, w;
 
-void ipslr_status_parse_k1(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+    for (i = 0; i < layout->fields_length && i < MAX_STATUS_FIELDS; i++) {
+        const ipslr_status_field_def_t *def = &layout->fields[i];
+        for (j = i + 1; j < layout->fields_length && layout->fields[j].status_offset != def->status_offset; j++) {
+        }
+        active[i] = j == layout->fields_length && def->width > 0;
     }
-
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-// parse_common returns invalid values for the following fields. Fixing the fields:
-
-    status->jpeg_hue = get_uint32_le(&buf[0x100]);
-    status->current_shutter_speed.nom = get_uint32_le(&buf[0x110]);
-    status->current_shutter_speed.denom = get_uint32_le(&buf[0x114]);
-    status->current_aperture.nom = get_uint32_le(&buf[0x118]);
-    status->current_aperture.denom = get_uint32_le(&buf[0x11c]);
-    status->max_shutter_speed.nom = get_uint32_le(&buf[0x130]);
-    status->max_shutter_speed.denom = get_uint32_le(&buf[0x134]);
-    status->current_iso = get_uint32_le(&buf[0x138]);
-    status->light_meter_flags = get_uint32_le(&buf[0x140]); // ?
-    status->lens_min_aperture.nom = get_uint32_le(&buf[0x148]);
-    status->lens_min_aperture.denom = get_uint32_le(&buf[0x14c]);
-    status->lens_max_aperture.nom = get_uint32_le(&buf[0x150]);
-    status->lens_max_aperture.denom = get_uint32_le(&buf[0x154]);
-    status->manual_mode_ev = get_uint32_le(&buf[0x160]); // ?
-    status->focused_af_point = get_uint32_le(&buf[0x16c]); // ?
-    status->battery_1 = get_uint32_le(&buf[0x174]);
-    status->battery_2 = get_uint32_le(&buf[0x178]);
-
-    // selected_af_point is invalid
-    status->selected_af_point = 0;
-
-    status->bufmask = get_uint16_le( &buf[0x0C]);
-    status->zoom.nom = get_uint32_le(&buf[0x1A4]);
-    status->zoom.denom = get_uint32_le(&buf[0x1A8]);
-//    status->focus = get_int32_le(&buf[0x1A8]);
-    status->lens_id1 = (get_uint32_le( &buf[0x194])) & 0x0F;
-    status->lens_id2 = get_uint32_le( &buf[0x1A0]);
-}
-
-void ipslr_status_parse_k70(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
-    if ( debug ) {
-        ipslr_status_diff(buf);
+    for (w = 0; w < MAX_STATUS_BUF_SIZE / 8; w++) {
+        p->status_word_start[w] = count;
+        for (i = 0; i < layout->fields_length && i < MAX_STATUS_FIELDS; i++) {
+            const ipslr_status_field_def_t *def = &layout->fields[i];
+            if (active[i] && def->offset < 8 * w + 8 && def->offset + def->width > 8 * w) {
+                p->status_word_fields[count++] = i;
+            }
+        }
+    }
+    p->status_word_start[w] = count;
+    p->status_layout = layout;
+}
+
+/* Re-derives the fields of the model's layout whose bytes in
+   p->status_buffer differ from last. The pslr_status offsets of the
+   changed fields go to changed, up to max of them. Returns the number of
+   changed fields, -1 where the parser has no layout table. */
+int ipslr_status_update(ipslr_handle_t *p, pslr_status *status, const uint8_t *last, uint16_t *changed, int max) {
+    const ipslr_status_layout_t *layout = p->status_layout;
+    const uint8_t *buf = p->status_buffer;
+    unsigned int l;
+    uint64_t a, b;
+    int count = 0;
+    int w, i, k;
+
+    if (layout == NULL || layout->parser != p->model->status_parser_function) {
+        for (l = 0; l < sizeof (status_layouts) / sizeof (status_layouts[0]); l++) {
+            if (status_layouts[l].parser == p->model->status_parser_function) {
+                break;
+            }
+        }
+        if (l == sizeof (status_layouts) / sizeof (status_layouts[0])) {
+            return -1;
+        }
+        layout = &status_layouts[l];
+        ipslr_status_index(p, layout);
     }
-
-    memset(status, 0, sizeof (*status));
-    ipslr_status_parse_common( p, status, 0 );
-// parse_common returns invalid values for the following fields. Fixing the fields:
-
-    status->auto_bracket_picture_counter = get_uint32_le(&buf[0xE8]);
-    status->jpeg_hue = get_uint32_le(&buf[0x100]);
-    status->current_shutter_speed.nom = get_uint32_le(&buf[0x110]);
-    status->current_shutter_speed.denom = get_uint32_le(&buf[0x114]);
-    status->current_aperture.nom = get_uint32_le(&buf[0x118]);
-    status->current_aperture.denom = get_uint32_le(&buf[0x11c]);
-    status->max_shutter_speed.nom = get_uint32_le(&buf[0x130]);
-    status->max_shutter_speed.denom = get_uint32_le(&buf[0x134]);
-    status->current_iso = get_uint32_le(&buf[0x138]);
-    status->light_meter_flags = get_uint32_le(&buf[0x140]); // ?
-    status->lens_min_aperture.nom = get_uint32_le(&buf[0x148]);
-    status->lens_min_aperture.denom = get_uint32_le(&buf[0x14c]);
-    status->lens_max_aperture.nom = get_uint32_le(&buf[0x150]);
-    status->lens_max_aperture.denom = get_uint32_le(&buf[0x154]);
-    status->manual_mode_ev = get_uint32_le(&buf[0x160]); // ?
-    status->focused_af_point = get_uint32_le(&buf[0x16c]); // ?
-
-    status->battery_1 = get_uint32_le(&buf[0x174]);
-    status->battery_2 = get_uint32_le(&buf[0x178]);
-    status->battery_3 = 0;
-    status->battery_4 = 0;
-
-    // selected_af_point is invalid
-    status->selected_af_point = 0;
-
-    status->bufmask = get_uint16_le( &buf[0x0C]);
-    status->zoom.nom = get_uint32_le(&buf[0x1A4]);
-    status->zoom.denom = get_uint32_le(&buf[0x1A8]);
-//    status->focus = get_int32_le(&buf[0x1A8]);
-    status->lens_id1 = (get_uint32_le( &buf[0x194])) & 0x0F;
-    status->lens_id2 = get_uint32_le( &buf[0x1A0]);
-    status->shake_reduction = get_uint32_le(&buf[0xe4]);
-}
-
-void ipslr_status_parse_k200d(ipslr_handle_t *p, pslr_status *status) {
-    uint8_t *buf = p->status_buffer;
     if ( debug ) {
-        ipslr_status_diff(buf);
+        ipslr_status_diff(p, p->status_buffer, layout->fields, layout->fields_length);
     }
-
-    memset(status, 0, sizeof (*status));
-    status->bufmask = get_uint16_be(&buf[0x16]);
-    status->user_mode_flag = get_uint32_be(&buf[0x1c]);
-    status->set_shutter_speed.nom = get_uint32_be(&buf[0x2c]);
-    status->set_shutter_speed.denom = get_uint32_be(&buf[0x30]);
-    status->current_aperture.nom = get_uint32_be(&buf[0x034]);
-    status->current_aperture.denom = get_uint32_be(&buf[0x038]);
-    status->set_aperture.nom = get_uint32_be(&buf[0x34]);
-    status->set_aperture.denom = get_uint32_be(&buf[0x38]);
-    status->ec.nom = get_uint32_be(&buf[0x3c]);
-    status->ec.denom = get_uint32_be(&buf[0x40]);
-    status->current_iso = get_uint32_be(&buf[0x060]);
-    status->fixed_iso = get_uint32_be(&buf[0x60]);
-    status->auto_iso_min = get_uint32_be(&buf[0x64]);
-    status->auto_iso_max = get_uint32_be(&buf[0x68]);
-    status->image_format = get_uint32_be(&buf[0x78]);
-    status->jpeg_resolution = get_uint32_be(&buf[0x7c]);
-    status->jpeg_quality = _get_user_jpeg_stars( p->model, get_uint32_be(&buf[0x80]));
-    status->raw_format = get_uint32_be(&buf[0x84]);
-    status->jpeg_image_tone = get_uint32_be(&buf[0x88]);
-    status->jpeg_saturation = get_uint32_be(&buf[0x8c]);
-    status->jpeg_sharpness = get_uint32_be(&buf[0x90]);
-    status->jpeg_contrast = get_uint32_be(&buf[0x94]);
-    //status->custom_ev_steps = get_uint32_be(&buf[0x9c]);
-    //status->custom_sensitivity_steps = get_uint32_be(&buf[0xa0]);
-    status->exposure_mode = get_uint32_be(&buf[0xac]);
-    status->af_mode = get_uint32_be(&buf[0xb8]);
-    status->af_point_select = get_uint32_be(&buf[0xbc]);
-    status->selected_af_point = get_uint32_be(&buf[0xc0]);
-    status->drive_mode = get_uint32_be(&buf[0xcc]);
-    status->shake_reduction = get_uint32_be(&buf[0xda]);
-    status->jpeg_hue = get_uint32_be(&buf[0xf4]);
-    status->current_shutter_speed.nom = get_uint32_be(&buf[0x0104]);
-    status->current_shutter_speed.denom = get_uint32_be(&buf[0x108]);
-    status->light_meter_flags = get_uint32_be(&buf[0x124]);
-    status->lens_min_aperture.nom = get_uint32_be(&buf[0x13c]);
-    status->lens_min_aperture.denom = get_uint32_be(&buf[0x140]);
-    status->lens_max_aperture.nom = get_uint32_be(&buf[0x144]);
-    status->lens_max_aperture.denom = get_uint32_be(&buf[0x148]);
-    status->focused_af_point = get_uint32_be(&buf[0x150]);
-    status->zoom.nom = get_uint32_be(&buf[0x17c]);
-    status->zoom.denom = get_uint32_be(&buf[0x180]);
-    status->focus = get_int32_be(&buf[0x184]);
-    // Drive mode: 0=Single shot, 1= Continous Hi, 2= Continous Low or Self timer 12s, 3=Self timer 2s
-    // 4= remote, 5= remote 3s delay
+    // MAX_STATUS_BUF_SIZE is a multiple of 8, unchanged 64 byte blocks are skipped at once
+    for (w = 0; w < MAX_STATUS_BUF_SIZE / 8; w++) {
+        if (w % 8 == 0 && w + 8 <= MAX_STATUS_BUF_SIZE / 8 && !memcmp(&last[8 * w], &buf[8 * w], 64)) {
+            w += 7;
+            continue;
+        }
+        memcpy(&a, &last[8 * w], 8);
+        memcpy(&b, &buf[8 * w], 8);
+        if (a == b) {
+            continue;
+        }
+        for (i = p->status_word_start[w]; i < p->status_word_start[w + 1]; i++) {
+            const ipslr_status_field_def_t *def = &layout->fields[p->status_word_fields[i]];
+            if (!memcmp(&last[def->offset], &buf[def->offset], def->width)) {
+                continue;
+            }
+            // a field across two words is found in both
+            for (k = 0; k < count && k < max && changed[k] != def->status_offset; k++) {
+            }
+            if (k < count && k < max) {
+                continue;
+            }
+            ipslr_status_field_store(p, def, status);
+            if (count < max) {
+                changed[count] = def->status_offset;
+            }
+            count++;
+        }
+    }
+    return count;
 }
 
 pslr_setting_def_t *find_setting_by_name (pslr_setting_def_t *array, int array_length, char *name) {
@@ -832,3 +899,13 @@ ipslr_model_info_t *find_model_by_id( uint32_t id ) {
     //    DPRINT("not found\n");
     return NULL;
 }
+
+ipslr_model_info_t *find_model_by_name( const char *name ) {
+    int i;
+    for ( i = 0; i<sizeof (camera_models) / sizeof (camera_models[0]); i++) {
+        if ( strlen(camera_models[i].name) == strlen(name) && str_comparison_i( camera_models[i].name, name, strlen(name) ) == 0 ) {
+            return &camera_models[i];
+        }
+    }
+    return NULL;
+}
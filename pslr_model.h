@@ -35,13 +35,18 @@
 #ifndef PSLR_MODEL_H
 #define PSLR_MODEL_H
 
+#include <sys/time.h>
+#include <pthread.h>
+
 #include "pslr_enum.h"
 #include "pslr_scsi.h"
 
 #define MAX_RESOLUTION_SIZE 4
 #define MAX_STATUS_BUF_SIZE 456
+#define MAX_STATUS_FIELDS 128
 #define SETTINGS_BUFFER_SIZE 1024
 #define MAX_SEGMENTS 4
+#define POLL_STATS_SIZE 64
 
 typedef struct ipslr_handle ipslr_handle_t;
 
@@ -107,6 +112,25 @@ typedef struct {
     uint32_t battery_4;
 } pslr_status;
 
+/* groups of pslr_status fields reported by the status change events */
+typedef enum {
+    PSLR_STATUS_CHANGE_BUFMASK       = 1 << 0,
+    PSLR_STATUS_CHANGE_ISO           = 1 << 1,
+    PSLR_STATUS_CHANGE_SHUTTER_SPEED = 1 << 2,
+    PSLR_STATUS_CHANGE_APERTURE      = 1 << 3,
+    PSLR_STATUS_CHANGE_EXPOSURE      = 1 << 4,
+    PSLR_STATUS_CHANGE_BRACKETING    = 1 << 5,
+    PSLR_STATUS_CHANGE_IMAGE_FORMAT  = 1 << 6,
+    PSLR_STATUS_CHANGE_FOCUS         = 1 << 7,
+    PSLR_STATUS_CHANGE_DRIVE         = 1 << 8,
+    PSLR_STATUS_CHANGE_WHITE_BALANCE = 1 << 9,
+    PSLR_STATUS_CHANGE_FLASH         = 1 << 10,
+    PSLR_STATUS_CHANGE_LENS          = 1 << 11,
+    PSLR_STATUS_CHANGE_BATTERY       = 1 << 12,
+    PSLR_STATUS_CHANGE_OTHER         = 1 << 13,
+    PSLR_STATUS_CHANGE_ALL           = (1 << 14) - 1
+} pslr_status_change_t;
+
 typedef enum {
     PSLR_SETTING_STATUS_READ,
     PSLR_SETTING_STATUS_HARDWIRED,
@@ -137,11 +161,39 @@ typedef struct {
     int length;
 } pslr_setting_def_t;
 
+typedef struct {
+    bool full_scan;   // all SETTINGS_BUFFER_SIZE offsets were read
+    uint32_t reads;   // number of setting read round trips
+    uint32_t usec;    // duration of the read
+} pslr_settings_stats_t;
+
+typedef struct {
+    uint32_t count;      // number of full shutter presses
+    uint32_t last_usec;  // API call until the camera accepted the command
+    uint32_t min_usec;
+    uint32_t max_usec;
+    uint32_t avg_usec;
+    uint64_t total_usec;
+} pslr_shutter_stats_t;
+
+typedef struct {
+    uint32_t hits;           // full status requests answered from the cache
+    uint32_t misses;         // full status transfers
+    uint32_t invalidations;  // commands that dropped a valid cache
+    uint32_t coalesced;      // requests answered from the transfer running when they came in
+} pslr_status_cache_stats_t;
+
 typedef void (*ipslr_status_parse_t)(ipslr_handle_t *p, pslr_status *status);
+int ipslr_status_update(ipslr_handle_t *p, pslr_status *status, const uint8_t *last, uint16_t *changed, int max);
 typedef void (*ipslr_settings_parse_t)(ipslr_handle_t *p, pslr_settings *settings);
 void ipslr_settings_parser_generic(ipslr_handle_t *p, pslr_settings *settings);
 pslr_setting_def_t *find_setting_by_name (pslr_setting_def_t *array, int array_length, char *name);
 
+typedef struct {
+    uint32_t next_segment_delay;                     // us to wait after next segment before polling its status
+    uint32_t segment_info_retry_delay;               // first us to wait while the segment info is not ready
+} ipslr_model_timing_t;
+
 typedef struct {
     uint32_t id;                                     // Pentax model ID
     const char *name;                                // name
@@ -165,6 +217,7 @@ typedef struct {
     pslr_setting_def_t *setting_defs;
     int setting_defs_length;
     ipslr_settings_parse_t settings_parser_function; // parse function for setting buffer
+    ipslr_model_timing_t *timing;                    // NULL: the 100 ms steps of the original code
 } ipslr_model_info_t;
 
 typedef struct {
@@ -173,8 +226,43 @@ typedef struct {
     uint32_t length;
 } ipslr_segment_t;
 
+typedef struct {
+    uint32_t current;             // bytes downloaded
+    uint32_t total;               // bytes to download
+    uint32_t block_size;          // bytes per download block
+    uint32_t transactions;        // SCSI transactions so far
+    double mb_per_sec;            // raw transfer rate
+    double transactions_per_mb;
+} pslr_download_stats_t;
+
+typedef struct {
+    uint16_t command;    // a << 8 | b
+    uint32_t count;      // number of completed commands
+    uint32_t polls;      // number of status reads
+    uint32_t avg_usec;   // learned completion latency
+    uint32_t max_usec;
+    uint64_t total_usec;
+} pslr_poll_stats_t;
+
+#define ASYNC_PENDING_MAX 4
+
+#define TRACE_SIZE 4096
+#define TRACE_WRITE 0x01  // data to the camera
+#define TRACE_QUEUED 0x02 // submitted through the queue
+
+typedef struct {
+    uint64_t start;      // us since the epoch
+    uint32_t duration;   // us, 0 while a queued command is pending
+    uint32_t length;     // data bytes requested
+    int32_t result;      // transport return value
+    uint8_t cdb[8];
+    uint8_t flags;       // TRACE_*
+} ipslr_trace_entry_t;
+
 struct ipslr_handle {
+    pthread_mutex_t lock; /* recursive, held by the public API calls */
     FDTYPE fd;
+    pslr_transport_t *transport;
     pslr_status status;
     pslr_settings settings;
     uint32_t id;
@@ -184,9 +272,65 @@ struct ipslr_handle {
     uint32_t offset;
     uint8_t status_buffer[MAX_STATUS_BUF_SIZE];
     uint8_t settings_buffer[SETTINGS_BUFFER_SIZE];
+    pslr_settings_stats_t settings_stats;
+    pslr_poll_stats_t poll_stats[POLL_STATS_SIZE];
+    int poll_stats_count;
+    uint16_t last_command;
+    bool command_pending;
+    struct timeval command_time;
+    uint32_t transactions;
+    uint32_t block_size;
+    bool block_size_probe;        // larger blocks are tried only on request
+    bool block_size_probed;
+    pslr_download_stats_t download_stats;
+    struct timeval download_start;
+    uint32_t download_transactions_start;
+    void (*progress_callback)(uint32_t current, uint32_t total);
+    void (*download_progress_callback)(pslr_download_stats_t *stats, uintptr_t user_data);
+    uintptr_t download_progress_user_data;
+    uint8_t status_diff_buffer[MAX_STATUS_BUF_SIZE];
+    bool status_diff_init;
+    char unknown_name[32];
+    bool fast_shutter;
+    pslr_shutter_stats_t shutter_stats;
+    uint32_t status_cache_ttl;    // usec, 0 disables the cache
+    bool status_cache_valid;
+    struct timeval status_cache_time;
+    pslr_status_cache_stats_t status_cache_stats;
+    pthread_mutex_t status_lock;  // guards status_reading and status_reads, taken without lock
+    bool status_reading;          // a full status transfer into p->status is running
+    uint32_t status_reads;        // full status transfers into p->status so far
+    uint8_t status_last_buffer[MAX_STATUS_BUF_SIZE]; // raw buffer of p->status
+    const void *status_layout;    // layout table status_word_fields is built for
+    // entries of the layout that are not overridden, by 8 byte status buffer word
+    uint8_t status_word_fields[2 * MAX_STATUS_FIELDS];
+    uint16_t status_word_start[MAX_STATUS_BUF_SIZE / 8 + 1];
+    uint32_t status_last_length;
+    uint32_t status_changes;      // accumulated since pslr_get_status_changes
+    uint32_t status_change_mask;
+    void (*status_change_callback)(void *h, uint32_t changes, const pslr_status *old_status,
+                                   const pslr_status *new_status, uintptr_t user_data);
+    uintptr_t status_change_user_data;
+    bool async;                   // commands are queued, pslr_set_queued_commands
+    int async_pack_id;
+    int async_pending[ASYNC_PENDING_MAX]; // submitted, not completed yet
+    uint32_t async_trace[ASYNC_PENDING_MAX]; // trace entries of async_pending
+    int async_pending_count;
+    bool download_prepared;       // the camera got the download request below
+    uint32_t download_prepared_addr;
+    uint32_t download_prepared_length;
+    uint8_t *map;                 // mapped reserved buffer of the transport
+    uint32_t map_size;
+    uint32_t map_length;          // bytes of the last block read into map
+    bool map_download;
+    ipslr_trace_entry_t trace[TRACE_SIZE]; // last transactions, always recorded
+    uint32_t trace_count;
+    char *trace_file;             // dumped on errors and slow transactions
+    uint64_t trace_dump_usec;
 };
 
 ipslr_model_info_t *find_model_by_id( uint32_t id );
+ipslr_model_info_t *find_model_by_name( const char *name );
 
 int get_hw_jpeg_quality( ipslr_model_info_t *model, int user_jpeg_stars);
 
@@ -202,6 +346,6 @@ typedef int32_t (*get_int32_func)(uint8_t *buf);
 char *shexdump(uint8_t *buf, uint32_t bufLen);
 void hexdump(uint8_t *buf, uint32_t bufLen);
 void hexdump_debug(uint8_t *buf, uint32_t bufLen);
-const char* int_to_binary( uint16_t x );
+const char* int_to_binary( uint16_t x, char *b );
 
 #endif
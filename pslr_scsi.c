@@ -24,6 +24,37 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "pslr_scsi.h"
+
+/* Up to 32 bytes in one DPRINT, the platform layers used to pass every
+   byte through the varargs write_debug */
+static void print_scsi_bytes(const char *direction, const uint8_t *buf, uint32_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    const char *wrap = "\n\t\t\t\t\t      ";
+    char line[256];
+    char *s = line;
+    uint32_t i;
+
+    if (!debug) {
+        return;
+    }
+    for (i = 0; i < len && i < 32; ++i) {
+        if (i > 0) {
+            *s++ = ' ';
+            if (i % 16 == 0) {
+                strcpy(s, wrap);
+                s += strlen(wrap);
+            } else if ((i%4) == 0 ) {
+                *s++ = ' ';
+            }
+        }
+        *s++ = hex[buf[i] >> 4];
+        *s++ = hex[buf[i] & 0x0f];
+    }
+    *s = '\0';
+    DPRINT("[S]\t\t\t\t\t %s [%s]\n", direction, line);
+}
+
 #ifdef WIN32
 #include "pslr_scsi_win.c"
 #else
@@ -34,3 +65,15 @@
 #include "pslr_scsi_linux.c"
 #endif
 #endif
+
+pslr_transport_t pslr_scsi_transport = {
+    "scsi",
+    scsi_read,
+    scsi_write,
+    get_drive_info,
+    close_drive,
+    scsi_async_open,
+    scsi_submit,
+    scsi_complete,
+    scsi_map_reserved
+};
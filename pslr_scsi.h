@@ -75,9 +75,63 @@ int scsi_write(FDTYPE sg_fd, uint8_t *cmd, uint32_t cmdLen,
 
 char **get_drives(int *driveNum);
 
+/* Like get_drives, but only the drives whose vendor and model pass match.
+   Where the platform can read them without opening the drive (Linux sysfs)
+   the others are never opened; elsewhere every drive is returned. */
+typedef bool (*drive_match_t)(const char *vendorId, const char *productId);
+char **get_drives_matching(int *driveNum, drive_match_t match);
+
 pslr_result get_drive_info(char* driveName, FDTYPE* hDevice,
                            char* vendorId, int vendorIdSizeMax,
                            char* productId, int productIdSizeMax);
 
 void close_drive(FDTYPE *hDevice);
+
+/* Queued commands (Linux SG v3 write()/read() interface). scsi_async_open
+   returns false where the descriptor cannot queue, then only the blocking
+   calls above work. scsi_submit queues a transfer tagged with pack_id and
+   returns at once; scsi_complete waits for that command and returns the
+   bytes read (0 for writes) or a negative pslr_result. */
+bool scsi_async_open(FDTYPE sg_fd);
+int scsi_submit(FDTYPE sg_fd, int pack_id, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                uint8_t *buf, uint32_t bufLen);
+int scsi_complete(FDTYPE sg_fd, int pack_id);
+
+/* Maps the reserved buffer of the descriptor, sized up to *size, and sets
+   *size to the mapped length. Reads with a NULL buffer (scsi_read,
+   scsi_submit) then land there without a copy. Other commands may borrow
+   the buffer while it is idle, so the data is only valid until the next
+   command. NULL where this is not supported. */
+uint8_t *scsi_map_reserved(FDTYPE sg_fd, uint32_t *size);
+
+/* Kernel hotplug events. hotplug_open returns a descriptor, -1 where they
+   are not supported. hotplug_wait accepts any descriptor delivering
+   uevent datagrams, it returns 1 when a SCSI disk or generic device was
+   added, 0 after timeout_ms (-1: no timeout) and -1 on error. */
+int hotplug_open(void);
+int hotplug_wait(int fd, int timeout_ms);
+void hotplug_close(int fd);
+
+/* A transport moves the 8 byte Pentax CDBs to a camera. The default one
+   is the platform SCSI layer above, others (e.g. the virtual camera) can
+   be plugged in per handle. */
+typedef struct {
+    const char *name;
+    int (*read)(FDTYPE sg_fd, uint8_t *cmd, uint32_t cmdLen,
+                uint8_t *buf, uint32_t bufLen);
+    int (*write)(FDTYPE sg_fd, uint8_t *cmd, uint32_t cmdLen,
+                 uint8_t *buf, uint32_t bufLen);
+    pslr_result (*get_drive_info)(char* driveName, FDTYPE* hDevice,
+                                  char* vendorId, int vendorIdSizeMax,
+                                  char* productId, int productIdSizeMax);
+    void (*close_drive)(FDTYPE *hDevice);
+    /* optional, NULL where only the blocking calls exist */
+    bool (*async_open)(FDTYPE sg_fd);
+    int (*submit)(FDTYPE sg_fd, int pack_id, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                  uint8_t *buf, uint32_t bufLen);
+    int (*complete)(FDTYPE sg_fd, int pack_id);
+    uint8_t *(*map_reserved)(FDTYPE sg_fd, uint32_t *size);
+} pslr_transport_t;
+
+extern pslr_transport_t pslr_scsi_transport;
 #endif
@@ -36,6 +36,14 @@
 #endif
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <linux/netlink.h>
 #include "pslr_model.h"
 
 #include "pslr_scsi.h"
@@ -64,23 +72,99 @@ void print_scsi_error(sg_io_hdr_t *pIo, uint8_t *sense_buffer) {
     }
 }
 
-const char* device_dirs[2] = {"/sys/class/scsi_generic", "/sys/block"};
+#ifndef PSLR_SYSFS
+#define PSLR_SYSFS "/sys"
+#endif
+#ifndef PSLR_DEV
+#define PSLR_DEV "/dev"
+#endif
+
+const char* device_dirs[2] = {PSLR_SYSFS "/class/scsi_generic", PSLR_SYSFS "/block"};
+
+/* vendor and model of every sysfs entry seen by get_drives_matching, sorted
+   by (dir, name). An entry is reused while its sysfs node stays the same,
+   a replugged device gets a new inode. */
+typedef struct {
+    int dir;
+    ino_t ino;
+    char *name;
+    char vendorId[20];
+    char productId[20];
+} drive_entry_t;
+
+static drive_entry_t *drive_cache = NULL;
+static int drive_cache_num = 0;
+static pthread_mutex_t drive_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int drive_entry_compare(const void *a, const void *b) {
+    const drive_entry_t *x = a;
+    const drive_entry_t *y = b;
+    if (x->dir != y->dir) {
+        return x->dir - y->dir;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int read_sysfs_attribute(const char *dir, const char *driveName, const char *attribute,
+                                char *buf, int size) {
+    char nmbuf[256];
+    int fd;
+    int length;
+
+    buf[0] = '\0';
+    snprintf(nmbuf, sizeof (nmbuf), "%s/%s/device/%s", dir, driveName, attribute);
+    fd = open(nmbuf, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    length = read(fd, buf, size-1);
+    close(fd);
+    if (length < 0) {
+        return -1;
+    }
+    buf[length] = '\0';
+    return length;
+}
+
+static bool has_sysfs_device(const char *dir, const char *driveName) {
+    char nmbuf[256];
+    struct stat st;
+
+    snprintf(nmbuf, sizeof (nmbuf), "%s/%s/device", dir, driveName);
+    return lstat(nmbuf, &st) == 0;
+}
+
+static int read_drive_attribute(const char *driveName, const char *attribute, char *buf, int size) {
+    int di;
+    for (di=0; di<sizeof(device_dirs)/sizeof(device_dirs[0]); ++di) {
+        if (read_sysfs_attribute(device_dirs[di], driveName, attribute, buf, size) != -1) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void drive_list_add(char ***list, int *num, int *size, const char *name) {
+    if (*num == *size) {
+        *size = *size ? *size * 2 : 16;
+        *list = realloc(*list, *size * sizeof(char*));
+    }
+    (*list)[(*num)++] = strdup(name);
+}
 
 char **get_drives(int *driveNum) {
     DIR *d;
     struct dirent *ent;
-    char *tmp[256];
     char **ret=NULL;
-    int j=0,jj;
+    int j=0;
+    int size=0;
     int di;
     for (di=0; di<sizeof(device_dirs)/sizeof(device_dirs[0]); ++di) {
         d = opendir(device_dirs[di]);
         if (d) {
             while ( (ent = readdir(d)) ) {
                 if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-                    tmp[j] = malloc( strlen(ent->d_name)+1 );
-                    strncpy(tmp[j], ent->d_name, strlen(ent->d_name)+1);
-                    ++j;
+                    drive_list_add(&ret, &j, &size, ent->d_name);
                 }
             }
             closedir(d);
@@ -89,14 +173,80 @@ char **get_drives(int *driveNum) {
         }
     }
     *driveNum = j;
-    if (j>0) {
-        ret = malloc( j * sizeof(char*) );
-        for ( jj=0; jj<j; ++jj ) {
-            ret[jj] = malloc( strlen(tmp[jj])+1 );
-            strncpy( ret[jj], tmp[jj], strlen(tmp[jj]) );
-            ret[jj][strlen(tmp[jj])]='\0';
+    return ret;
+}
+
+char **get_drives_matching(int *driveNum, drive_match_t match) {
+    DIR *d;
+    struct dirent *ent;
+    drive_entry_t *entries = NULL;
+    drive_entry_t *cached;
+    int num = 0;
+    int size = 0;
+    char **ret = NULL;
+    int j = 0;
+    int ret_size = 0;
+    int di;
+    int i;
+
+    pthread_mutex_lock(&drive_cache_lock);
+    for (di=0; di<sizeof(device_dirs)/sizeof(device_dirs[0]); ++di) {
+        d = opendir(device_dirs[di]);
+        if (!d) {
+            DPRINT("Cannot open %s\n", device_dirs[di]);
+            continue;
+        }
+        while ( (ent = readdir(d)) ) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            if (num == size) {
+                size = size ? size * 2 : 64;
+                entries = realloc(entries, size * sizeof(drive_entry_t));
+            }
+            drive_entry_t *e = &entries[num++];
+            e->dir = di;
+            e->ino = ent->d_ino;
+            e->name = ent->d_name;
+            cached = drive_cache_num ? bsearch(e, drive_cache, drive_cache_num, sizeof(drive_entry_t), drive_entry_compare) : NULL;
+            e->name = strdup(ent->d_name);
+            if (cached && cached->ino == e->ino) {
+                memcpy(e->vendorId, cached->vendorId, sizeof(e->vendorId));
+                memcpy(e->productId, cached->productId, sizeof(e->productId));
+            } else if (read_sysfs_attribute(device_dirs[di], e->name, "vendor", e->vendorId, sizeof(e->vendorId)) == -1
+                       || read_sysfs_attribute(device_dirs[di], e->name, "model", e->productId, sizeof(e->productId)) == -1) {
+                if (has_sysfs_device(device_dirs[di], e->name)) {
+                    // not readable (yet), leave it out so the next call retries
+                    DPRINT("Cannot read vendor/model of %s\n", e->name);
+                    free(e->name);
+                    --num;
+                    continue;
+                }
+                // loop, nvme, etc.: no SCSI device behind, remember that too
+                e->vendorId[0] = '\0';
+                e->productId[0] = '\0';
+            }
+        }
+        closedir(d);
+    }
+    if (num > 0) {
+        qsort(entries, num, sizeof(drive_entry_t), drive_entry_compare);
+    }
+    for (i=0; i<drive_cache_num; ++i) {
+        free(drive_cache[i].name);
+    }
+    free(drive_cache);
+    drive_cache = entries;
+    drive_cache_num = num;
+
+    for (i=0; i<num; ++i) {
+        if (entries[i].vendorId[0] != '\0' && match(entries[i].vendorId, entries[i].productId)) {
+            drive_list_add(&ret, &j, &ret_size, entries[i].name);
         }
     }
+    pthread_mutex_unlock(&drive_cache_lock);
+    DPRINT("%d of %d drives match\n", j, num);
+    *driveNum = j;
     return ret;
 }
 
@@ -104,40 +254,18 @@ pslr_result get_drive_info(char* driveName, int* hDevice,
                            char* vendorId, int vendorIdSizeMax,
                            char* productId, int productIdSizeMax) {
     char nmbuf[256];
-    int fd;
 
     vendorId[0] = '\0';
     productId[0] = '\0';
-    snprintf(nmbuf, sizeof (nmbuf), "/sys/class/scsi_generic/%s/device/vendor", driveName);
-    fd = open(nmbuf, O_RDONLY);
-    if (fd == -1) {
-        snprintf(nmbuf, sizeof (nmbuf), "/sys/block/%s/device/vendor", driveName);
-        fd = open(nmbuf, O_RDONLY);
-        if (fd == -1) {
-            return PSLR_DEVICE_ERROR;
-        }
-    }
-    int v_length = read(fd, vendorId, vendorIdSizeMax-1);
-    vendorId[v_length]='\0';
-    close(fd);
-
-    snprintf(nmbuf, sizeof (nmbuf), "/sys/class/scsi_generic/%s/device/model", driveName);
-    fd = open(nmbuf, O_RDONLY);
-    if (fd == -1) {
-        snprintf(nmbuf, sizeof (nmbuf), "/sys/block/%s/device/model", driveName);
-        fd = open(nmbuf, O_RDONLY);
-        if (fd == -1) {
-            return PSLR_DEVICE_ERROR;
-        }
+    if (read_drive_attribute(driveName, "vendor", vendorId, vendorIdSizeMax) == -1
+            || read_drive_attribute(driveName, "model", productId, productIdSizeMax) == -1) {
+        return PSLR_DEVICE_ERROR;
     }
-    int p_length = read(fd, productId, productIdSizeMax-1);
-    productId[p_length]='\0';
-    close(fd);
 
-    snprintf(nmbuf, sizeof (nmbuf), "/dev/%s", driveName);
+    snprintf(nmbuf, sizeof (nmbuf), PSLR_DEV "/%s", driveName);
     *hDevice = open(nmbuf, O_RDWR);
     if ( *hDevice == -1) {
-        snprintf(nmbuf, sizeof (nmbuf), "/dev/block/%s", driveName);
+        snprintf(nmbuf, sizeof (nmbuf), PSLR_DEV "/block/%s", driveName);
         *hDevice = open(nmbuf, O_RDWR);
         if ( *hDevice == -1 ) {
             return PSLR_DEVICE_ERROR;
@@ -146,16 +274,240 @@ pslr_result get_drive_info(char* driveName, int* hDevice,
     return PSLR_OK;
 }
 
+#ifndef SCSI_GENERIC_MAJOR
+#define SCSI_GENERIC_MAJOR 21
+#endif
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 4 /* missing from the glibc copy of sg.h */
+#endif
+
+#define SCSI_TIMEOUT 20000 /* 20000 millisecs == 20 seconds */
+#define SCSI_ASYNC_MAX 16
+#define SCSI_MAP_MAX 4
+
+/* A command queued with scsi_submit. The kernel copies the sense data
+   (and the data of a read) at read() time, into the buffers given to
+   write(), so they live here until scsi_complete. */
+typedef struct {
+    int fd;
+    int pack_id;
+    bool used;
+    bool toDevice;
+    uint32_t bufLen;
+    uint8_t sense[32];
+} scsi_async_t;
+
+static scsi_async_t scsi_async[SCSI_ASYNC_MAX];
+static pthread_mutex_t scsi_async_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* reserved buffers mapped by scsi_map_reserved, unmapped by close_drive */
+typedef struct {
+    int fd;
+    uint8_t *map;
+    uint32_t size;
+} scsi_map_t;
+
+static scsi_map_t scsi_maps[SCSI_MAP_MAX];
+
+static scsi_async_t *scsi_async_find(int sg_fd, int pack_id) {
+    int i;
+    for (i = 0; i < SCSI_ASYNC_MAX; ++i) {
+        if (scsi_async[i].used && scsi_async[i].fd == sg_fd && scsi_async[i].pack_id == pack_id) {
+            return &scsi_async[i];
+        }
+    }
+    return NULL;
+}
+
+static scsi_async_t *scsi_async_alloc(int sg_fd, int pack_id) {
+    int i;
+    for (i = 0; i < SCSI_ASYNC_MAX; ++i) {
+        if (!scsi_async[i].used) {
+            scsi_async[i].used = true;
+            scsi_async[i].fd = sg_fd;
+            scsi_async[i].pack_id = pack_id;
+            return &scsi_async[i];
+        }
+    }
+    return NULL;
+}
+
+static void scsi_async_release(scsi_async_t *a) {
+    pthread_mutex_lock(&scsi_async_lock);
+    a->used = false;
+    pthread_mutex_unlock(&scsi_async_lock);
+}
+
 void close_drive(int *hDevice) {
+    int i;
+    pthread_mutex_lock(&scsi_async_lock);
+    for (i = 0; i < SCSI_ASYNC_MAX; ++i) {
+        if (scsi_async[i].used && scsi_async[i].fd == *hDevice) {
+            scsi_async[i].used = false;
+        }
+    }
+    for (i = 0; i < SCSI_MAP_MAX; ++i) {
+        if (scsi_maps[i].map && scsi_maps[i].fd == *hDevice) {
+            munmap(scsi_maps[i].map, scsi_maps[i].size);
+            scsi_maps[i].map = NULL;
+        }
+    }
+    pthread_mutex_unlock(&scsi_async_lock);
     close( *hDevice );
 }
 
+/* Queued and mmap-ed IO are sg features, a write() or mmap() of a disk node
+   would reach the disk */
+static bool scsi_is_sg(int sg_fd) {
+    struct stat st;
+    return fstat(sg_fd, &st) == 0 && S_ISCHR(st.st_mode) && major(st.st_rdev) == SCSI_GENERIC_MAJOR;
+}
+
+bool scsi_async_open(int sg_fd) {
+    int version = 0;
+    int one = 1;
+
+    if (!scsi_is_sg(sg_fd)) {
+        return false;
+    }
+    if (ioctl(sg_fd, SG_GET_VERSION_NUM, &version) == -1 || version < 30000) {
+        return false;
+    }
+    // read() returns the command asked for by pack_id, not the oldest one
+    if (ioctl(sg_fd, SG_SET_FORCE_PACK_ID, &one) == -1 || ioctl(sg_fd, SG_SET_COMMAND_Q, &one) == -1) {
+        return false;
+    }
+    DPRINT("sg version %d, queued commands enabled\n", version);
+    return true;
+}
+
+uint8_t *scsi_map_reserved(int sg_fd, uint32_t *size) {
+    int reserved = *size;
+    long page = sysconf(_SC_PAGESIZE);
+    uint8_t *map;
+    int i;
+
+    if (!scsi_is_sg(sg_fd)) {
+        return NULL;
+    }
+    // the kernel caps the size at the max transfer of the host adapter
+    if (ioctl(sg_fd, SG_SET_RESERVED_SIZE, &reserved) == -1 || ioctl(sg_fd, SG_GET_RESERVED_SIZE, &reserved) == -1) {
+        return NULL;
+    }
+    reserved -= reserved % page;
+    if (reserved <= 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&scsi_async_lock);
+    for (i = 0; i < SCSI_MAP_MAX && scsi_maps[i].map; ++i) {
+    }
+    if (i == SCSI_MAP_MAX) {
+        pthread_mutex_unlock(&scsi_async_lock);
+        return NULL;
+    }
+    map = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_SHARED, sg_fd, 0);
+    if (map == MAP_FAILED) {
+        pthread_mutex_unlock(&scsi_async_lock);
+        perror("mmap");
+        return NULL;
+    }
+    scsi_maps[i].fd = sg_fd;
+    scsi_maps[i].map = map;
+    scsi_maps[i].size = reserved;
+    pthread_mutex_unlock(&scsi_async_lock);
+    DPRINT("sg reserved buffer of %d bytes mapped\n", reserved);
+    *size = reserved;
+    return map;
+}
+
+int scsi_submit(int sg_fd, int pack_id, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                uint8_t *buf, uint32_t bufLen) {
+    sg_io_hdr_t io;
+    scsi_async_t *a;
+
+    pthread_mutex_lock(&scsi_async_lock);
+    a = scsi_async_alloc(sg_fd, pack_id);
+    pthread_mutex_unlock(&scsi_async_lock);
+    if (!a) {
+        DPRINT("Too many queued SCSI commands\n");
+        return PSLR_DEVICE_ERROR;
+    }
+    a->toDevice = toDevice;
+    a->bufLen = bufLen;
+
+    memset(&io, 0, sizeof (io));
+    io.interface_id = 'S';
+    io.cmd_len = cmdLen;
+    io.mx_sb_len = sizeof (a->sense);
+    io.dxfer_direction = bufLen == 0 ? SG_DXFER_NONE : toDevice ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+    io.dxfer_len = bufLen;
+    io.dxferp = buf;
+    io.cmdp = cmd;
+    io.sbp = a->sense;
+    io.timeout = SCSI_TIMEOUT;
+    io.pack_id = pack_id;
+    if (buf == NULL && bufLen > 0) {
+        io.flags = SG_FLAG_MMAP_IO;
+    }
+
+    print_scsi_bytes(">>>", cmd, cmdLen);
+    if (write(sg_fd, &io, sizeof (io)) != sizeof (io)) {
+        perror("write");
+        scsi_async_release(a);
+        return PSLR_DEVICE_ERROR;
+    }
+    return PSLR_OK;
+}
+
+int scsi_complete(int sg_fd, int pack_id) {
+    sg_io_hdr_t io;
+    scsi_async_t *a;
+    struct pollfd pfd;
+    int r;
+
+    pthread_mutex_lock(&scsi_async_lock);
+    a = scsi_async_find(sg_fd, pack_id);
+    pthread_mutex_unlock(&scsi_async_lock);
+    if (!a) {
+        return -PSLR_PARAM;
+    }
+
+    // the kernel aborts the command after SCSI_TIMEOUT, do not wait forever on a dead port
+    pfd.fd = sg_fd;
+    pfd.events = POLLIN;
+    do {
+        r = poll(&pfd, 1, 2 * SCSI_TIMEOUT);
+    } while (r == -1 && errno == EINTR);
+    if (r <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0) {
+        DPRINT("SCSI command %d did not complete\n", pack_id);
+        return -PSLR_DEVICE_ERROR;
+    }
+
+    memset(&io, 0, sizeof (io));
+    io.interface_id = 'S';
+    io.pack_id = pack_id;
+    r = read(sg_fd, &io, sizeof (io));
+    if (r == -1) {
+        perror("read");
+        r = -PSLR_DEVICE_ERROR;
+    } else if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+        print_scsi_error(&io, a->sense);
+        r = -PSLR_SCSI_ERROR;
+    } else if (a->toDevice) {
+        r = 0;
+    } else {
+        // same special case as in scsi_read
+        r = io.resid == a->bufLen ? a->bufLen : a->bufLen - io.resid;
+    }
+    scsi_async_release(a);
+    return r;
+}
+
 int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
               uint8_t *buf, uint32_t bufLen) {
     sg_io_hdr_t io;
     uint8_t sense[32];
     int r;
-    int i;
 
     memset(&io, 0, sizeof (io));
 
@@ -168,22 +520,16 @@ int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     io.dxferp = buf;
     io.cmdp = cmd;
     io.sbp = sense;
-    io.timeout = 20000; /* 20000 millisecs == 20 seconds */
+    io.timeout = SCSI_TIMEOUT;
     /* io.flags = 0; */ /* take defaults: indirect IO, etc */
     /* io.pack_id = 0; */
     /* io.usr_ptr = NULL; */
-
-    DPRINT("[S]\t\t\t\t\t >>> [");
-    for (i = 0; i < cmdLen; ++i) {
-        if (i > 0) {
-            DPRINT(" ");
-            if ((i%4) == 0 ) {
-                DPRINT(" ");
-            }
-        }
-        DPRINT("%02X", cmd[i]);
+    if (buf == NULL) {
+        // into the buffer mapped by scsi_map_reserved
+        io.flags = SG_FLAG_MMAP_IO;
     }
-    DPRINT("]\n");
+
+    print_scsi_bytes(">>>", cmd, cmdLen);
 
     r = ioctl(sg_fd, SG_IO, &io);
     if (r == -1) {
@@ -195,19 +541,9 @@ int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
         print_scsi_error(&io, sense);
         return -PSLR_SCSI_ERROR;
     } else {
-        DPRINT("[S]\t\t\t\t\t <<< [");
-        for (i = 0; i < 32 && i < (bufLen - io.resid); ++i) {
-            if (i > 0) {
-                DPRINT(" ");
-                if (i % 16 == 0) {
-                    DPRINT("\n\t\t\t\t\t      ");
-                } else if ((i%4) == 0 ) {
-                    DPRINT(" ");
-                }
-            }
-            DPRINT("%02X", buf[i]);
+        if (buf) {
+            print_scsi_bytes("<<<", buf, bufLen - io.resid);
         }
-        DPRINT("]\n");
 
         /* Older Pentax DSLR will report all bytes remaining, so make
          * a special case for this (treat it as all bytes read). */
@@ -225,7 +561,6 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     sg_io_hdr_t io;
     uint8_t sense[32];
     int r;
-    int i;
 
     memset(&io, 0, sizeof (io));
 
@@ -238,38 +573,15 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     io.dxferp = buf;
     io.cmdp = cmd;
     io.sbp = sense;
-    io.timeout = 20000; /* 20000 millisecs == 20 seconds */
+    io.timeout = SCSI_TIMEOUT;
     /* io.flags = 0; */ /* take defaults: indirect IO, etc */
     /* io.pack_id = 0; */
     /* io.usr_ptr = NULL; */
 
     //  print debug scsi cmd
-    DPRINT("[S]\t\t\t\t\t >>> [");
-    for (i = 0; i < cmdLen; ++i) {
-        if (i > 0) {
-            DPRINT(" ");
-            if ((i%4) == 0 ) {
-                DPRINT(" ");
-            }
-        }
-        DPRINT("%02X", cmd[i]);
-    }
-    DPRINT("]\n");
+    print_scsi_bytes(">>>", cmd, cmdLen);
     if (bufLen > 0) {
-        //  print debug write buffer
-        DPRINT("[S]\t\t\t\t\t >>> [");
-        for (i = 0; i < 32 && i < bufLen; ++i) {
-            if (i > 0) {
-                DPRINT(" ");
-                if (i % 16 == 0) {
-                    DPRINT("\n\t\t\t\t\t      ");
-                } else if ((i%4) == 0 ) {
-                    DPRINT(" ");
-                }
-            }
-            DPRINT("%02X", buf[i]);
-        }
-        DPRINT("]\n");
+        print_scsi_bytes(">>>", buf, bufLen);
     }
 
     r = ioctl(sg_fd, SG_IO, &io);
@@ -286,3 +598,126 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
         return PSLR_OK;
     }
 }
+
+#define HOTPLUG_BUFFER_SIZE 8192
+
+int hotplug_open(void) {
+    struct sockaddr_nl addr;
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd == -1) {
+        DPRINT("Cannot open uevent socket\n");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1; // kernel events, not the ones of udev
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        DPRINT("Cannot bind uevent socket\n");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* "add@DEVPATH\0KEY=VALUE\0..." of an added SCSI generic device or disk */
+static bool hotplug_is_scsi_add(const char *msg, size_t length) {
+    const char *action = NULL;
+    const char *subsystem = NULL;
+    const char *devtype = NULL;
+    const char *p;
+
+    for (p = msg; p < msg + length; p += strlen(p) + 1) {
+        if (!strncmp(p, "ACTION=", 7)) {
+            action = p + 7;
+        } else if (!strncmp(p, "SUBSYSTEM=", 10)) {
+            subsystem = p + 10;
+        } else if (!strncmp(p, "DEVTYPE=", 8)) {
+            devtype = p + 8;
+        }
+    }
+    if (action == NULL || strcmp(action, "add") || subsystem == NULL) {
+        return false;
+    }
+    return !strcmp(subsystem, "scsi_generic") || (!strcmp(subsystem, "block") && devtype && !strcmp(devtype, "disk"));
+}
+
+int hotplug_wait(int fd, int timeout_ms) {
+    char buf[HOTPLUG_BUFFER_SIZE];
+    struct sockaddr_nl addr;
+    struct iovec iov;
+    struct msghdr msg;
+    struct pollfd pfd;
+    struct timeval start;
+    struct timeval now;
+    int wait = timeout_ms;
+    bool added = false;
+    ssize_t n;
+
+    gettimeofday(&start, NULL);
+    while (true) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (timeout_ms > 0) {
+            gettimeofday(&now, NULL);
+            wait = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+            if (wait < 0) {
+                wait = 0;
+            }
+        }
+        int r = poll(&pfd, 1, wait);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1 || (pfd.revents & (POLLERR | POLLNVAL))) {
+            return -1;
+        }
+        if (r == 0) {
+            return 0;
+        }
+        // every queued event
+        while (true) {
+            memset(&msg, 0, sizeof(msg));
+            iov.iov_base = buf;
+            iov.iov_len = sizeof(buf) - 1;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_name = &addr;
+            msg.msg_namelen = sizeof(addr);
+            n = recvmsg(fd, &msg, MSG_DONTWAIT);
+            if (n == -1 && errno == ENOBUFS) {
+                // the socket overflowed, an addition may have been lost
+                added = true;
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            // uevents come from the kernel only
+            if (msg.msg_namelen == sizeof(addr) && addr.nl_family == AF_NETLINK && addr.nl_pid != 0) {
+                continue;
+            }
+            buf[n] = '\0';
+            if (hotplug_is_scsi_add(buf, n)) {
+                DPRINT("hotplug: %s\n", buf);
+                added = true;
+            }
+        }
+        if (added) {
+            return 1;
+        }
+        if (n == 0 && (pfd.revents & POLLHUP)) {
+            // the event source was closed
+            return -1;
+        }
+        if (timeout_ms == 0) {
+            return 0;
+        }
+    }
+}
+
+void hotplug_close(int fd) {
+    if (fd != -1) {
+        close(fd);
+    }
+}
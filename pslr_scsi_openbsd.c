@@ -90,6 +90,11 @@ char **get_drives(int *driveNum) {
     return ret;
 }
 
+char **get_drives_matching(int *driveNum, drive_match_t match) {
+    // vendor and model need an open drive here, pslr_init checks them
+    return get_drives(driveNum);
+}
+
 pslr_result get_drive_info(char* driveName, int* hDevice,
                            char* vendorId, int vendorIdSizeMax,
                            char* productId, int productIdSizeMax) {
@@ -160,11 +165,27 @@ void close_drive(int *hDevice) {
     close( *hDevice );
 }
 
+bool scsi_async_open(int sg_fd) {
+    return false;
+}
+
+int scsi_submit(int sg_fd, int pack_id, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                uint8_t *buf, uint32_t bufLen) {
+    return PSLR_DEVICE_ERROR;
+}
+
+int scsi_complete(int sg_fd, int pack_id) {
+    return -PSLR_DEVICE_ERROR;
+}
+
+uint8_t *scsi_map_reserved(int sg_fd, uint32_t *size) {
+    return NULL;
+}
+
 int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
               uint8_t *buf, uint32_t bufLen) {
 
     int r;
-    unsigned int i;
     scsireq_t screq;
 
     memset(&screq, 0, sizeof(screq));
@@ -180,17 +201,7 @@ int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     screq.databuf = buf;
     screq.datalen = bufLen;
 
-    DPRINT("[S]\t\t\t\t\t >>> [");
-    for (i = 0; i < cmdLen; ++i) {
-        if (i > 0) {
-            DPRINT(" ");
-            if ((i%4) == 0 ) {
-                DPRINT(" ");
-            }
-        }
-        DPRINT("%02X", cmd[i]);
-    }
-    DPRINT("]\n");
+    print_scsi_bytes(">>>", cmd, cmdLen);
 
     r = ioctl(sg_fd, SCIOCCOMMAND, &screq);
     if (r == -1) {
@@ -202,19 +213,7 @@ int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
         print_scsi_error(&screq);
         return -PSLR_SCSI_ERROR;
     } else {
-        DPRINT("[S]\t\t\t\t\t <<< [");
-        for (i = 0; i < 32 && i < screq.datalen_used; ++i) {
-            if (i > 0) {
-                DPRINT(" ");
-                if (i % 16 == 0) {
-                    DPRINT("\n\t\t\t\t\t      ");
-                } else if ((i%4) == 0 ) {
-                    DPRINT(" ");
-                }
-            }
-            DPRINT("%02X", buf[i]);
-        }
-        DPRINT("]\n");
+        print_scsi_bytes("<<<", buf, screq.datalen_used);
 
         /* Older Pentax DSLR will report all bytes remaining, so make
          * a special case for this (treat it as all bytes read). */
@@ -238,7 +237,6 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
 
 
     int r;
-    unsigned int i;
     scsireq_t screq;
 
     memset(&screq, 0, sizeof(screq));
@@ -255,33 +253,9 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     screq.datalen = bufLen;
 
 
-    //  print debug scsi cmd
-    DPRINT("[S]\t\t\t\t\t >>> [");
-    for (i = 0; i < cmdLen; ++i) {
-        if (i > 0) {
-            DPRINT(" ");
-            if ((i%4) == 0 ) {
-                DPRINT(" ");
-            }
-        }
-        DPRINT("%02X", cmd[i]);
-    }
-    DPRINT("]\n");
+    print_scsi_bytes(">>>", cmd, cmdLen);
     if (bufLen > 0) {
-        //  print debug write buffer
-        DPRINT("[S]\t\t\t\t\t >>> [");
-        for (i = 0; i < 32 && i < bufLen; ++i) {
-            if (i > 0) {
-                DPRINT(" ");
-                if (i % 16 == 0) {
-                    DPRINT("\n\t\t\t\t\t      ");
-                } else if ((i%4) == 0 ) {
-                    DPRINT(" ");
-                }
-            }
-            DPRINT("%02X", buf[i]);
-        }
-        DPRINT("]\n");
+        print_scsi_bytes(">>>", buf, bufLen);
     }
 
     r = ioctl(sg_fd, SCIOCCOMMAND, &screq);
@@ -298,3 +272,15 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
         return PSLR_OK;
     }
 }
+
+/* no hotplug events, pslr_init_wait polls */
+int hotplug_open(void) {
+    return -1;
+}
+
+int hotplug_wait(int fd, int timeout_ms) {
+    return -1;
+}
+
+void hotplug_close(int fd) {
+}
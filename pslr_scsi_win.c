@@ -76,6 +76,11 @@ char **get_drives(int *driveNum) {
     return ret;
 }
 
+char **get_drives_matching(int *driveNum, drive_match_t match) {
+    // vendor and model need an open drive here, pslr_init checks them
+    return get_drives(driveNum);
+}
+
 pslr_result get_drive_info(char* driveName, int* hDevice,
                            char* vendorId, int vendorIdSizeMax,
                            char* productId, int productIdSizeMax
@@ -153,6 +158,23 @@ void close_drive(int *hDevice) {
     CloseHandle((HANDLE)*hDevice);
 }
 
+bool scsi_async_open(int sg_fd) {
+    return false;
+}
+
+int scsi_submit(int sg_fd, int pack_id, bool toDevice, uint8_t *cmd, uint32_t cmdLen,
+                uint8_t *buf, uint32_t bufLen) {
+    return PSLR_DEVICE_ERROR;
+}
+
+int scsi_complete(int sg_fd, int pack_id) {
+    return -PSLR_DEVICE_ERROR;
+}
+
+uint8_t *scsi_map_reserved(int sg_fd, uint32_t *size) {
+    return NULL;
+}
+
 int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
               uint8_t *buf, uint32_t bufLen) {
     SCSI_PASS_THROUGH_WITH_BUFFER sptdwb;
@@ -177,6 +199,7 @@ int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     memset(sptdwb.sptd.Cdb, 0, sizeof(sptdwb.sptd.Cdb));
     memcpy(sptdwb.sptd.Cdb, cmd, cmdLen);
 
+    print_scsi_bytes(">>>", cmd, cmdLen);
     Status=DeviceIoControl((HANDLE)sg_fd,
                            IOCTL_SCSI_PASS_THROUGH_DIRECT,
                            &sptdwb,
@@ -197,6 +220,7 @@ int scsi_read(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     if (LastError != 0) {
         return -PSLR_SCSI_ERROR;
     } else {
+        print_scsi_bytes("<<<", buf, bufLen);
         if (sptdwb.sptd.DataTransferLength == bufLen) {
             return bufLen;
         } else {
@@ -228,6 +252,10 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
     memset(sptdwb.sptd.Cdb, 0, sizeof(sptdwb.sptd.Cdb));
     memcpy(sptdwb.sptd.Cdb, cmd, cmdLen);
 
+    print_scsi_bytes(">>>", cmd, cmdLen);
+    if (bufLen > 0) {
+        print_scsi_bytes(">>>", buf, bufLen);
+    }
     Status=DeviceIoControl((HANDLE)sg_fd,
                            IOCTL_SCSI_PASS_THROUGH_DIRECT,
                            &sptdwb,
@@ -248,3 +276,15 @@ int scsi_write(int sg_fd, uint8_t *cmd, uint32_t cmdLen,
         return PSLR_OK;
     }
 }
+
+/* no hotplug events, pslr_init_wait polls */
+int hotplug_open(void) {
+    return -1;
+}
+
+int hotplug_wait(int fd, int timeout_ms) {
+    return -1;
+}
+
+void hotplug_close(int fd) {
+}
@@ -0,0 +1,662 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2018 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    based on:
+
+    PK-Remote
+    Remote control of Pentax DSLR cameras.
+    Copyright (C) 2008 Pontus Lidman <pontus@lysator.liu.se>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "pslr_virtual.h"
+
+#define VIRTUAL_CAMERA_MAX 8
+#define VIRTUAL_LATENCY_MAX 16
+#define VIRTUAL_BUFFER_NUM 10
+#define VIRTUAL_ARGS_SIZE 32
+#define VIRTUAL_RESULT_SIZE MAX_STATUS_BUF_SIZE
+#define VIRTUAL_LIMITED_STATUS_SIZE 264 /* models without buffer_size */
+#define VIRTUAL_DEFAULT_MODEL "K-1"
+#define VIRTUAL_DEFAULT_IMAGE_SIZE (12 * 1024 * 1024)
+#define VIRTUAL_SEGMENT_SIZE_MAX 0x01000000
+#define VIRTUAL_IMAGE_SIZE_MIN 4 /* the JPEG buffer is a quarter of the image */
+#define VIRTUAL_IMAGE_SIZE_MAX (MAX_SEGMENTS * VIRTUAL_SEGMENT_SIZE_MAX)
+#define VIRTUAL_BASE_ADDR 0x10000000
+#define VIRTUAL_MAX_TRANSFER (512 * 1024) /* like the sg reserved buffer */
+
+typedef struct {
+    uint16_t command; /* a << 8 | b */
+    uint32_t usec;
+} ipslr_virtual_latency_t;
+
+/* 0x18 property changes mirrored into the status buffer */
+typedef struct {
+    int subcommand;
+    int arg;
+    size_t field; /* offset of the uint32 field in pslr_status */
+    uint32_t initial;
+} ipslr_virtual_property_t;
+
+static const ipslr_virtual_property_t virtual_properties[] = {
+    { 0x01, 1, offsetof(pslr_status, exposure_mode), PSLR_EXPOSURE_MODE_P },
+    { 0x12, 1, offsetof(pslr_status, image_format), PSLR_IMAGE_FORMAT_JPEG },
+    { 0x1f, 1, offsetof(pslr_status, raw_format), PSLR_RAW_FORMAT_PEF },
+    { 0x15, 0, offsetof(pslr_status, fixed_iso), 100 },
+    { 0x16, 0, offsetof(pslr_status, set_shutter_speed.nom), 1 },
+    { 0x16, 1, offsetof(pslr_status, set_shutter_speed.denom), 125 },
+    { 0x17, 0, offsetof(pslr_status, set_aperture.nom), 56 },
+    { 0x17, 1, offsetof(pslr_status, set_aperture.denom), 10 },
+    { 0x18, 0, offsetof(pslr_status, ec.nom), 0 },
+    { 0x18, 1, offsetof(pslr_status, ec.denom), 10 }
+};
+
+#define VIRTUAL_PROPERTY_NUM (sizeof (virtual_properties) / sizeof (virtual_properties[0]))
+
+typedef struct {
+    bool used;
+    ipslr_model_info_t *model;
+    int bufmask_offset; /* -1 if the model has no status parser */
+    int property_offset[VIRTUAL_PROPERTY_NUM];
+    uint8_t status_buffer[MAX_STATUS_BUF_SIZE];
+    uint32_t default_latency;
+    ipslr_virtual_latency_t latency[VIRTUAL_LATENCY_MAX];
+    int latency_count;
+    uint32_t transfer_rate;
+    uint32_t image_size;
+    uint32_t capture_time;
+    struct timeval busy_until;
+    uint8_t args[VIRTUAL_ARGS_SIZE];
+    uint8_t result[VIRTUAL_RESULT_SIZE];
+    uint32_t result_length;
+    uint8_t error;
+    uint16_t bufmask;
+    uint16_t processing;
+    struct timeval image_ready[VIRTUAL_BUFFER_NUM];
+    bool bulb;
+    int selected_buffer;
+    pslr_buffer_type selected_type;
+    int segment_index;
+    uint32_t download_addr;
+    uint32_t download_length;
+    uint8_t settings[SETTINGS_BUFFER_SIZE];
+} ipslr_virtual_camera_t;
+
+static ipslr_virtual_camera_t virtual_cameras[VIRTUAL_CAMERA_MAX];
+static pthread_mutex_t virtual_cameras_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ipslr_virtual_camera_t *virtual_camera( FDTYPE fd ) {
+    if ( fd < 0 || fd >= VIRTUAL_CAMERA_MAX || !virtual_cameras[fd].used ) {
+        return NULL;
+    }
+    return &virtual_cameras[fd];
+}
+
+static ipslr_virtual_camera_t *virtual_camera_of_handle( pslr_handle_t h ) {
+    ipslr_handle_t *p = (ipslr_handle_t *) h;
+    if ( p == NULL || p->transport != &pslr_virtual_transport ) {
+        return NULL;
+    }
+    return virtual_camera( p->fd );
+}
+
+static uint32_t virtual_get_uint32( ipslr_virtual_camera_t *v, uint8_t *buf ) {
+    return v->model->is_little_endian ? get_uint32_le(buf) : get_uint32_be(buf);
+}
+
+static void virtual_set_uint32( ipslr_virtual_camera_t *v, uint32_t value, uint8_t *buf ) {
+    if ( v->model->is_little_endian ) {
+        set_uint32_le(value, buf);
+    } else {
+        set_uint32_be(value, buf);
+    }
+}
+
+static void virtual_result( ipslr_virtual_camera_t *v, uint32_t length ) {
+    memset(v->result, 0, length);
+    v->result_length = length;
+}
+
+static uint16_t virtual_tag( int offset ) {
+    return 0x8000 | offset;
+}
+
+/* The status buffer layout differs per model. Let the model's own parser
+   tell where the fields live: tag every even offset with its value, then
+   look for the tags in the parsed fields. Fields which are not plain
+   uint32 reads (or not parsed at all) stay at -1. */
+static void virtual_probe_layout( ipslr_virtual_camera_t *v ) {
+    ipslr_handle_t probe;
+    pslr_status status;
+    uint32_t value;
+    int offset;
+    int i;
+
+    v->bufmask_offset = -1;
+    for ( i = 0; i < VIRTUAL_PROPERTY_NUM; ++i ) {
+        v->property_offset[i] = -1;
+    }
+    if ( !v->model->status_parser_function ) {
+        return;
+    }
+    memset(&probe, 0, sizeof (probe));
+    probe.model = v->model;
+    for ( i = 0; i + 1 < MAX_STATUS_BUF_SIZE; i += 2 ) {
+        probe.status_buffer[i] = v->model->is_little_endian ? virtual_tag(i) & 0xff : virtual_tag(i) >> 8;
+        probe.status_buffer[i+1] = v->model->is_little_endian ? virtual_tag(i) >> 8 : virtual_tag(i) & 0xff;
+    }
+    // nothing to report in the debug status diff of the probe
+    memcpy(probe.status_diff_buffer, probe.status_buffer, MAX_STATUS_BUF_SIZE);
+    probe.status_diff_init = true;
+    (*v->model->status_parser_function)(&probe, &status);
+
+    if ( status.bufmask & 0x8000 ) {
+        v->bufmask_offset = status.bufmask & 0x7fff;
+    }
+    for ( i = 0; i < VIRTUAL_PROPERTY_NUM; ++i ) {
+        value = *(uint32_t *) ((uint8_t *) &status + virtual_properties[i].field);
+        offset = (v->model->is_little_endian ? value : value >> 16) & 0x7fff;
+        if ( offset + 4 <= MAX_STATUS_BUF_SIZE && virtual_get_uint32( v, &probe.status_buffer[offset] ) == value ) {
+            v->property_offset[i] = offset;
+            virtual_set_uint32( v, virtual_properties[i].initial, &v->status_buffer[offset] );
+        }
+    }
+}
+
+static void virtual_set_property( ipslr_virtual_camera_t *v, int subcommand ) {
+    int i;
+    for ( i = 0; i < VIRTUAL_PROPERTY_NUM; ++i ) {
+        if ( virtual_properties[i].subcommand == subcommand && v->property_offset[i] >= 0 ) {
+            virtual_set_uint32( v, virtual_get_uint32( v, &v->args[4 * virtual_properties[i].arg] ), &v->status_buffer[v->property_offset[i]] );
+        }
+    }
+}
+
+static uint32_t virtual_latency( ipslr_virtual_camera_t *v, int a, int b ) {
+    int i;
+    for ( i = 0; i < v->latency_count; ++i ) {
+        if ( v->latency[i].command == (a << 8 | b) ) {
+            return v->latency[i].usec;
+        }
+    }
+    return v->default_latency;
+}
+
+static void virtual_time_after( struct timeval *t, uint32_t usec ) {
+    gettimeofday(t, NULL);
+    t->tv_usec += usec;
+    t->tv_sec += t->tv_usec / 1000000;
+    t->tv_usec %= 1000000;
+}
+
+static bool virtual_time_passed( struct timeval *t ) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec > t->tv_sec ||
+           (now.tv_sec == t->tv_sec && now.tv_usec >= t->tv_usec);
+}
+
+static void virtual_set_busy( ipslr_virtual_camera_t *v, uint32_t usec ) {
+    virtual_time_after(&v->busy_until, usec);
+}
+
+static bool virtual_is_busy( ipslr_virtual_camera_t *v ) {
+    return !virtual_time_passed(&v->busy_until);
+}
+
+/* images still being processed show up in bufmask when they are ready */
+static void virtual_update_images( ipslr_virtual_camera_t *v ) {
+    int i;
+    for ( i = 0; i < VIRTUAL_BUFFER_NUM; ++i ) {
+        if ( (v->processing & (1 << i)) && virtual_time_passed(&v->image_ready[i]) ) {
+            v->processing &= ~(1 << i);
+            v->bufmask |= 1 << i;
+        }
+    }
+}
+
+static uint32_t virtual_image_length( ipslr_virtual_camera_t *v, pslr_buffer_type type ) {
+    switch ( type ) {
+        case PSLR_BUF_PEF:
+        case PSLR_BUF_DNG:
+            return v->image_size;
+        case PSLR_BUF_PREVIEW:
+            return 64 * 1024;
+        case PSLR_BUF_THUMBNAIL:
+            return 16 * 1024;
+        default:
+            return v->image_size / 4;
+    }
+}
+
+/* Segment info blocks of the selected buffer: b1, (b4, b3)*, b2 */
+static int virtual_segment_info( ipslr_virtual_camera_t *v, int index, uint32_t *b, uint32_t *addr, uint32_t *length ) {
+    uint32_t image_length = virtual_image_length( v, v->selected_type );
+    int segment_num = (image_length + VIRTUAL_SEGMENT_SIZE_MAX - 1) / VIRTUAL_SEGMENT_SIZE_MAX;
+    uint32_t segment_length;
+    int info_num;
+    int segment;
+
+    if ( segment_num < 2 && image_length > 1024 * 1024 ) {
+        // real cameras split bigger images, exercise that path too
+        segment_num = 2;
+    }
+    segment_length = (image_length + segment_num - 1) / segment_num;
+    info_num = 2 * segment_num + 2;
+    index %= info_num;
+    *addr = 0;
+    *length = 0;
+    if ( index == 0 ) {
+        *b = 1;
+    } else if ( index == info_num - 1 ) {
+        *b = 2;
+    } else {
+        segment = (index - 1) / 2;
+        if ( index % 2 == 1 ) {
+            *b = 4;
+            *length = segment * segment_length;
+        } else {
+            *b = 3;
+            *addr = VIRTUAL_BASE_ADDR + (v->selected_buffer * MAX_SEGMENTS + segment) * VIRTUAL_SEGMENT_SIZE_MAX;
+            *length = image_length - segment * segment_length;
+            if ( *length > segment_length ) {
+                *length = segment_length;
+            }
+        }
+    }
+    return info_num;
+}
+
+static void virtual_new_image( ipslr_virtual_camera_t *v ) {
+    int i;
+    for ( i = 0; i < VIRTUAL_BUFFER_NUM; ++i ) {
+        if ( !((v->bufmask | v->processing) & (1 << i)) ) {
+            v->processing |= 1 << i;
+            virtual_time_after(&v->image_ready[i], v->capture_time);
+            DPRINT("[V]\tnew image in buffer %d\n", i);
+            virtual_update_images( v );
+            return;
+        }
+    }
+    v->error = 0x81;
+}
+
+static void virtual_command( ipslr_virtual_camera_t *v, int a, int b ) {
+    uint32_t info_b, info_addr, info_length;
+    uint32_t offset, status_size;
+    time_t now;
+    struct tm *tm;
+
+    v->result_length = 0;
+    v->error = 0;
+    virtual_update_images( v );
+    switch ( a << 8 | b ) {
+        case 0x0001:
+            virtual_result( v, 16 );
+            break;
+        case 0x0004:
+            virtual_result( v, 8 );
+            virtual_set_uint32( v, v->model->id, v->result );
+            break;
+        case 0x0005:
+            virtual_result( v, 0xb8 );
+            break;
+        case 0x0008:
+            status_size = v->model->buffer_size > 0 ? v->model->buffer_size : VIRTUAL_LIMITED_STATUS_SIZE;
+            virtual_result( v, status_size );
+            memcpy(v->result, v->status_buffer, status_size);
+            if ( v->bufmask_offset >= 0 ) {
+                v->result[v->bufmask_offset] = v->model->is_little_endian ? v->bufmask & 0xff : v->bufmask >> 8;
+                v->result[v->bufmask_offset+1] = v->model->is_little_endian ? v->bufmask >> 8 : v->bufmask & 0xff;
+            }
+            break;
+        case 0x0101:
+            virtual_result( v, 4 );
+            virtual_set_uint32( v, 0x01100000, v->result );
+            break;
+        case 0x0200:
+            virtual_result( v, 8 );
+            virtual_set_uint32( v, v->bufmask, v->result );
+            break;
+        case 0x0201:
+            v->selected_buffer = virtual_get_uint32( v, &v->args[0] );
+            if ( v->selected_buffer < 0 || v->selected_buffer >= VIRTUAL_BUFFER_NUM || !(v->bufmask & (1 << v->selected_buffer)) ) {
+                v->selected_buffer = -1;
+                v->error = 0x81;
+                break;
+            }
+            v->selected_type = virtual_get_uint32( v, &v->args[4] );
+            v->segment_index = 0;
+            break;
+        case 0x0203:
+            offset = virtual_get_uint32( v, &v->args[0] );
+            if ( offset < VIRTUAL_BUFFER_NUM ) {
+                v->bufmask &= ~(1 << offset);
+            }
+            break;
+        case 0x0400:
+            virtual_result( v, 16 );
+            if ( v->selected_buffer < 0 ) {
+                virtual_set_uint32( v, 2, &v->result[4] );
+                break;
+            }
+            virtual_segment_info( v, v->segment_index, &info_b, &info_addr, &info_length );
+            virtual_set_uint32( v, info_b, &v->result[4] );
+            virtual_set_uint32( v, info_addr, &v->result[8] );
+            virtual_set_uint32( v, info_length, &v->result[12] );
+            break;
+        case 0x0401:
+            if ( v->selected_buffer >= 0 ) {
+                v->segment_index = (v->segment_index + 1) % virtual_segment_info( v, 0, &info_b, &info_addr, &info_length );
+            }
+            break;
+        case 0x0600:
+            v->download_addr = virtual_get_uint32( v, &v->args[0] );
+            v->download_length = virtual_get_uint32( v, &v->args[4] );
+            break;
+        case 0x1005:
+            if ( virtual_get_uint32( v, &v->args[0] ) == 2 ) {
+                virtual_new_image( v );
+            }
+            break;
+        case 0x100d:
+            if ( virtual_get_uint32( v, &v->args[0] ) ) {
+                v->bulb = true;
+            } else if ( v->bulb ) {
+                v->bulb = false;
+                virtual_new_image( v );
+            }
+            break;
+        case 0x2006:
+            virtual_result( v, 24 );
+            now = time(NULL);
+            tm = localtime(&now);
+            virtual_set_uint32( v, tm->tm_year + 1900, &v->result[0] );
+            virtual_set_uint32( v, tm->tm_mon + 1, &v->result[4] );
+            virtual_set_uint32( v, tm->tm_mday, &v->result[8] );
+            virtual_set_uint32( v, tm->tm_hour, &v->result[12] );
+            virtual_set_uint32( v, tm->tm_min, &v->result[16] );
+            virtual_set_uint32( v, tm->tm_sec, &v->result[20] );
+            break;
+        case 0x2008:
+            offset = virtual_get_uint32( v, &v->args[0] );
+            if ( offset < SETTINGS_BUFFER_SIZE ) {
+                v->settings[offset] = virtual_get_uint32( v, &v->args[4] );
+            }
+            break;
+        case 0x2009:
+            offset = virtual_get_uint32( v, &v->args[0] );
+            virtual_result( v, 4 );
+            virtual_set_uint32( v, offset < SETTINGS_BUFFER_SIZE ? v->settings[offset] : 0, v->result );
+            break;
+        default:
+            if ( a == 0x18 ) {
+                virtual_set_property( v, b );
+            } else if ( a == 0x23 ) {
+                // debug mode commands, the answer is read but not parsed
+                virtual_result( v, 16 );
+            }
+            // mode changes and the other buttons are just acknowledged
+            break;
+    }
+    virtual_set_busy( v, virtual_latency( v, a, b ) );
+}
+
+static void virtual_print_cmd( const char *direction, uint8_t *cmd ) {
+    DPRINT("[V]\t\t\t\t\t %s [%02X %02X %02X %02X  %02X %02X %02X %02X]\n", direction,
+           cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7]);
+}
+
+static int virtual_read( FDTYPE fd, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen ) {
+    ipslr_virtual_camera_t *v = virtual_camera( fd );
+    uint32_t n;
+    uint32_t i;
+    uint32_t addr;
+
+    if ( v == NULL ) {
+        return -PSLR_DEVICE_ERROR;
+    }
+    if ( cmdLen < 8 || cmd[0] != 0xf0 ) {
+        return -PSLR_SCSI_ERROR;
+    }
+    virtual_print_cmd( ">>>", cmd );
+    switch ( cmd[1] ) {
+        case 0x26: {
+            uint8_t statusbuf[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            if ( virtual_is_busy( v ) ) {
+                statusbuf[7] = 0x01;
+            } else {
+                set_uint32_le( v->result_length, statusbuf );
+                statusbuf[6] = 0x01;
+                statusbuf[7] = v->error;
+            }
+            n = bufLen < 8 ? bufLen : 8;
+            memcpy(buf, statusbuf, n);
+            return n;
+        }
+        case 0x49:
+            n = get_uint32_le(&cmd[4]);
+            n = n < bufLen ? n : bufLen;
+            n = n < v->result_length ? n : v->result_length;
+            memcpy(buf, v->result, n);
+            return n;
+        case 0x24:
+            if ( cmd[2] != 0x06 || cmd[3] != 0x02 ) {
+                return -PSLR_SCSI_ERROR;
+            }
+            if ( bufLen > VIRTUAL_MAX_TRANSFER ) {
+                return -PSLR_SCSI_ERROR;
+            }
+            n = bufLen < v->download_length ? bufLen : v->download_length;
+            for ( i = 0; i < n; ++i ) {
+                addr = v->download_addr + i;
+                buf[i] = (addr ^ addr >> 8 ^ addr >> 16) & 0xff;
+            }
+            v->download_addr += n;
+            v->download_length -= n;
+            if ( v->transfer_rate > 0 ) {
+                usleep( (uint64_t) n * 1000000 / v->transfer_rate );
+            }
+            return n;
+        default:
+            return -PSLR_SCSI_ERROR;
+    }
+}
+
+static int virtual_write( FDTYPE fd, uint8_t *cmd, uint32_t cmdLen, uint8_t *buf, uint32_t bufLen ) {
+    ipslr_virtual_camera_t *v = virtual_camera( fd );
+
+    if ( v == NULL ) {
+        return PSLR_DEVICE_ERROR;
+    }
+    if ( cmdLen < 8 || cmd[0] != 0xf0 ) {
+        return PSLR_SCSI_ERROR;
+    }
+    virtual_print_cmd( ">>>", cmd );
+    switch ( cmd[1] ) {
+        case 0x4f:
+            if ( cmd[2] + bufLen > VIRTUAL_ARGS_SIZE ) {
+                return PSLR_SCSI_ERROR;
+            }
+            memcpy(&v->args[cmd[2]], buf, bufLen);
+            return PSLR_OK;
+        case 0x24:
+            virtual_command( v, cmd[2], cmd[3] );
+            return PSLR_OK;
+        default:
+            return PSLR_SCSI_ERROR;
+    }
+}
+
+bool pslr_virtual_is_device( const char *driveName ) {
+    return driveName != NULL && strncmp(driveName, PSLR_VIRTUAL_DEVICE, strlen(PSLR_VIRTUAL_DEVICE)) == 0;
+}
+
+static pslr_result virtual_get_drive_info( char* driveName, FDTYPE* hDevice,
+        char* vendorId, int vendorIdSizeMax,
+        char* productId, int productIdSizeMax ) {
+    char model_name[64];
+    char *options;
+    char *colon;
+    ipslr_virtual_camera_t *v;
+    int fd;
+
+    *hDevice = -1;
+    vendorId[0] = '\0';
+    productId[0] = '\0';
+    if ( !pslr_virtual_is_device( driveName ) ) {
+        return PSLR_DEVICE_ERROR;
+    }
+    options = driveName + strlen(PSLR_VIRTUAL_DEVICE);
+    snprintf(model_name, sizeof (model_name), "%s", VIRTUAL_DEFAULT_MODEL);
+    if ( *options == ':' ) {
+        ++options;
+        colon = strchr(options, ':');
+        snprintf(model_name, sizeof (model_name), "%.*s", colon ? (int) (colon - options) : (int) strlen(options), options);
+        options = colon ? colon : options + strlen(options);
+    }
+
+    pthread_mutex_lock(&virtual_cameras_lock);
+    for ( fd = 0; fd < VIRTUAL_CAMERA_MAX && virtual_cameras[fd].used; ++fd ) {
+    }
+    if ( fd == VIRTUAL_CAMERA_MAX ) {
+        pthread_mutex_unlock(&virtual_cameras_lock);
+        DPRINT("\tToo many virtual cameras\n");
+        return PSLR_DEVICE_ERROR;
+    }
+    v = &virtual_cameras[fd];
+    memset(v, 0, sizeof (*v));
+    v->model = find_model_by_name( model_name );
+    if ( v->model == NULL ) {
+        pthread_mutex_unlock(&virtual_cameras_lock);
+        DPRINT("\tUnknown virtual camera model: %s\n", model_name);
+        return PSLR_DEVICE_ERROR;
+    }
+    v->used = true;
+    pthread_mutex_unlock(&virtual_cameras_lock);
+    virtual_probe_layout( v );
+    v->image_size = VIRTUAL_DEFAULT_IMAGE_SIZE;
+    v->selected_buffer = -1;
+    if ( *options == ':' ) {
+        v->default_latency = strtoul(options + 1, &options, 10);
+    }
+    if ( *options == ':' ) {
+        v->transfer_rate = strtoul(options + 1, &options, 10);
+    }
+    if ( *options == ':' ) {
+        v->image_size = strtoul(options + 1, &options, 10);
+    }
+    if ( *options == ':' ) {
+        v->capture_time = strtoul(options + 1, &options, 10);
+    }
+    if ( v->image_size < VIRTUAL_IMAGE_SIZE_MIN || v->image_size > VIRTUAL_IMAGE_SIZE_MAX ) {
+        DPRINT("\tVirtual image size %u is out of range %u..%u\n", v->image_size, VIRTUAL_IMAGE_SIZE_MIN, VIRTUAL_IMAGE_SIZE_MAX);
+        pthread_mutex_lock(&virtual_cameras_lock);
+        v->used = false;
+        pthread_mutex_unlock(&virtual_cameras_lock);
+        return PSLR_PARAM;
+    }
+    DPRINT("\tVirtual %s: latency %u us, rate %u B/s, image %u bytes, capture %u us, bufmask at 0x%x\n", v->model->name,
+           v->default_latency, v->transfer_rate, v->image_size, v->capture_time, v->bufmask_offset);
+
+    snprintf(vendorId, vendorIdSizeMax, "PENTAX");
+    snprintf(productId, productIdSizeMax, "DIGITAL_CAMERA");
+    *hDevice = fd;
+    return PSLR_OK;
+}
+
+static void virtual_close_drive( FDTYPE *hDevice ) {
+    ipslr_virtual_camera_t *v = virtual_camera( *hDevice );
+    if ( v != NULL ) {
+        pthread_mutex_lock(&virtual_cameras_lock);
+        v->used = false;
+        pthread_mutex_unlock(&virtual_cameras_lock);
+    }
+}
+
+pslr_transport_t pslr_virtual_transport = {
+    PSLR_VIRTUAL_DEVICE,
+    virtual_read,
+    virtual_write,
+    virtual_get_drive_info,
+    virtual_close_drive
+};
+
+int pslr_virtual_set_latency( pslr_handle_t h, int a, int b, uint32_t usec ) {
+    ipslr_virtual_camera_t *v = virtual_camera_of_handle( h );
+    int i;
+
+    if ( v == NULL ) {
+        return PSLR_PARAM;
+    }
+    if ( a < 0 ) {
+        v->default_latency = usec;
+        return PSLR_OK;
+    }
+    for ( i = 0; i < v->latency_count; ++i ) {
+        if ( v->latency[i].command == (a << 8 | b) ) {
+            v->latency[i].usec = usec;
+            return PSLR_OK;
+        }
+    }
+    if ( v->latency_count == VIRTUAL_LATENCY_MAX ) {
+        return PSLR_NO_MEMORY;
+    }
+    v->latency[v->latency_count].command = a << 8 | b;
+    v->latency[v->latency_count].usec = usec;
+    ++v->latency_count;
+    return PSLR_OK;
+}
+
+int pslr_virtual_set_transfer_rate( pslr_handle_t h, uint32_t bytes_per_sec ) {
+    ipslr_virtual_camera_t *v = virtual_camera_of_handle( h );
+    if ( v == NULL ) {
+        return PSLR_PARAM;
+    }
+    v->transfer_rate = bytes_per_sec;
+    return PSLR_OK;
+}
+
+int pslr_virtual_set_image_size( pslr_handle_t h, uint32_t image_bytes ) {
+    ipslr_virtual_camera_t *v = virtual_camera_of_handle( h );
+    if ( v == NULL || image_bytes < VIRTUAL_IMAGE_SIZE_MIN || image_bytes > VIRTUAL_IMAGE_SIZE_MAX ) {
+        return PSLR_PARAM;
+    }
+    v->image_size = image_bytes;
+    return PSLR_OK;
+}
+
+int pslr_virtual_set_capture_time( pslr_handle_t h, uint32_t usec ) {
+    ipslr_virtual_camera_t *v = virtual_camera_of_handle( h );
+    if ( v == NULL ) {
+        return PSLR_PARAM;
+    }
+    v->capture_time = usec;
+    return PSLR_OK;
+}
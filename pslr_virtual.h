@@ -0,0 +1,50 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2018 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    based on:
+
+    PK-Remote
+    Remote control of Pentax DSLR cameras.
+    Copyright (C) 2008 Pontus Lidman <pontus@lysator.liu.se>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef PSLR_VIRTUAL_H
+#define PSLR_VIRTUAL_H
+
+#include "pslr.h"
+
+/* In-process simulated camera, selected by the device name
+     virtual[:MODEL[:LATENCY_US[:BYTES_PER_SEC[:IMAGE_BYTES[:CAPTURE_US]]]]]
+   e.g. "virtual:K-1:2000". It answers the f0 24/26/49/4f commands of
+   pentax_scsi_protocol.md. Every command keeps the camera busy for its
+   latency, downloads are throttled to BYTES_PER_SEC (0: unlimited).
+   IMAGE_BYTES is 4 bytes to 64 MiB, other sizes are refused.
+   A new image appears in the buffer mask CAPTURE_US after the shutter.
+   The downloaded byte at camera address A is (A ^ A>>8 ^ A>>16) & 0xff. */
+#define PSLR_VIRTUAL_DEVICE "virtual"
+
+extern pslr_transport_t pslr_virtual_transport;
+
+bool pslr_virtual_is_device( const char *driveName );
+
+/* a < 0 sets the default latency of every command */
+int pslr_virtual_set_latency( pslr_handle_t h, int a, int b, uint32_t usec );
+int pslr_virtual_set_transfer_rate( pslr_handle_t h, uint32_t bytes_per_sec );
+int pslr_virtual_set_image_size( pslr_handle_t h, uint32_t image_bytes );
+int pslr_virtual_set_capture_time( pslr_handle_t h, uint32_t usec );
+#endif
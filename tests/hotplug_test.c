@@ -0,0 +1,124 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2018 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Hotplug test. A socketpair stands in for the uevent socket: the test
+   writes kernel style "add@...\0KEY=VALUE\0..." datagrams to one end and
+   pslr_hotplug_wait reads the other.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../pslr.h"
+
+#define EVENT_DELAY_MS 100
+
+bool debug = false;
+
+static const char sg_add[] = "add@/devices/pci/usb1/1-1/host6/target6:0:0/6:0:0:0/scsi_generic/sg3\0"
+                             "ACTION=add\0DEVPATH=/devices/pci/usb1/1-1/host6/target6:0:0/6:0:0:0/scsi_generic/sg3\0"
+                             "SUBSYSTEM=scsi_generic\0DEVNAME=sg3\0SEQNUM=4711";
+static const char sg_remove[] = "remove@/devices/scsi_generic/sg3\0"
+                                "ACTION=remove\0SUBSYSTEM=scsi_generic\0DEVNAME=sg3";
+static const char disk_add[] = "add@/devices/block/sdc\0"
+                               "ACTION=add\0SUBSYSTEM=block\0DEVTYPE=disk\0DEVNAME=sdc";
+static const char partition_add[] = "add@/devices/block/sdc/sdc1\0"
+                                    "ACTION=add\0SUBSYSTEM=block\0DEVTYPE=partition\0DEVNAME=sdc1";
+static const char usb_add[] = "add@/devices/pci/usb1/1-1\0"
+                              "ACTION=add\0SUBSYSTEM=usb\0DEVTYPE=usb_device";
+
+static int failed = 0;
+
+static int elapsed_ms(struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void check(const char *name, int got, int expected) {
+    printf("%-40s %s\n", name, got == expected ? "ok" : "FAILED");
+    if (got != expected) {
+        printf("\tgot %d, expected %d\n", got, expected);
+        failed++;
+    }
+}
+
+static int wait_for(int fd[2], const char *event, size_t length, int timeout_ms) {
+    if (event != NULL && send(fd[1], event, length, 0) != (ssize_t) length) {
+        perror("send");
+        return -2;
+    }
+    return pslr_hotplug_wait(fd[0], timeout_ms);
+}
+
+static void *late_event(void *arg) {
+    int *fd = arg;
+    usleep(EVENT_DELAY_MS * 1000);
+    send(fd[1], sg_add, sizeof (sg_add), 0);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct timeval start;
+    pthread_t thread;
+    int fd[2];
+    int r;
+    int ms;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fd) == -1) {
+        perror("socketpair");
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+    r = wait_for(fd, NULL, 0, 50);
+    ms = elapsed_ms(&start);
+    check("timeout without events", r == 0 && ms >= 50, true);
+    check("scsi_generic added", wait_for(fd, sg_add, sizeof (sg_add), 1000), 1);
+    check("scsi_generic removed", wait_for(fd, sg_remove, sizeof (sg_remove), 20), 0);
+    check("disk added", wait_for(fd, disk_add, sizeof (disk_add), 1000), 1);
+    check("partition added", wait_for(fd, partition_add, sizeof (partition_add), 20), 0);
+    check("usb device added", wait_for(fd, usb_add, sizeof (usb_add), 20), 0);
+    send(fd[1], usb_add, sizeof (usb_add), 0);
+    send(fd[1], disk_add, sizeof (disk_add), 0);
+    send(fd[1], sg_add, sizeof (sg_add), 0);
+    check("queued events in one wait", pslr_hotplug_wait(fd[0], 20), 1);
+    check("queued events are drained", pslr_hotplug_wait(fd[0], 20), 0);
+
+    gettimeofday(&start, NULL);
+    pthread_create(&thread, NULL, late_event, fd);
+    r = pslr_hotplug_wait(fd[0], -1);
+    ms = elapsed_ms(&start);
+    pthread_join(thread, NULL);
+    check("wakes up on a late event", r, 1);
+    printf("\tevent after %d ms, woken up after %d ms\n", EVENT_DELAY_MS, ms);
+
+    close(fd[1]);
+    check("closed event source", pslr_hotplug_wait(fd[0], 1000), -1);
+    close(fd[0]);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2018 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Lens table test: every entry of exiftool_pentax_lens.txt has to be
+   found by get_lens_name, ids that are not in the table give "". With
+   -b the lookup is timed against a linear scan of the same table.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../pslr_lens.h"
+
+#define BENCH_ROUNDS 10000
+
+typedef struct {
+    uint32_t id1;
+    uint32_t id2;
+    const char *name;
+} lens_entry_t;
+
+static const lens_entry_t lenses[] = {
+#include "../exiftool_pentax_lens.txt"
+};
+
+#define LENS_COUNT (sizeof (lenses) / sizeof (lenses[0]))
+
+static const char *linear_lens_name(uint32_t id1, uint32_t id2) {
+    unsigned int i;
+    for (i = 0; i < LENS_COUNT; i++) {
+        if (lenses[i].id1 == id1 && lenses[i].id2 == id2) {
+            return lenses[i].name;
+        }
+    }
+    return "";
+}
+
+static bool lens_known(uint32_t id1, uint32_t id2) {
+    return linear_lens_name(id1, id2)[0] != '\0';
+}
+
+static double bench_nsec(struct timespec *start, struct timespec *end) {
+    return ((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec)) / (BENCH_ROUNDS * LENS_COUNT);
+}
+
+int main(int argc, char **argv) {
+    struct timespec t0, t1, t2;
+    unsigned int i, round;
+    uint32_t id1, id2;
+    size_t sum = 0;
+    int failed = 0;
+
+    for (i = 0; i < LENS_COUNT; i++) {
+        if (i > 0 && (lenses[i-1].id1 > lenses[i].id1 ||
+                      (lenses[i-1].id1 == lenses[i].id1 && lenses[i-1].id2 >= lenses[i].id2))) {
+            printf("not sorted at %u %u\n", lenses[i].id1, lenses[i].id2);
+            failed++;
+        }
+        if (strcmp(get_lens_name(lenses[i].id1, lenses[i].id2), lenses[i].name)) {
+            printf("%u %u: got \"%s\" instead of \"%s\"\n", lenses[i].id1, lenses[i].id2,
+                   get_lens_name(lenses[i].id1, lenses[i].id2), lenses[i].name);
+            failed++;
+        }
+    }
+    for (id1 = 0; id1 < 16; id1++) {
+        for (id2 = 0; id2 < 512; id2++) {
+            if (!lens_known(id1, id2) && strcmp(get_lens_name(id1, id2), "")) {
+                printf("%u %u: got \"%s\" for an unknown lens\n", id1, id2, get_lens_name(id1, id2));
+                failed++;
+            }
+        }
+    }
+    printf("%u lenses, %d errors\n", (unsigned int) LENS_COUNT, failed);
+
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+            for (i = 0; i < LENS_COUNT; i++) {
+                sum += strlen(linear_lens_name(lenses[i].id1, lenses[i].id2));
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        for (round = 0; round < BENCH_ROUNDS; round++) {
+            for (i = 0; i < LENS_COUNT; i++) {
+                sum += strlen(get_lens_name(lenses[i].id1, lenses[i].id2));
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        printf("linear scan %.1f ns, get_lens_name %.1f ns per lookup (%zu)\n",
+               bench_nsec(&t0, &t1), bench_nsec(&t1, &t2), sum);
+    }
+    return failed ? 1 : 0;
+}
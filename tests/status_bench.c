@@ -0,0 +1,275 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2018 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Status parser benchmark.
+
+   The generated parsers are compared with a parser that walks the same
+   field tables and reads every field through the get_uint*_be/le
+   function pointers, the way the hand-written parsers did. Both parse
+   the status buffer recorded from the virtual camera of every model, and
+   random buffers to check that they agree. ipslr_status_update, which
+   re-derives only the fields whose bytes changed, has to give the same
+   status as a full parse after a few random byte changes.
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#include "../pslr_model.c"
+#include "../pslr.h"
+
+#define BENCH_PARSES 1000000
+#define BENCH_RANDOM_BUFFERS 1000
+#define BENCH_CHANGED_BYTES 4
+
+bool debug = false;
+
+typedef uint32_t (*ref_read_t)(uint8_t *buf);
+
+static uint32_t ref_read_U16_BE(uint8_t *buf) {
+    return get_uint16_be(buf);
+}
+
+static uint32_t ref_read_U16_LE(uint8_t *buf) {
+    return get_uint16_le(buf);
+}
+
+#define ref_read_U32_BE get_uint32_be
+#define ref_read_U32_LE get_uint32_le
+
+static uint32_t ref_read_I32_BE(uint8_t *buf) {
+    return get_int32_be(buf);
+}
+
+static uint32_t ref_read_I32_LE(uint8_t *buf) {
+    return get_int32_le(buf);
+}
+
+typedef enum {
+    REF_TRANSFORM_RAW,
+    REF_TRANSFORM_STARS,
+    REF_TRANSFORM_LENS_ID,
+    REF_TRANSFORM_CONST
+} ref_transform_t;
+
+typedef struct {
+    uint16_t status_offset;
+    uint8_t status_size;
+    uint16_t offset;
+    ref_read_t read;
+    ref_transform_t transform;
+    uint32_t value;
+} ref_field_t;
+
+#define REF_FIELD(field, type, endian, off, transform) \
+    { offsetof(pslr_status, field), sizeof (((pslr_status *) 0)->field), (off), ref_read_ ## type ## _ ## endian, \
+      REF_TRANSFORM_ ## transform, 0 },
+#define REF_CONST(field, val) \
+    { offsetof(pslr_status, field), sizeof (((pslr_status *) 0)->field), 0, NULL, REF_TRANSFORM_CONST, (val) },
+
+/* not const, so the compiler cannot resolve the read pointers */
+#define REF_LAYOUT(name, layout) \
+    ref_field_t ref_fields_ ## name[] = { \
+        layout(REF_FIELD, REF_CONST) \
+    };
+
+REF_LAYOUT(k10d, STATUS_FIELDS_K10D)
+REF_LAYOUT(k20d, STATUS_FIELDS_K20D)
+REF_LAYOUT(istds, STATUS_FIELDS_ISTDS)
+REF_LAYOUT(kx, STATUS_FIELDS_KX)
+REF_LAYOUT(kr, STATUS_FIELDS_KR)
+REF_LAYOUT(k5, STATUS_FIELDS_K5)
+REF_LAYOUT(k30, STATUS_FIELDS_K30)
+REF_LAYOUT(k50, STATUS_FIELDS_K50)
+REF_LAYOUT(k500, STATUS_FIELDS_K500)
+REF_LAYOUT(km, STATUS_FIELDS_KM)
+REF_LAYOUT(k3, STATUS_FIELDS_K3)
+REF_LAYOUT(ks1, STATUS_FIELDS_KS1)
+REF_LAYOUT(k1, STATUS_FIELDS_K1)
+REF_LAYOUT(k70, STATUS_FIELDS_K70)
+REF_LAYOUT(k200d, STATUS_FIELDS_K200D)
+
+typedef struct {
+    ipslr_status_parse_t parser;
+    ref_field_t *fields;
+    int count;
+} ref_layout_t;
+
+#define REF_ENTRY(parser, name) \
+    { ipslr_status_parse_ ## parser, ref_fields_ ## name, sizeof (ref_fields_ ## name) / sizeof (ref_fields_ ## name[0]) }
+
+static const ref_layout_t ref_layouts[] = {
+    REF_ENTRY(k10d, k10d),
+    REF_ENTRY(k20d, k20d),
+    REF_ENTRY(istds, istds),
+    REF_ENTRY(kx, kx),
+    REF_ENTRY(kr, kr),
+    REF_ENTRY(k5, k5),
+    REF_ENTRY(k30, k30),
+    REF_ENTRY(k01, k30),
+    REF_ENTRY(k50, k50),
+    REF_ENTRY(k500, k500),
+    REF_ENTRY(km, km),
+    REF_ENTRY(k3, k3),
+    REF_ENTRY(ks1, ks1),
+    REF_ENTRY(k1, k1),
+    REF_ENTRY(k70, k70),
+    REF_ENTRY(k200d, k200d)
+};
+
+/* global, so the stores of one parse are not dropped */
+pslr_status bench_status;
+
+void ref_status_parse(ipslr_handle_t *p, const ref_layout_t *layout, pslr_status *status) {
+    uint8_t *buf = p->status_buffer;
+    uint16_t v16;
+    uint32_t v;
+    int i;
+
+    memset(status, 0, sizeof (*status));
+    for (i = 0; i < layout->count; i++) {
+        const ref_field_t *f = &layout->fields[i];
+        if (f->transform == REF_TRANSFORM_CONST) {
+            v = f->value;
+        } else {
+            v = f->read(&buf[f->offset]);
+            if (f->transform == REF_TRANSFORM_STARS) {
+                v = _get_user_jpeg_stars(p->model, v);
+            } else if (f->transform == REF_TRANSFORM_LENS_ID) {
+                v &= 0x0F;
+            }
+        }
+        if (f->status_size == 2) {
+            v16 = v;
+            memcpy((uint8_t *) status + f->status_offset, &v16, 2);
+        } else {
+            memcpy((uint8_t *) status + f->status_offset, &v, 4);
+        }
+    }
+}
+
+static double bench_nsec(struct timespec *start, struct timespec *end) {
+    return ((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec)) / BENCH_PARSES;
+}
+
+static const ref_layout_t *find_ref_layout(ipslr_status_parse_t parser) {
+    unsigned int i;
+    for (i = 0; i < sizeof (ref_layouts) / sizeof (ref_layouts[0]); i++) {
+        if (ref_layouts[i].parser == parser) {
+            return &ref_layouts[i];
+        }
+    }
+    return NULL;
+}
+
+static int bench_model(ipslr_model_info_t *model) {
+    char device[64];
+    pslr_handle_t h;
+    ipslr_handle_t *p;
+    const ref_layout_t *layout;
+    uint8_t recorded[MAX_STATUS_BUF_SIZE];
+    uint8_t last[MAX_STATUS_BUF_SIZE];
+    uint16_t changed[64];
+    pslr_status status;
+    pslr_status ref;
+    struct timespec t0, t1, t2, t3;
+    int update_failed = 0;
+    int failed = 0;
+    int i, j;
+
+    layout = find_ref_layout(model->status_parser_function);
+    if (layout == NULL) {
+        printf("%-12s no reference layout\n", model->name);
+        return 1;
+    }
+    snprintf(device, sizeof (device), "virtual:%s", model->name);
+    h = pslr_init(NULL, device);
+    if (h == NULL || pslr_connect(h) != PSLR_OK) {
+        printf("%-12s cannot connect to %s\n", model->name, device);
+        return 1;
+    }
+    p = (ipslr_handle_t *) h;
+    pslr_get_status(h, &status);
+    memcpy(recorded, p->status_buffer, MAX_STATUS_BUF_SIZE);
+
+    for (i = 0; i <= BENCH_RANDOM_BUFFERS; i++) {
+        if (i > 0) {
+            for (j = 0; j < MAX_STATUS_BUF_SIZE; j++) {
+                p->status_buffer[j] = rand();
+            }
+        }
+        model->status_parser_function(p, &status);
+        ref_status_parse(p, layout, &ref);
+        if (memcmp(&status, &ref, sizeof (status))) {
+            failed++;
+        }
+    }
+    memcpy(p->status_buffer, recorded, MAX_STATUS_BUF_SIZE);
+
+    model->status_parser_function(p, &status);
+    for (i = 0; i < BENCH_RANDOM_BUFFERS; i++) {
+        memcpy(last, p->status_buffer, MAX_STATUS_BUF_SIZE);
+        for (j = 0; j < BENCH_CHANGED_BYTES; j++) {
+            p->status_buffer[rand() % model->buffer_size] = rand();
+        }
+        ipslr_status_update(p, &status, last, changed, 64);
+        model->status_parser_function(p, &ref);
+        if (memcmp(&status, &ref, sizeof (status))) {
+            update_failed++;
+        }
+    }
+    memcpy(p->status_buffer, recorded, MAX_STATUS_BUF_SIZE);
+    memcpy(last, recorded, MAX_STATUS_BUF_SIZE);
+    last[model->buffer_size / 2] ^= 0xff;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < BENCH_PARSES; i++) {
+        ref_status_parse(p, layout, &bench_status);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < BENCH_PARSES; i++) {
+        model->status_parser_function(p, &bench_status);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    for (i = 0; i < BENCH_PARSES; i++) {
+        ipslr_status_update(p, &bench_status, last, changed, 64);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+    printf("%-12s %3d fields  pointer reads %6.1f ns  generated %6.1f ns  one byte update %6.1f ns  %s\n", model->name,
+           layout->count, bench_nsec(&t0, &t1), bench_nsec(&t1, &t2), bench_nsec(&t2, &t3),
+           failed ? "MISMATCH" : update_failed ? "UPDATE MISMATCH" : "ok");
+
+    pslr_disconnect(h);
+    pslr_shutdown(h);
+    return failed != 0 || update_failed != 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof (camera_models) / sizeof (camera_models[0]); i++) {
+        if (camera_models[i].status_parser_function != NULL) {
+            failed += bench_model(&camera_models[i]);
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+/*
+    pkTriggerCord
+    Copyright (C) 2011-2018 Andras Salamon <andras.salamon@melda.info>
+    Remote control of Pentax DSLR cameras.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    and GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+   Camera discovery benchmark on a fake sysfs tree. FAKE_ROOT is the
+   directory pslr_scsi.c was built for with PSLR_SYSFS=FAKE_ROOT/sys and
+   PSLR_DEV=FAKE_ROOT/dev. The tree gets hundreds of disks, some loop
+   devices without a SCSI device behind and one camera. Opening every
+   drive, as pslr_init did before the sysfs filter, is compared with
+   pslr_init.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../pslr.h"
+
+#ifndef FAKE_ROOT
+#error FAKE_ROOT has to be the fake root pslr_scsi.c was built for
+#endif
+
+#define SG_DISKS 400
+#define BLOCK_DISKS 400
+#define BLOCK_LOOPS 150
+#define SCANS 50
+
+bool debug = false;
+
+static void write_file(const char *path, const char *content) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(content, f);
+    fclose(f);
+}
+
+static void add_entry(const char *dir, const char *name, const char *vendor, const char *model) {
+    char path[512];
+
+    snprintf(path, sizeof (path), FAKE_ROOT "/sys/%s/%s", dir, name);
+    mkdir(path, 0755);
+    snprintf(path, sizeof (path), FAKE_ROOT "/dev/%s", name);
+    write_file(path, "");
+    if (vendor == NULL) {
+        return;
+    }
+    snprintf(path, sizeof (path), FAKE_ROOT "/sys/%s/%s/device", dir, name);
+    mkdir(path, 0755);
+    snprintf(path, sizeof (path), FAKE_ROOT "/sys/%s/%s/device/vendor", dir, name);
+    write_file(path, vendor);
+    snprintf(path, sizeof (path), FAKE_ROOT "/sys/%s/%s/device/model", dir, name);
+    write_file(path, model);
+}
+
+static void create_tree(void) {
+    char name[32];
+    int i;
+
+    mkdir(FAKE_ROOT, 0755);
+    mkdir(FAKE_ROOT "/sys", 0755);
+    mkdir(FAKE_ROOT "/sys/class", 0755);
+    mkdir(FAKE_ROOT "/sys/class/scsi_generic", 0755);
+    mkdir(FAKE_ROOT "/sys/block", 0755);
+    mkdir(FAKE_ROOT "/dev", 0755);
+    for (i = 0; i < SG_DISKS; i++) {
+        snprintf(name, sizeof (name), "sg%d", i);
+        add_entry("class/scsi_generic", name, "ATA     \n", "ST4000NM0035-1V4\n");
+    }
+    snprintf(name, sizeof (name), "sg%d", SG_DISKS);
+    add_entry("class/scsi_generic", name, "PENTAX  \n", "DIGITAL_CAMERA  \n");
+    for (i = 0; i < BLOCK_DISKS; i++) {
+        snprintf(name, sizeof (name), "sd%c%c", 'a' + i / 26, 'a' + i % 26);
+        add_entry("block", name, "ATA     \n", "ST4000NM0035-1V4\n");
+    }
+    for (i = 0; i < BLOCK_LOOPS; i++) {
+        snprintf(name, sizeof (name), "loop%d", i);
+        add_entry("block", name, NULL, NULL);
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftwbuf) {
+    return remove(path);
+}
+
+static double elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* enumeration as pslr_init did it without the sysfs filter */
+static int open_all_drives(int *opened) {
+    char vendorId[20];
+    char productId[20];
+    char **drives;
+    int driveNum;
+    int found = 0;
+    int fd;
+    int i;
+
+    *opened = 0;
+    drives = get_drives(&driveNum);
+    for (i = 0; i < driveNum; i++) {
+        if (get_drive_info(drives[i], &fd, vendorId, sizeof (vendorId), productId, sizeof (productId)) == PSLR_OK) {
+            ++*opened;
+            if (!strncmp(vendorId, "PENTAX", 6)) {
+                found++;
+            }
+            close_drive(&fd);
+        }
+        free(drives[i]);
+    }
+    free(drives);
+    return found;
+}
+
+static bool find_camera(void) {
+    pslr_handle_t h = pslr_init(NULL, NULL);
+    if (h == NULL) {
+        return false;
+    }
+    pslr_shutdown(h);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    struct timespec start;
+    double first, repeat;
+    int opened;
+    int found;
+    int i;
+
+    create_tree();
+    printf("fake sysfs: %d scsi_generic, %d block entries, one camera\n", SG_DISKS + 1, BLOCK_DISKS + BLOCK_LOOPS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    found = open_all_drives(&opened);
+    first = elapsed_ms(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < SCANS; i++) {
+        open_all_drives(&opened);
+    }
+    repeat = elapsed_ms(&start) / SCANS;
+    printf("open every drive: %d opens, %d camera, first %.2f ms, repeated %.2f ms\n", opened, found, first, repeat);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    found = find_camera();
+    first = elapsed_ms(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < SCANS; i++) {
+        found &= find_camera();
+    }
+    repeat = elapsed_ms(&start) / SCANS;
+    printf("pslr_init:        %s, first %.2f ms, repeated %.2f ms\n", found ? "camera found" : "NO CAMERA", first, repeat);
+
+    nftw(FAKE_ROOT, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return found ? 0 : 1;
+}